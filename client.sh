@@ -48,6 +48,8 @@ clean
 debug=3
 disabled=0
 server_persist_timeout=86400
+cniplist_path=$PWD/cniplist.set
+cniplist6_path=$PWD/cniplist6.set
 sproxy=1
 server 0 1.2.3.4:65535-e-T-U
 EOF
@@ -0,0 +1,212 @@
+/*
+ * cn_domain_build.h: key encoding and trie construction for the cn_domain
+ * trie, shared by natcap_client.c and the offline compiler
+ * natcapd/cn_domain_compile.c so that both produce the same layout.
+ *
+ * This file is part of the natcap.
+ *
+ * natcap is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef _CN_DOMAIN_BUILD_H_
+#define _CN_DOMAIN_BUILD_H_
+
+#include "natcap.h"
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#define cn_domain_alloc(size) vmalloc(size)
+#define cn_domain_free(p) vfree(p)
+#define cn_domain_sort(base, num, size, cmp) sort(base, num, size, cmp, NULL)
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#define cn_domain_alloc(size) malloc(size)
+#define cn_domain_free(p) free(p)
+#define cn_domain_sort(base, num, size, cmp) qsort(base, num, size, cmp)
+#endif
+
+/* keys are the labels in reverse order joined by CN_DOMAIN_SEP */
+#define CN_DOMAIN_SEP '\001'
+#define CN_DOMAIN_MAX_LABEL 63
+#define CN_DOMAIN_MAX_KEY 256
+
+/* "www.baidu.com" -> "com\001baidu\001www" */
+static int cn_domain_key_encode(char *key, const char *d, int len)
+{
+	int klen = 0;
+	int end = len;
+
+	while (end > 0) {
+		int start = end;
+		while (start > 0 && d[start - 1] != '.')
+			start--;
+		if (end - start > CN_DOMAIN_MAX_LABEL)
+			return -EINVAL;
+		if (end > start) {
+			if (klen + (klen ? 1 : 0) + (end - start) >= CN_DOMAIN_MAX_KEY)
+				return -EINVAL;
+			if (klen)
+				key[klen++] = CN_DOMAIN_SEP;
+			memcpy(key + klen, d + start, end - start);
+			klen += end - start;
+		}
+		end = start - 1;
+	}
+
+	return klen;
+}
+
+/* number of whole labels shared by two encoded keys */
+static unsigned int cn_domain_key_lcp(const char *a, const char *b)
+{
+	unsigned int n = 0;
+	int i;
+
+	for (i = 0; a[i] == b[i]; i++) {
+		if (a[i] == 0)
+			return n + 1;
+		if (a[i] == CN_DOMAIN_SEP)
+			n++;
+	}
+	if ((a[i] == 0 || a[i] == CN_DOMAIN_SEP) && (b[i] == 0 || b[i] == CN_DOMAIN_SEP))
+		n++;
+
+	return n;
+}
+
+static unsigned int cn_domain_key_labels(const char *k)
+{
+	unsigned int n = 1;
+
+	for (; *k; k++) {
+		if (*k == CN_DOMAIN_SEP)
+			n++;
+	}
+	return n;
+}
+
+static int cn_domain_key_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static unsigned int cn_domain_label_len(const char *k)
+{
+	unsigned int n = 0;
+
+	while (k[n] != 0 && k[n] != CN_DOMAIN_SEP)
+		n++;
+	return n;
+}
+
+/* sort the keys and lay the trie out breadth first, so every node's children are contiguous and sorted.
+ * keys[] is reordered in place; returns 0 and the trie in *tp, or a negative errno */
+static int cn_domain_trie_build(const char **keys, unsigned int nkeys, struct cn_domain_trie **tp)
+{
+	struct cn_domain_trie *t;
+	struct cn_domain_node *node;
+	unsigned int *cur;
+	char *pool;
+	unsigned int count = 0;
+	unsigned int node_count = 1;
+	unsigned int pool_size = 0;
+	unsigned int i, j, n, pos;
+
+	cn_domain_sort(keys, nkeys, sizeof(char *), cn_domain_key_cmp);
+
+	/* drop duplicates and the subdomains of a domain already listed */
+	for (i = 0; i < nkeys; i++) {
+		if (count > 0) {
+			unsigned int len = strlen(keys[count - 1]);
+			if (strncmp(keys[count - 1], keys[i], len) == 0 && (keys[i][len] == 0 || keys[i][len] == CN_DOMAIN_SEP))
+				continue;
+			n = cn_domain_key_lcp(keys[count - 1], keys[i]);
+		} else {
+			n = 0;
+		}
+		node_count += cn_domain_key_labels(keys[i]) - n;
+		for (pos = 0, j = 0; keys[i][pos] != 0; pos++) {
+			if (j >= n && keys[i][pos] != CN_DOMAIN_SEP)
+				pool_size++;
+			if (keys[i][pos] == CN_DOMAIN_SEP)
+				j++;
+		}
+		keys[count++] = keys[i];
+	}
+
+	if (pool_size > CN_DOMAIN_LABEL_OFF_MASK)
+		return -E2BIG;
+
+	cur = cn_domain_alloc((count + 1) * sizeof(unsigned int));
+	if (cur == NULL)
+		return -ENOMEM;
+	memset(cur, 0, (count + 1) * sizeof(unsigned int));
+
+	t = cn_domain_alloc(sizeof(struct cn_domain_trie) + node_count * sizeof(struct cn_domain_node) + pool_size);
+	if (t == NULL) {
+		cn_domain_free(cur);
+		return -ENOMEM;
+	}
+	t->magic = CN_DOMAIN_MAGIC;
+	t->version = CN_DOMAIN_VERSION;
+	t->count = count;
+	t->node_count = node_count;
+	t->reserved = 0;
+	t->pool_size = pool_size;
+	pool = cn_domain_trie_pool(t);
+
+	/* child/nchild of an unprocessed node temporarily hold its key range */
+	t->nodes[0].label = 0;
+	t->nodes[0].child = 0;
+	t->nodes[0].nchild = count;
+
+	pos = 0;
+	for (i = 1, n = 0; n < i; n++) {
+		unsigned int lo, hi, end = 0;
+
+		node = &t->nodes[n];
+		lo = node->child;
+		hi = node->nchild;
+
+		if (lo < hi && keys[lo][cur[lo]] == 0) {
+			end = CN_DOMAIN_NODE_END;
+			lo++;
+		}
+
+		node->child = i;
+		while (lo < hi) {
+			const char *label = keys[lo] + cur[lo];
+			unsigned int len = cn_domain_label_len(label);
+			struct cn_domain_node *child = &t->nodes[i++];
+
+			memcpy(pool + pos, label, len);
+			child->label = (len << CN_DOMAIN_LABEL_LEN_SHIFT) | pos;
+			child->child = lo;
+			pos += len;
+
+			for (j = lo; j < hi; j++) {
+				const char *k = keys[j] + cur[j];
+				if (strncmp(k, label, len) != 0 || (k[len] != 0 && k[len] != CN_DOMAIN_SEP))
+					break;
+				cur[j] += len + (k[len] == CN_DOMAIN_SEP ? 1 : 0);
+			}
+			child->nchild = j;
+			lo = j;
+		}
+		node->nchild = (i - node->child) | end;
+	}
+
+	cn_domain_free(cur);
+
+	*tp = t;
+	return 0;
+}
+
+#endif /* _CN_DOMAIN_BUILD_H_ */
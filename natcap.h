@@ -28,6 +28,7 @@
 #include <linux/ctype.h>
 #include <linux/types.h>
 #include <linux/socket.h>
+#include <linux/in6.h>
 #include <asm/byteorder.h>
 #include <asm/types.h>
 #include <net/netfilter/nf_conntrack.h>
@@ -152,11 +153,6 @@ struct natcap_TCPOPT {
 #define NATCAP_TCPOPT_TYPE_ADD 5
 };
 
-struct cone_nat_session {
-	__be32 ip;
-	__be16 port;
-};
-
 struct cone_snat_session {
 	__be32 lan_ip;
 	__be32 wan_ip;
@@ -180,6 +176,27 @@ struct tuple3 {
 	__be16 sport;
 };
 
+/* per path estimates of the client multipath scheduler */
+struct peer_path {
+	unsigned short lag; //EWMA of ms behind the first copy, <<3
+	unsigned char loss; //EWMA, 255 = 100%
+	unsigned char rx; //copies received in the current share window
+	short wrr; //smooth weighted round robin credit
+};
+
+/* a recently received segment, the copies of it coming in on slower paths are dropped */
+struct peer_dup {
+	__be32 seq;
+	unsigned short ack; //low 16 bits of ack_seq
+	unsigned short win;
+	unsigned short ms;
+	unsigned char path;
+#define PEER_DUP_USED 0x1
+#define PEER_DUP_SEEN 0x2
+#define PEER_DUP_DIRECT 0x4
+	unsigned char flags;
+};
+
 struct natcap_session {
 #define NS_NATCAP_CONFUSION_BIT 0
 #define NS_NATCAP_CONFUSION (1 << NS_NATCAP_CONFUSION_BIT)
@@ -206,6 +223,8 @@ struct natcap_session {
 #define NS_NATCAP_ENC_BIT 15
 #define NS_NATCAP_ENC (1 << NS_NATCAP_ENC_BIT)
 
+#define NS_PEER_MP_BIT 10
+#define NS_PEER_MP (1 << NS_PEER_MP_BIT)
 #define NS_PEER_SSYN_BIT 11
 #define NS_PEER_SSYN (1 << NS_PEER_SSYN_BIT)
 #define NS_PEER_KNOCK_BIT 12
@@ -241,6 +260,9 @@ struct natcap_session {
 			int tcp_seq_offset;
 		} p;
 	};
+	unsigned short user_idx; //per user speed limit slot, 0: not looked up yet
+	unsigned short syn_ms; //client: low 16 bits of msecs the SYN to server went out, 0: no SYN pending
+	unsigned int ipset_cache; //per-ct ipset verdicts: gen << 16 | tested << 8 | result, see IP_SET_test_cached()
 
 #define MAX_PEER_NUM 16
 	unsigned int peer_jiffies;
@@ -249,7 +271,17 @@ struct natcap_session {
 	         peer_idx:7;
 	unsigned char peer_cnt:5,
 	         peer_req_cnt:3;
+};
+
+/* peer multipath state, only allocated right behind the natcap_session of the
+ * TCPUDPENC flows, see natcap_session_mp() */
+struct natcap_session_mp {
 	struct tuple3 peer_tuple3[MAX_PEER_NUM];
+	struct peer_path peer_path[MAX_PEER_NUM + 1]; //[MAX_PEER_NUM] is the direct path
+#define PEER_DUP_RING 8
+	struct peer_dup peer_dup[PEER_DUP_RING];
+	unsigned char peer_dup_idx;
+	unsigned char peer_rx_total;
 };
 
 #define NATCAP_MAGIC 0x43415099
@@ -426,4 +458,32 @@ static inline unsigned char ucharmindiff(unsigned char a, unsigned char b)
 
 #define MAX_IOCTL_LEN 256
 
+/* cn_domain reversed-label trie, shared with the offline compiler natcapd/cn_domain_compile */
+#define CN_DOMAIN_MAGIC 0x4e44434e
+#define CN_DOMAIN_VERSION 1
+
+struct cn_domain_node {
+	unsigned int label; /* (label len << 24) | label offset in the pool */
+	unsigned int child; /* index of the first child, siblings are sorted */
+	unsigned int nchild; /* child count | CN_DOMAIN_NODE_END */
+};
+#define CN_DOMAIN_LABEL_LEN_SHIFT 24
+#define CN_DOMAIN_LABEL_OFF_MASK 0x00ffffff
+#define CN_DOMAIN_LABEL_LEN(n) ((n)->label >> CN_DOMAIN_LABEL_LEN_SHIFT)
+#define CN_DOMAIN_LABEL_OFF(n) ((n)->label & CN_DOMAIN_LABEL_OFF_MASK)
+#define CN_DOMAIN_NODE_END 0x80000000
+#define CN_DOMAIN_NCHILD(n) ((n)->nchild & ~CN_DOMAIN_NODE_END)
+
+/* header, nodes[node_count], then the label pool: the in-kernel generation and the blob file are the same bytes */
+struct cn_domain_trie {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	unsigned int node_count;
+	unsigned int pool_size;
+	unsigned int reserved;
+	struct cn_domain_node nodes[0];
+};
+#define cn_domain_trie_pool(t) ((char *)&(t)->nodes[(t)->node_count])
+
 #endif /* _NATCAP_H_ */
@@ -23,6 +23,7 @@
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/if_arp.h>
+#include <linux/inet.h>
 #include <linux/init.h>
 #include <linux/ip.h>
 #include <linux/kernel.h>
@@ -36,6 +37,13 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/rcupdate.h>
+#include <linux/jhash.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_helper.h>
 #include <net/netfilter/nf_conntrack_acct.h>
@@ -44,11 +52,17 @@
 #include "natcap_client.h"
 #include "natcap_knock.h"
 #include "natcap_peer.h"
+#include "cn_domain_build.h"
 
 #define CN_DOMAIN_SIZE 32
-static char *cn_domain = NULL;
-static int cn_domain_size = 0;
-static int cn_domain_count = 0;
+
+/* TCPUDPENC has to cut gso skbs before the tcp->udp rewrite. keep the payload in the
+ * original frags and leave the checksums to the device: the inner tcp checksum is
+ * recomputed by the server and the outer udp one stays CHECKSUM_PARTIAL */
+#define NATCAP_GSO_FEATURES (NETIF_F_SG | NETIF_F_HW_CSUM)
+
+/* cn_domain is a reversed-label trie: "www.baidu.com" is walked as com -> baidu -> www */
+static struct cn_domain_trie __rcu *cn_domain = NULL;
 
 unsigned int server_index_natcap_mask = 0x00000000;
 #define server_index_natcap_set(index, at) *(unsigned int *)(at) = ((*(unsigned int *)(at)) & (~server_index_natcap_mask)) | ((index) & server_index_natcap_mask)
@@ -71,6 +85,27 @@ static inline int server_index_natcap_get(unsigned int *at)
 unsigned int peer_multipath = 4;
 unsigned int dns_proxy_drop = 0;
 unsigned int server_persist_lock = 0;
+/* NATCAP_SERVER_SELECT_CURRENT: all flows use the current server
+ * NATCAP_SERVER_SELECT_HASH: flows are spread by dst ip over a consistent hash
+ * NATCAP_SERVER_SELECT_RTT: power of two choices over the server health estimates
+ */
+unsigned int server_select_mode = NATCAP_SERVER_SELECT_CURRENT;
+const char *server_select_mode_str[NATCAP_SERVER_SELECT_MAX] = {
+	[NATCAP_SERVER_SELECT_CURRENT] = "current",
+	[NATCAP_SERVER_SELECT_HASH] = "hash",
+	[NATCAP_SERVER_SELECT_RTT] = "rtt",
+};
+/* NATCAP_PEER_MULTIPATH_RR: every segment goes direct, a copy goes to the relays in turn
+ * NATCAP_PEER_MULTIPATH_RTT: every segment goes direct, a copy goes to the relay lagging least
+ * NATCAP_PEER_MULTIPATH_WRR: small segments as in rtt, bulk is spread over the direct path and
+ *                            the relays by weighted round robin instead of being copied
+ */
+unsigned int peer_multipath_mode = NATCAP_PEER_MULTIPATH_RTT;
+const char *peer_multipath_mode_str[NATCAP_PEER_MULTIPATH_MAX] = {
+	[NATCAP_PEER_MULTIPATH_RR] = "rr",
+	[NATCAP_PEER_MULTIPATH_RTT] = "rtt",
+	[NATCAP_PEER_MULTIPATH_WRR] = "wrr",
+};
 unsigned int server_persist_timeout = 0;
 module_param(server_persist_timeout, int, 0);
 MODULE_PARM_DESC(server_persist_timeout, "Use diffrent server after timeout");
@@ -82,31 +117,56 @@ static int natcap_tx_speed = 0;
 static int natcap_rx_speed = 0;
 static struct natcap_token_ctrl tx_ntc;
 static struct natcap_token_ctrl rx_ntc;
-static void natcap_ntc_init(struct natcap_token_ctrl *ntc)
+/* each cpu spends a local credit and borrows batch tokens from the shared pool when it runs dry */
+#define NATCAP_TOKEN_BATCH_MIN 2048
+#define NATCAP_TOKEN_BATCH_MAX 65536
+
+static int natcap_ntc_init(struct natcap_token_ctrl *ntc)
 {
-	spin_lock_init(&ntc->lock);
-	ntc->tokens = 0;
+	atomic_set(&ntc->tokens, 0);
 	ntc->tokens_per_jiffy = 0;
+	ntc->batch = NATCAP_TOKEN_BATCH_MIN;
 	ntc->jiffies = 0;
+	ntc->local = alloc_percpu(int);
+	if (ntc->local == NULL) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void natcap_ntc_exit(struct natcap_token_ctrl *ntc)
+{
+	ntc->tokens_per_jiffy = 0;
+	if (ntc->local) {
+		free_percpu(ntc->local);
+		ntc->local = NULL;
+	}
+}
+
+static void natcap_ntc_set(struct natcap_token_ctrl *ntc, int speed)
+{
+	int cpu;
+
+	ntc->tokens_per_jiffy = speed / HZ;
+	ntc->batch = clamp_t(int, ntc->tokens_per_jiffy / 4, NATCAP_TOKEN_BATCH_MIN, NATCAP_TOKEN_BATCH_MAX);
+	atomic_set(&ntc->tokens, 0);
+	if (ntc->local) {
+		for_each_possible_cpu(cpu) {
+			*per_cpu_ptr(ntc->local, cpu) = 0;
+		}
+	}
+	ntc->jiffies = jiffies;
 }
 
 void natcap_tx_speed_set(int speed)
 {
 	natcap_tx_speed = speed;
-	spin_lock_bh(&tx_ntc.lock);
-	tx_ntc.tokens = 0;
-	tx_ntc.tokens_per_jiffy = natcap_tx_speed / HZ;
-	tx_ntc.jiffies = jiffies;
-	spin_unlock_bh(&tx_ntc.lock);
+	natcap_ntc_set(&tx_ntc, speed);
 }
 void natcap_rx_speed_set(int speed)
 {
 	natcap_rx_speed = speed;
-	spin_lock_bh(&rx_ntc.lock);
-	rx_ntc.tokens = 0;
-	rx_ntc.tokens_per_jiffy = natcap_rx_speed / HZ;
-	rx_ntc.jiffies = jiffies;
-	spin_unlock_bh(&rx_ntc.lock);
+	natcap_ntc_set(&rx_ntc, speed);
 }
 
 int natcap_tx_speed_get(void)
@@ -118,11 +178,62 @@ int natcap_rx_speed_get(void)
 	return natcap_rx_speed;
 }
 
-static int natcap_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct, struct natcap_token_ctrl *ntc)
+/* take n tokens from the shared pool unless it is already in debt */
+static int natcap_ntc_borrow(struct natcap_token_ctrl *ntc, int n)
+{
+	int old;
+
+	for (;;) {
+		old = atomic_read(&ntc->tokens);
+		if (old <= 0)
+			return 0;
+		if (atomic_cmpxchg(&ntc->tokens, old, old - n) == old)
+			return 1;
+	}
+}
+
+/* only the cpu that wins the jiffies cmpxchg feeds the elapsed tokens */
+static void natcap_ntc_refill(struct natcap_token_ctrl *ntc)
+{
+	unsigned long last_jiffies = ntc->jiffies;
+	unsigned long current_jiffies = jiffies;
+	unsigned long feed_jiffies;
+	int feed, old, new;
+
+	if (current_jiffies > last_jiffies) {
+		feed_jiffies = current_jiffies - last_jiffies;
+	} else {
+		feed_jiffies = last_jiffies - current_jiffies;
+	}
+	if (feed_jiffies == 0) {
+		return;
+	}
+	if (cmpxchg(&ntc->jiffies, last_jiffies, current_jiffies) != last_jiffies) {
+		return;
+	}
+	if (feed_jiffies > 64 * HZ) {
+		feed_jiffies = 64 * HZ;
+	}
+
+	feed = (int)(ntc->tokens_per_jiffy * feed_jiffies);
+	if (feed_jiffies <= HZ) {
+		atomic_add(feed, &ntc->tokens);
+		return;
+	}
+
+	/* idle for a while: pay back the debt but do not save up a burst */
+	do {
+		old = atomic_read(&ntc->tokens);
+		new = old + feed;
+		if (new > 0) {
+			new = 0;
+		}
+	} while (atomic_cmpxchg(&ntc->tokens, old, new) != old);
+}
+
+/* payload bytes charged to the speed limit, 0 for packets we never limit */
+static int natcap_flow_len(struct sk_buff *skb, struct nf_conn *ct)
 {
-	unsigned long feed_jiffies = 0;
-	unsigned long current_jiffies;
-	int ret = 0;
 	int len = skb->len;
 	struct iphdr *iph = ip_hdr(skb);
 	void *l4 = (void *)iph + iph->ihl * 4;
@@ -141,58 +252,380 @@ static int natcap_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct, struct natc
 		len -= iph->ihl * 4 + sizeof(struct udphdr);
 		break;
 	}
-	if (len <= 0) {
+	return len > 0 ? len : 0;
+}
+
+static int natcap_flow_ctrl(struct natcap_token_ctrl *ntc, int len)
+{
+	int ret = 0;
+	int *local;
+
+	if (ntc->tokens_per_jiffy == 0) {
 		return 0;
 	}
-	if (ntc->tokens_per_jiffy == 0) {
+
+	if (ntc->local == NULL) {
+		/* a per user bucket only sees that user's flows, spend the pool directly */
+		if (!natcap_ntc_borrow(ntc, len)) {
+			natcap_ntc_refill(ntc);
+			if (!natcap_ntc_borrow(ntc, len)) {
+				return -1;
+			}
+		}
 		return 0;
 	}
 
-	spin_lock_bh(&ntc->lock);
-	if (ntc->tokens > 0) {
-		ntc->tokens -= len;
-		ret = 0;
-		goto out;
+	local_bh_disable();
+	local = this_cpu_ptr(ntc->local);
+	if (*local <= 0) {
+		if (!natcap_ntc_borrow(ntc, ntc->batch)) {
+			natcap_ntc_refill(ntc);
+			if (!natcap_ntc_borrow(ntc, ntc->batch)) {
+				ret = -1;
+				goto out;
+			}
+		}
+		*local += ntc->batch;
 	}
+	*local -= len;
 
-	current_jiffies = jiffies;
-	if (current_jiffies > ntc->jiffies) {
-		feed_jiffies = current_jiffies - ntc->jiffies;
-	} else {
-		feed_jiffies = ntc->jiffies - current_jiffies;
+out:
+	local_bh_enable();
+	return ret;
+}
+
+/* per user speed limit: one tx/rx bucket pair per source mac or source ip */
+#define NATCAP_USER_MAX 4096
+#define NATCAP_USER_HASH_SIZE 1024
+#define NATCAP_USER_NONE 0xffff
+/* ns->user_idx is the slot in the low 12 bits and a generation of the slot in the high 4 bits,
+ * so a ct whose user got reclaimed does not charge whoever took the slot over */
+#define NATCAP_USER_SLOT_MASK (NATCAP_USER_MAX - 1)
+#define NATCAP_USER_GEN_SHIFT 12
+#define NATCAP_USER_IDLE_TIME (300 * HZ)
+
+struct natcap_user {
+	struct natcap_user __rcu *next;
+	struct rcu_head rcu;
+	unsigned long jiffies; /* last packet seen */
+	unsigned char key[ETH_ALEN];
+	unsigned char mode;
+	unsigned char fixed; /* speed set by user_speed_limit= instead of the defaults */
+	unsigned short idx;
+	struct natcap_token_ctrl tx;
+	struct natcap_token_ctrl rx;
+};
+
+unsigned int natcap_user_mode = NATCAP_USER_MODE_NONE;
+const char *natcap_user_mode_str[NATCAP_USER_MODE_MAX] = {
+	[NATCAP_USER_MODE_NONE] = "none",
+	[NATCAP_USER_MODE_MAC] = "mac",
+	[NATCAP_USER_MODE_IP] = "ip"
+};
+
+static int natcap_user_tx_speed = 0;
+static int natcap_user_rx_speed = 0;
+static unsigned int natcap_user_count = 0;
+static unsigned int natcap_user_next = 1;
+static unsigned long natcap_user_gc_jiffies = 0;
+static DEFINE_SPINLOCK(natcap_user_lock);
+/* slot 0 is never used: a zeroed session means not looked up yet.
+ * the last slot is never used either, NATCAP_USER_NONE would alias it */
+static struct natcap_user __rcu *natcap_user_slot[NATCAP_USER_MAX];
+static unsigned char natcap_user_gen[NATCAP_USER_MAX];
+static struct natcap_user __rcu *natcap_user_hash[NATCAP_USER_HASH_SIZE];
+
+static inline unsigned int natcap_user_hashfn(const unsigned char *key, unsigned int mode)
+{
+	return jhash(key, ETH_ALEN, mode) % NATCAP_USER_HASH_SIZE;
+}
+
+static struct natcap_user *natcap_user_find(const unsigned char *key, unsigned int mode, unsigned int hash)
+{
+	struct natcap_user *user;
+
+	rcu_read_lock();
+	for (user = rcu_dereference(natcap_user_hash[hash]); user; user = rcu_dereference(user->next)) {
+		if (user->mode == mode && memcmp(user->key, key, ETH_ALEN) == 0) {
+			break;
+		}
 	}
-	if (feed_jiffies > 64 * HZ) {
-		feed_jiffies = 64 * HZ;
+	rcu_read_unlock();
+
+	return user;
+}
+
+/* called with natcap_user_lock held */
+static void natcap_user_drop(struct natcap_user *user)
+{
+	unsigned int hash = natcap_user_hashfn(user->key, user->mode);
+	unsigned int slot = user->idx & NATCAP_USER_SLOT_MASK;
+	struct natcap_user __rcu **pprev = &natcap_user_hash[hash];
+	struct natcap_user *pos;
+
+	while ((pos = rcu_dereference_protected(*pprev, lockdep_is_held(&natcap_user_lock))) != NULL) {
+		if (pos == user) {
+			rcu_assign_pointer(*pprev, rcu_dereference_protected(user->next, lockdep_is_held(&natcap_user_lock)));
+			break;
+		}
+		pprev = &pos->next;
 	}
+	RCU_INIT_POINTER(natcap_user_slot[slot], NULL);
+	natcap_user_gen[slot]++;
+	natcap_user_count--;
 
-	ret = ntc->tokens + (int)(ntc->tokens_per_jiffy * feed_jiffies);
+	kfree_rcu(user, rcu);
+}
 
-	if (feed_jiffies <= HZ) {
-		ntc->tokens = ret;
-	} else {
-		if (ret <= 0) {
-			ntc->tokens = ret;
-		} else {
-			ntc->tokens = 0;
+/* called with natcap_user_lock held, the users set by user_speed_limit= are kept */
+static void natcap_user_gc(void)
+{
+	unsigned int i;
+	struct natcap_user *user;
+
+	for (i = 1; i < NATCAP_USER_MAX - 1; i++) {
+		user = rcu_dereference_protected(natcap_user_slot[i], lockdep_is_held(&natcap_user_lock));
+		if (!user || user->fixed || time_before(jiffies, user->jiffies + NATCAP_USER_IDLE_TIME)) {
+			continue;
+		}
+		natcap_user_drop(user);
+	}
+}
+
+/* called with natcap_user_lock held, the user stays valid until it is released */
+static struct natcap_user *__natcap_user_get(const unsigned char *key, unsigned int mode, unsigned int hash)
+{
+	unsigned int i, slot = 0;
+	struct natcap_user *user;
+
+	user = natcap_user_find(key, mode, hash);
+	if (user) {
+		return user;
+	}
+	if (natcap_user_count >= NATCAP_USER_MAX - 2) {
+		/* full: reclaim the idle users, at most once a second */
+		if (time_before(jiffies, natcap_user_gc_jiffies + HZ)) {
+			return NULL;
+		}
+		natcap_user_gc_jiffies = jiffies;
+		natcap_user_gc();
+		if (natcap_user_count >= NATCAP_USER_MAX - 2) {
+			return NULL;
 		}
 	}
+	user = kzalloc(sizeof(struct natcap_user), GFP_ATOMIC);
+	if (!user) {
+		return NULL;
+	}
 
-	if (ntc->tokens >= 0) {
-		ntc->tokens -= len;
-		ret = 0;
+	for (i = 0; i < NATCAP_USER_MAX - 2; i++) {
+		slot = natcap_user_next;
+		natcap_user_next = natcap_user_next + 1 >= NATCAP_USER_MAX - 1 ? 1 : natcap_user_next + 1;
+		if (rcu_access_pointer(natcap_user_slot[slot]) == NULL) {
+			break;
+		}
 	}
-	ntc->jiffies = current_jiffies;
 
-out:
-	spin_unlock_bh(&ntc->lock);
+	memcpy(user->key, key, ETH_ALEN);
+	user->mode = mode;
+	user->jiffies = jiffies;
+	user->idx = slot | ((natcap_user_gen[slot] & 0xf) << NATCAP_USER_GEN_SHIFT);
+	natcap_ntc_set(&user->tx, natcap_user_tx_speed);
+	natcap_ntc_set(&user->rx, natcap_user_rx_speed);
+	natcap_user_count++;
+
+	RCU_INIT_POINTER(user->next, natcap_user_hash[hash]);
+	rcu_assign_pointer(natcap_user_slot[slot], user);
+	rcu_assign_pointer(natcap_user_hash[hash], user);
+
+	return user;
+}
+
+/* the caller runs under rcu (the hooks), a user may be dropped as soon as the lock is released */
+static struct natcap_user *natcap_user_get(const unsigned char *key, unsigned int mode)
+{
+	unsigned int hash = natcap_user_hashfn(key, mode);
+	struct natcap_user *user;
+
+	user = natcap_user_find(key, mode, hash);
+	if (user) {
+		return user;
+	}
+
+	spin_lock_bh(&natcap_user_lock);
+	user = __natcap_user_get(key, mode, hash);
+	spin_unlock_bh(&natcap_user_lock);
+
+	return user;
+}
+
+/* look the user up once per ct on an original direction packet and cache the slot in ns */
+static void natcap_user_attach(struct sk_buff *skb, const struct net_device *in, struct nf_conn *ct, struct natcap_session *ns)
+{
+	unsigned char key[ETH_ALEN] = { };
+	unsigned int mode = natcap_user_mode;
+	struct natcap_user *user;
+
+	switch (mode) {
+	case NATCAP_USER_MODE_MAC:
+		if (!in || in->type != ARPHRD_ETHER || !skb_mac_header_was_set(skb)) {
+			ns->user_idx = NATCAP_USER_NONE;
+			return;
+		}
+		memcpy(key, eth_hdr(skb)->h_source, ETH_ALEN);
+		break;
+	case NATCAP_USER_MODE_IP:
+		memcpy(key, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, sizeof(__be32));
+		break;
+	default:
+		return;
+	}
+
+	user = natcap_user_get(key, mode);
+	if (!user) {
+		NATCAP_WARN("user table full(%u), no per user speed limit for %pI4\n", NATCAP_USER_MAX - 2, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip);
+		ns->user_idx = NATCAP_USER_NONE;
+		return;
+	}
+	ns->user_idx = user->idx;
+}
+
+static inline struct natcap_user *natcap_user_of(struct natcap_session *ns)
+{
+	struct natcap_user *user;
+
+	if (ns->user_idx == 0 || ns->user_idx == NATCAP_USER_NONE) {
+		return NULL;
+	}
+	user = rcu_dereference(natcap_user_slot[ns->user_idx & NATCAP_USER_SLOT_MASK]);
+	if (!user || user->idx != ns->user_idx) {
+		/* reclaimed or flushed, look it up again on the next original direction packet */
+		ns->user_idx = 0;
+		return NULL;
+	}
+	if (user->jiffies != jiffies) {
+		user->jiffies = jiffies;
+	}
+	return user;
+}
+
+static void natcap_user_speed_update(void)
+{
+	unsigned int i;
+	struct natcap_user *user;
+
+	spin_lock_bh(&natcap_user_lock);
+	for (i = 1; i < NATCAP_USER_MAX - 1; i++) {
+		user = rcu_dereference_protected(natcap_user_slot[i], lockdep_is_held(&natcap_user_lock));
+		if (!user || user->fixed) {
+			continue;
+		}
+		natcap_ntc_set(&user->tx, natcap_user_tx_speed);
+		natcap_ntc_set(&user->rx, natcap_user_rx_speed);
+	}
+	spin_unlock_bh(&natcap_user_lock);
+}
+
+void natcap_user_tx_speed_set(int speed)
+{
+	natcap_user_tx_speed = speed;
+	natcap_user_speed_update();
+}
+void natcap_user_rx_speed_set(int speed)
+{
+	natcap_user_rx_speed = speed;
+	natcap_user_speed_update();
+}
+
+int natcap_user_tx_speed_get(void)
+{
+	return natcap_user_tx_speed;
+}
+int natcap_user_rx_speed_get(void)
+{
+	return natcap_user_rx_speed;
+}
+
+unsigned int natcap_user_count_get(void)
+{
+	return natcap_user_count;
+}
+
+/* the users keyed on the other mode can never match again, drop them */
+void natcap_user_mode_set(unsigned int mode)
+{
+	unsigned int i;
+	struct natcap_user *user;
+
+	spin_lock_bh(&natcap_user_lock);
+	natcap_user_mode = mode;
+	for (i = 1; i < NATCAP_USER_MAX - 1; i++) {
+		user = rcu_dereference_protected(natcap_user_slot[i], lockdep_is_held(&natcap_user_lock));
+		if (user && user->mode != mode) {
+			natcap_user_drop(user);
+		}
+	}
+	spin_unlock_bh(&natcap_user_lock);
+}
+
+/* key is a mac for NATCAP_USER_MODE_MAC, or a __be32 ip in the first 4 bytes for NATCAP_USER_MODE_IP */
+int natcap_user_speed_limit(const unsigned char *key, unsigned int mode, int tx_speed, int rx_speed)
+{
+	struct natcap_user *user;
+	int ret = 0;
+
+	/* look up and set under the lock: gc, clean or a mode change may drop the user otherwise */
+	spin_lock_bh(&natcap_user_lock);
+	user = __natcap_user_get(key, mode, natcap_user_hashfn(key, mode));
+	if (user) {
+		user->fixed = 1;
+		natcap_ntc_set(&user->tx, tx_speed);
+		natcap_ntc_set(&user->rx, rx_speed);
+	} else {
+		ret = -ENOSPC;
+	}
+	spin_unlock_bh(&natcap_user_lock);
+
 	return ret;
 }
 
-static inline int natcap_tx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct)
+/* drop the explicit limits and the whole table, every user comes back at the default speed */
+void natcap_user_speed_clean(void)
+{
+	unsigned int i;
+	struct natcap_user *user;
+
+	spin_lock_bh(&natcap_user_lock);
+	for (i = 1; i < NATCAP_USER_MAX - 1; i++) {
+		user = rcu_dereference_protected(natcap_user_slot[i], lockdep_is_held(&natcap_user_lock));
+		if (user) {
+			natcap_user_drop(user);
+		}
+	}
+	spin_unlock_bh(&natcap_user_lock);
+}
+
+static void natcap_user_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NATCAP_USER_HASH_SIZE; i++) {
+		RCU_INIT_POINTER(natcap_user_hash[i], NULL);
+	}
+	for (i = 1; i < NATCAP_USER_MAX - 1; i++) {
+		kfree(rcu_dereference_protected(natcap_user_slot[i], 1));
+		RCU_INIT_POINTER(natcap_user_slot[i], NULL);
+	}
+	natcap_user_count = 0;
+}
+
+static inline int natcap_tx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct, struct natcap_session *ns)
 {
+	int len;
 	struct nf_conn_acct *acct;
+	struct natcap_user *user = natcap_user_of(ns);
 
-	if (tx_ntc.tokens_per_jiffy == 0) {
+	if (tx_ntc.tokens_per_jiffy == 0 && (!user || user->tx.tokens_per_jiffy == 0)) {
 		return 0;
 	}
 	if (tx_pkts_threshold != 0) {
@@ -205,13 +638,26 @@ static inline int natcap_tx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct)
 			}
 		}
 	}
-	return natcap_flow_ctrl(skb, ct, &tx_ntc);
+	len = natcap_flow_len(skb, ct);
+	if (len == 0) {
+		return 0;
+	}
+	/* only charge the user for what the shared pool lets through */
+	if (natcap_flow_ctrl(&tx_ntc, len) < 0) {
+		return -1;
+	}
+	if (user && natcap_flow_ctrl(&user->tx, len) < 0) {
+		return -1;
+	}
+	return 0;
 }
-static inline int natcap_rx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct)
+static inline int natcap_rx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct, struct natcap_session *ns)
 {
+	int len;
 	struct nf_conn_acct *acct;
+	struct natcap_user *user = natcap_user_of(ns);
 
-	if (rx_ntc.tokens_per_jiffy == 0) {
+	if (rx_ntc.tokens_per_jiffy == 0 && (!user || user->rx.tokens_per_jiffy == 0)) {
 		return 0;
 	}
 	if (rx_pkts_threshold != 0) {
@@ -224,7 +670,18 @@ static inline int natcap_rx_flow_ctrl(struct sk_buff *skb, struct nf_conn *ct)
 			}
 		}
 	}
-	return natcap_flow_ctrl(skb, ct, &rx_ntc);
+	len = natcap_flow_len(skb, ct);
+	if (len == 0) {
+		return 0;
+	}
+	/* only charge the user for what the shared pool lets through */
+	if (natcap_flow_ctrl(&rx_ntc, len) < 0) {
+		return -1;
+	}
+	if (user && natcap_flow_ctrl(&user->rx, len) < 0) {
+		return -1;
+	}
+	return 0;
 }
 
 unsigned int cnipwhitelist_mode = 0;
@@ -308,158 +765,449 @@ static inline void get_dns_proxy_server(__be16 port, struct tuple *dst)
 	}
 }
 
-#define MAX_NATCAP_SERVER 128
+#define MAX_NATCAP_SERVER 4096
+
+struct natcap_server_node {
+	struct tuple server;
+	unsigned long last_active;
+#define NATCAP_SERVER_IN 0
+#define NATCAP_SERVER_OUT 1
+	unsigned char last_dir;
+	unsigned char dead; /* dropped from the group, freed with the last table that holds it */
+	unsigned short loss; /* SYN loss rate EWMA, 1024 = 100% */
+	unsigned int srtt; /* SYN -> SYN-ACK rtt EWMA in ms << 3, 0: no sample yet */
+	unsigned int rst; /* RSTs answering our SYN */
+};
+
+/* one immutable generation of a server group, rebuilt and swapped under RCU on every change.
+ * node[] is sorted from MAX to MIN so servers sharing an ip are adjacent,
+ * ip_slot[] is an open addressing index ip -> first node + 1,
+ * lookup[] is a maglev table flow hash -> node, so add/delete only moves ~1/count of the flows
+ */
+struct natcap_server_table {
+	unsigned int count;
+	unsigned int ip_mask;
+	unsigned int lookup_size;
+	unsigned short *ip_slot;
+	unsigned short *lookup;
+	struct natcap_server_node *node[0];
+};
+
 struct natcap_server_info {
 	unsigned long server_jiffies;
-	unsigned int active_index;
 	unsigned int server_index;
-	unsigned int server_count[2];
-	struct tuple server[2][MAX_NATCAP_SERVER];
-	unsigned long last_active[MAX_NATCAP_SERVER];
-#define NATCAP_SERVER_IN 0
-#define NATCAP_SERVER_OUT 1
-	unsigned char last_dir[MAX_NATCAP_SERVER];
+	struct natcap_server_table __rcu *table;
 };
 
 static struct natcap_server_info server_group[SERVER_GROUP_MAX];
+static DEFINE_MUTEX(natcap_server_mutex);
+static u32 natcap_server_hash_seed __read_mostly;
 
-void natcap_server_info_change(enum server_group_t x, int change)
+/* primes, lookup_size is the first one >= 16 * count */
+static const unsigned int natcap_server_lookup_primes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521
+};
+
+#define NATCAP_SERVER_SLOT_NONE 0xffff
+#define NATCAP_SERVER_PROBE 4
+
+static inline unsigned int natcap_server_ip_hash(__be32 ip)
 {
-	struct natcap_server_info *nsi = &server_group[x];
-	if (change || nsi->server_jiffies == 0 ||
-	        (!server_persist_lock &&
-	         time_after(jiffies, nsi->server_jiffies + (7 * server_persist_timeout / 8 + jiffies % (server_persist_timeout / 4 + 1)) * HZ))) {
-		nsi->server_jiffies = jiffies;
-		nsi->server_index += 1 + prandom_u32();
-	}
+	return jhash_1word((__force u32)ip, natcap_server_hash_seed);
 }
 
-void natcap_server_info_cleanup(enum server_group_t x)
+static inline int natcap_server_ip_first(const struct natcap_server_table *t, __be32 ip)
 {
-	struct natcap_server_info *nsi = &server_group[x];
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
+	unsigned int i = natcap_server_ip_hash(ip) & t->ip_mask;
+	unsigned short v;
 
-	nsi->server_count[m] = 0;
-	nsi->server_count[n] = 0;
-	nsi->active_index = n;
+	while ((v = t->ip_slot[i]) != 0) {
+		if (t->node[v - 1]->server.ip == ip)
+			return v - 1;
+		i = (i + 1) & t->ip_mask;
+	}
+	return -1;
 }
 
-int natcap_server_info_add(enum server_group_t x, const struct tuple *dst)
+static void natcap_server_lookup_build(struct natcap_server_table *t, unsigned int *cur, unsigned int *skip)
 {
-	struct natcap_server_info *nsi = &server_group[x];
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
-	unsigned int i, j;
-
-	if (nsi->server_count[m] == MAX_NATCAP_SERVER)
-		return -ENOSPC;
+	unsigned int size = t->lookup_size;
+	unsigned int filled = 0;
+	unsigned int i, c;
 
-	for (i = 0; i < nsi->server_count[m]; i++) {
-		if (tuple_eq(&nsi->server[m][i], dst)) {
-			return -EEXIST;
-		}
+	for (i = 0; i < t->count; i++) {
+		u32 h = jhash2((const u32 *)&t->node[i]->server, sizeof(struct tuple) / sizeof(u32), natcap_server_hash_seed);
+		cur[i] = h % size;
+		skip[i] = jhash_1word(h, natcap_server_hash_seed) % (size - 1) + 1;
 	}
 
-	/* all dst(s) are stored from MAX to MIN */
-	j = 0;
-	for (i = 0; i < nsi->server_count[m] && tuple_lt(dst, &nsi->server[m][i]); i++) {
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
-	}
-	tuple_copy(&nsi->server[n][j++], dst);
-	for (; i < nsi->server_count[m]; i++) {
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
+	memset(t->lookup, 0xff, size * sizeof(unsigned short));
+	while (1) {
+		for (i = 0; i < t->count; i++) {
+			c = cur[i];
+			while (t->lookup[c] != NATCAP_SERVER_SLOT_NONE) {
+				c += skip[i];
+				if (c >= size)
+					c -= size;
+			}
+			t->lookup[c] = i;
+			c += skip[i];
+			cur[i] = c >= size ? c - size : c;
+			if (++filled == size)
+				return;
+		}
 	}
-
-	nsi->server_count[n] = j;
-	nsi->active_index = n;
-
-	return 0;
 }
 
-int natcap_server_info_delete(enum server_group_t x, const struct tuple *dst)
+static struct natcap_server_table *natcap_server_table_build(struct natcap_server_node **node, unsigned int count)
 {
-	struct natcap_server_info *nsi = &server_group[x];
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
+	struct natcap_server_table *t;
+	unsigned int ip_size = 16;
+	unsigned int lookup_size;
+	unsigned int *tmp;
 	unsigned int i, j;
 
-	j = 0;
-	for (i = 0; i < nsi->server_count[m]; i++) {
-		if (tuple_eq(&nsi->server[m][i], dst)) {
+	while (ip_size < count * 2)
+		ip_size *= 2;
+	for (i = 0; i < ARRAY_SIZE(natcap_server_lookup_primes) - 1 && natcap_server_lookup_primes[i] < count * 16; i++)
+		;
+	lookup_size = natcap_server_lookup_primes[i];
+
+	t = vmalloc(sizeof(struct natcap_server_table) + count * sizeof(struct natcap_server_node *) +
+	            (ip_size + lookup_size) * sizeof(unsigned short));
+	if (!t)
+		return NULL;
+	tmp = vmalloc(count * 2 * sizeof(unsigned int));
+	if (!tmp) {
+		vfree(t);
+		return NULL;
+	}
+
+	t->count = count;
+	t->ip_mask = ip_size - 1;
+	t->lookup_size = lookup_size;
+	t->ip_slot = (unsigned short *)&t->node[count];
+	t->lookup = t->ip_slot + ip_size;
+	memcpy(t->node, node, count * sizeof(struct natcap_server_node *));
+
+	memset(t->ip_slot, 0, ip_size * sizeof(unsigned short));
+	for (i = 0; i < count; i++) {
+		if (i > 0 && node[i - 1]->server.ip == node[i]->server.ip)
 			continue;
-		}
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
+		j = natcap_server_ip_hash(node[i]->server.ip) & t->ip_mask;
+		while (t->ip_slot[j] != 0)
+			j = (j + 1) & t->ip_mask;
+		t->ip_slot[j] = i + 1;
 	}
-	if (j == i)
-		return -ENOENT;
 
-	nsi->server_count[n] = j;
+	natcap_server_lookup_build(t, tmp, tmp + count);
+	vfree(tmp);
 
-	nsi->active_index = n;
-
-	return 0;
+	return t;
 }
 
-const struct tuple *natcap_server_info_current(enum server_group_t x)
+static void natcap_server_publish(struct natcap_server_info *nsi, struct natcap_server_table *t)
 {
-	struct natcap_server_info *nsi = &server_group[x];
-	int count = nsi->server_count[nsi->active_index];
-	static struct tuple _tuple = {0};
-	if (count > 0)
-		return &nsi->server[nsi->active_index][nsi->server_index % count];
-	return &_tuple;
-}
+	struct natcap_server_table *old;
+	unsigned int i;
 
-void *natcap_server_info_get(enum server_group_t x, loff_t idx)
-{
-	struct natcap_server_info *nsi = &server_group[x];
-	if (x > SERVER_GROUP_0) {
-		int y;
-		for (y = SERVER_GROUP_0; y < x; y++) {
-			idx = idx - server_group[y].server_count[server_group[y].active_index];
+	old = rcu_dereference_protected(nsi->table, lockdep_is_held(&natcap_server_mutex));
+	rcu_assign_pointer(nsi->table, t);
+	if (old) {
+		synchronize_rcu();
+		for (i = 0; i < old->count; i++) {
+			if (old->node[i]->dead)
+				kfree(old->node[i]);
 		}
+		vfree(old);
 	}
-	if (idx >= 0 && idx < nsi->server_count[nsi->active_index])
-		return &nsi->server[nsi->active_index][idx];
-
-	return NULL;
 }
 
-void natcap_server_in_touch(enum server_group_t x, __be32 ip)
+void natcap_server_info_change(enum server_group_t x, int change)
 {
-	struct natcap_server_info *nsi;
-	unsigned int m;
-	unsigned int count;
-	unsigned int hash;
+	struct natcap_server_info *nsi = &server_group[x];
+	if (change || nsi->server_jiffies == 0 ||
+	        (!server_persist_lock &&
+	         time_after(jiffies, nsi->server_jiffies + (7 * server_persist_timeout / 8 + jiffies % (server_persist_timeout / 4 + 1)) * HZ))) {
+		nsi->server_jiffies = jiffies;
+		nsi->server_index += 1 + prandom_u32();
+	}
+}
+
+void natcap_server_info_cleanup(enum server_group_t x)
+{
+	struct natcap_server_info *nsi = &server_group[x];
+	struct natcap_server_table *t;
 	unsigned int i;
 
-	if (x >= SERVER_GROUP_MAX)
-		return;
+	mutex_lock(&natcap_server_mutex);
+	t = rcu_dereference_protected(nsi->table, lockdep_is_held(&natcap_server_mutex));
+	if (t) {
+		for (i = 0; i < t->count; i++)
+			t->node[i]->dead = 1;
+		natcap_server_publish(nsi, NULL);
+	}
+	mutex_unlock(&natcap_server_mutex);
+}
 
-	nsi = &server_group[x];
-	m = nsi->active_index;
-	count = nsi->server_count[m];
+int natcap_server_info_add(enum server_group_t x, const struct tuple *dst)
+{
+	struct natcap_server_info *nsi = &server_group[x];
+	struct natcap_server_table *t, *old;
+	struct natcap_server_node **node;
+	struct natcap_server_node *n;
+	unsigned int count;
+	unsigned int i, j;
+	int ret = 0;
 
-	if (count == 0)
-		return;
+	mutex_lock(&natcap_server_mutex);
+	old = rcu_dereference_protected(nsi->table, lockdep_is_held(&natcap_server_mutex));
+	count = old ? old->count : 0;
 
-	hash = nsi->server_index % count;
+	if (count == MAX_NATCAP_SERVER) {
+		ret = -ENOSPC;
+		goto out;
+	}
 
-	for (i = hash; i < count; i++) {
-		if (nsi->server[m][i].ip == ip) {
-			if (nsi->last_dir[i] != NATCAP_SERVER_IN)
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-			return;
+	for (i = 0; i < count; i++) {
+		if (tuple_eq(&old->node[i]->server, dst)) {
+			ret = -EEXIST;
+			goto out;
 		}
 	}
-	for (i = 0; i < hash; i++) {
-		if (nsi->server[m][i].ip == ip) {
-			if (nsi->last_dir[i] != NATCAP_SERVER_IN)
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-			return;
+
+	node = vmalloc((count + 1) * sizeof(struct natcap_server_node *));
+	if (!node) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	n = kzalloc(sizeof(struct natcap_server_node), GFP_KERNEL);
+	if (!n) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	tuple_copy(&n->server, dst);
+
+	/* all dst(s) are stored from MAX to MIN */
+	j = 0;
+	for (i = 0; i < count && tuple_lt(dst, &old->node[i]->server); i++) {
+		node[j++] = old->node[i];
+	}
+	node[j++] = n;
+	for (; i < count; i++) {
+		node[j++] = old->node[i];
+	}
+
+	t = natcap_server_table_build(node, j);
+	if (!t) {
+		kfree(n);
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	natcap_server_publish(nsi, t);
+
+out_free:
+	vfree(node);
+out:
+	mutex_unlock(&natcap_server_mutex);
+	return ret;
+}
+
+int natcap_server_info_delete(enum server_group_t x, const struct tuple *dst)
+{
+	struct natcap_server_info *nsi = &server_group[x];
+	struct natcap_server_table *t, *old;
+	struct natcap_server_node **node;
+	struct natcap_server_node *n = NULL;
+	unsigned int count;
+	unsigned int i, j;
+	int ret = 0;
+
+	mutex_lock(&natcap_server_mutex);
+	old = rcu_dereference_protected(nsi->table, lockdep_is_held(&natcap_server_mutex));
+	count = old ? old->count : 0;
+
+	for (i = 0; i < count; i++) {
+		if (tuple_eq(&old->node[i]->server, dst)) {
+			n = old->node[i];
+			break;
+		}
+	}
+	if (!n) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	if (count == 1) {
+		n->dead = 1;
+		natcap_server_publish(nsi, NULL);
+		goto out;
+	}
+
+	node = vmalloc((count - 1) * sizeof(struct natcap_server_node *));
+	if (!node) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	j = 0;
+	for (i = 0; i < count; i++) {
+		if (old->node[i] != n)
+			node[j++] = old->node[i];
+	}
+
+	t = natcap_server_table_build(node, j);
+	vfree(node);
+	if (!t) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	n->dead = 1;
+	natcap_server_publish(nsi, t);
+
+out:
+	mutex_unlock(&natcap_server_mutex);
+	return ret;
+}
+
+const struct tuple *natcap_server_info_current(enum server_group_t x, struct tuple *dst)
+{
+	struct natcap_server_info *nsi = &server_group[x];
+	struct natcap_server_table *t;
+
+	memset(dst, 0, sizeof(struct tuple));
+	rcu_read_lock();
+	t = rcu_dereference(nsi->table);
+	if (t)
+		tuple_copy(dst, &t->node[nsi->server_index % t->count]->server);
+	rcu_read_unlock();
+
+	return dst;
+}
+
+void *natcap_server_info_get(enum server_group_t x, loff_t idx, struct tuple *dst)
+{
+	struct natcap_server_table *t;
+	void *ret = NULL;
+	int y;
+
+	rcu_read_lock();
+	for (y = SERVER_GROUP_0; y < x; y++) {
+		t = rcu_dereference(server_group[y].table);
+		if (t)
+			idx = idx - t->count;
+	}
+	t = rcu_dereference(server_group[x].table);
+	if (t && idx >= 0 && idx < t->count) {
+		tuple_copy(dst, &t->node[idx]->server);
+		ret = dst;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+void natcap_server_in_touch(enum server_group_t x, __be32 ip)
+{
+	struct natcap_server_table *t;
+	int i;
+
+	if (x >= SERVER_GROUP_MAX)
+		return;
+
+	rcu_read_lock();
+	t = rcu_dereference(server_group[x].table);
+	if (t && (i = natcap_server_ip_first(t, ip)) >= 0) {
+		for (; i < t->count && t->node[i]->server.ip == ip; i++) {
+			if (t->node[i]->last_dir != NATCAP_SERVER_IN)
+				t->node[i]->last_dir = NATCAP_SERVER_IN;
+		}
+	}
+	rcu_read_unlock();
+}
+
+/* sent to but no reply within natcap_touch_timeout, retried again after 512s */
+static inline int natcap_server_node_blocked(const struct natcap_server_node *n)
+{
+	return n->last_dir == NATCAP_SERVER_OUT &&
+	       jiffies_diff(jiffies, n->last_active) > natcap_touch_timeout * HZ &&
+	       jiffies_diff(jiffies, n->last_active) <= 512 * HZ;
+}
+
+/* smoothed rtt inflated by the loss rate: a server losing every SYN costs 5x its rtt.
+ * servers without samples cost the least so they get probed first
+ */
+static inline unsigned int natcap_server_node_cost(const struct natcap_server_node *n)
+{
+	unsigned int srtt = n->srtt + 8;
+
+	if (natcap_server_node_blocked(n))
+		return ~0U;
+	return srtt + ((srtt * n->loss) >> 8);
+}
+
+#define NATCAP_SERVER_EV_RTT 0
+#define NATCAP_SERVER_EV_LOSS 1
+#define NATCAP_SERVER_EV_RST 2
+
+static void natcap_server_health_update(enum server_group_t x, __be32 ip, int ev, unsigned int rtt)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *n;
+	int i;
+
+	if (x >= SERVER_GROUP_MAX)
+		return;
+
+	rcu_read_lock();
+	t = rcu_dereference(server_group[x].table);
+	if (t && (i = natcap_server_ip_first(t, ip)) >= 0) {
+		for (; i < t->count && t->node[i]->server.ip == ip; i++) {
+			n = t->node[i];
+			switch (ev) {
+			case NATCAP_SERVER_EV_RTT:
+				if (rtt > 0xffff)
+					rtt = 0xffff;
+				n->srtt = n->srtt ? n->srtt - (n->srtt >> 3) + rtt : rtt << 3;
+				n->loss -= n->loss >> 4;
+				break;
+			case NATCAP_SERVER_EV_RST:
+				n->rst++;
+				/* fall through */
+			case NATCAP_SERVER_EV_LOSS:
+				n->loss += (1024 - n->loss) >> 4;
+				break;
+			}
 		}
 	}
+	rcu_read_unlock();
+}
+
+static inline unsigned short natcap_server_ms_now(void)
+{
+	unsigned short ms = jiffies_to_msecs(jiffies);
+	return ms ? ms : 1;
+}
+
+/* stamp the SYN towards the server, another SYN before the SYN-ACK counts as a loss */
+static inline void natcap_server_syn_out(struct nf_conn *ct, struct natcap_session *ns)
+{
+	if (ns->n.group_x >= SERVER_GROUP_MAX)
+		return;
+	if (ns->syn_ms != 0)
+		natcap_server_health_update(ns->n.group_x, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, NATCAP_SERVER_EV_LOSS, 0);
+	ns->syn_ms = natcap_server_ms_now();
+}
+
+static inline void natcap_server_syn_in(struct nf_conn *ct, struct natcap_session *ns, int rst)
+{
+	if (ns->syn_ms == 0)
+		return;
+	if (rst)
+		natcap_server_health_update(ns->n.group_x, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, NATCAP_SERVER_EV_RST, 0);
+	else
+		natcap_server_health_update(ns->n.group_x, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, NATCAP_SERVER_EV_RTT,
+		                            (unsigned short)(natcap_server_ms_now() - ns->syn_ms));
+	ns->syn_ms = 0;
 }
 
 // [T/U][T/U][o/e][0/1]
@@ -475,10 +1223,11 @@ void __natcap_server_info_select(enum server_group_t x, const struct net_device
 {
 	static atomic_t server_port = ATOMIC_INIT(0);
 	struct natcap_server_info *nsi;
-	unsigned int m;
+	struct natcap_server_table *t;
 	unsigned int count;
 	unsigned int hash;
 	unsigned int i, found = 0;
+	int k;
 
 	if (x == SERVER_GROUP_1) {
 		if ((natcap_server_use_peer & 0x1)) {
@@ -506,22 +1255,23 @@ void __natcap_server_info_select(enum server_group_t x, const struct net_device
 	}
 
 	nsi = &server_group[x];
-	m = nsi->active_index;
-	count = nsi->server_count[m];
 
 	dst->ip = 0;
 	dst->port = 0;
 	dst->encryption = 0;
 
-	if (count == 0)
+	rcu_read_lock();
+	t = rcu_dereference(nsi->table);
+	if (!t) {
+		rcu_read_unlock();
 		return;
+	}
+	count = t->count;
 
-	for (i = 0; i < count; i++) {
-		if (nsi->server[m][i].ip == ip) {
-			hash = i;
-			found = 1;
-			goto found;
-		}
+	if ((k = natcap_server_ip_first(t, ip)) >= 0) {
+		hash = k;
+		found = 1;
+		goto found;
 	}
 
 	natcap_server_info_change(x, 0);
@@ -531,32 +1281,56 @@ void __natcap_server_info_select(enum server_group_t x, const struct net_device
 	if ((i = server_index_natcap_get(&skb->mark)) != 0) {
 		hash = (i - 1) % count;
 		found = 1;
-	} else if (server_persist_lock || nsi->last_dir[hash] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[hash]) <= natcap_touch_timeout * HZ) {
+	} else if (server_select_mode == NATCAP_SERVER_SELECT_RTT) {
+		for (i = 0; i < NATCAP_SERVER_PROBE; i++) {
+			unsigned int a = prandom_u32() % count;
+			unsigned int b = count > 1 ? (a + 1 + prandom_u32() % (count - 1)) % count : a;
+			hash = natcap_server_node_cost(t->node[a]) <= natcap_server_node_cost(t->node[b]) ? a : b;
+			if (server_persist_lock || !natcap_server_node_blocked(t->node[hash])) {
+				found = 1;
+				break;
+			}
+		}
+	} else if (server_select_mode == NATCAP_SERVER_SELECT_HASH) {
+		unsigned int h = natcap_server_ip_hash(ip);
+		for (i = 0; i < NATCAP_SERVER_PROBE; i++) {
+			hash = t->lookup[h % t->lookup_size];
+			if (server_persist_lock || !natcap_server_node_blocked(t->node[hash])) {
+				found = 1;
+				break;
+			}
+			/* only flows of a blocked server move, the rest keep their slot */
+			h = jhash_1word(h, natcap_server_hash_seed);
+		}
+		if (!found) {
+			hash = t->lookup[natcap_server_ip_hash(ip) % t->lookup_size];
+		}
+	} else if (server_persist_lock || t->node[hash]->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, t->node[hash]->last_active) <= natcap_touch_timeout * HZ) {
 		found = 1;
 	} else {
 		unsigned int oldhash = hash;
 		hash = (hash + jiffies) % count;
 		for (i = hash; i < count; i++) {
-			if (nsi->last_dir[i] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[i]) > 512 * HZ) {
+			if (t->node[i]->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, t->node[i]->last_active) > 512 * HZ) {
 				found = 1;
 				hash = i;
 				nsi->server_index = i;
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
+				t->node[i]->last_dir = NATCAP_SERVER_IN;
 				NATCAP_WARN("current server(" TUPLE_FMT ") is blocked, switch to next=" TUPLE_FMT "\n",
-				            TUPLE_ARG(&nsi->server[m][oldhash]),
-				            TUPLE_ARG(&nsi->server[m][hash]));
+				            TUPLE_ARG(&t->node[oldhash]->server),
+				            TUPLE_ARG(&t->node[hash]->server));
 				break;
 			}
 		}
 		for (i = 0; !found && i < hash; i++) {
-			if (nsi->last_dir[i] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[i]) > 512 * HZ) {
+			if (t->node[i]->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, t->node[i]->last_active) > 512 * HZ) {
 				found = 1;
 				hash = i;
 				nsi->server_index = i;
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
+				t->node[i]->last_dir = NATCAP_SERVER_IN;
 				NATCAP_WARN("current server(" TUPLE_FMT ") is blocked, switch to next=" TUPLE_FMT "\n",
-				            TUPLE_ARG(&nsi->server[m][oldhash]),
-				            TUPLE_ARG(&nsi->server[m][hash]));
+				            TUPLE_ARG(&t->node[oldhash]->server),
+				            TUPLE_ARG(&t->node[hash]->server));
 				break;
 			}
 		}
@@ -564,18 +1338,20 @@ void __natcap_server_info_select(enum server_group_t x, const struct net_device
 			natcap_server_info_change(x, 1);
 			hash = nsi->server_index % count;
 			NATCAP_WARN("all servers are blocked, force change. " TUPLE_FMT " -> " TUPLE_FMT "\n",
-			            TUPLE_ARG(&nsi->server[m][oldhash]),
-			            TUPLE_ARG(&nsi->server[m][hash]));
+			            TUPLE_ARG(&t->node[oldhash]->server),
+			            TUPLE_ARG(&t->node[hash]->server));
 		}
 	}
 
 found:
-	if (nsi->last_dir[hash] == NATCAP_SERVER_IN || !found) {
-		nsi->last_dir[hash] = NATCAP_SERVER_OUT;
-		nsi->last_active[hash] = jiffies; /* ticks start */
+	if (t->node[hash]->last_dir == NATCAP_SERVER_IN || !found) {
+		t->node[hash]->last_dir = NATCAP_SERVER_OUT;
+		t->node[hash]->last_active = jiffies; /* ticks start */
 	}
 
-	tuple_copy(dst, &nsi->server[m][hash]);
+	tuple_copy(dst, &t->node[hash]->server);
+	rcu_read_unlock();
+
 	if (dst->port == __constant_htons(0)) {
 		dst->port = port;
 	} else if (dst->port == __constant_htons(65535)) {
@@ -593,24 +1369,24 @@ found:
 
 int is_natcap_server(__be32 ip)
 {
-	struct natcap_server_info *nsi;
-	unsigned int m;
-	unsigned int i;
+	struct natcap_server_table *t;
 	int x;
+	int ret = 0;
 
 	if (mode != MIXING_MODE && mode != CLIENT_MODE)
 		return 0;
 
+	rcu_read_lock();
 	for (x = 0; x < SERVER_GROUP_MAX; x++) {
-		nsi = &server_group[x];
-		m = nsi->active_index;
-		for (i = 0; i < nsi->server_count[m]; i++) {
-			if (nsi->server[m][i].ip == ip)
-				return 1;
+		t = rcu_dereference(server_group[x].table);
+		if (t && natcap_server_ip_first(t, ip) >= 0) {
+			ret = 1;
+			break;
 		}
 	}
+	rcu_read_unlock();
 
-	return 0;
+	return ret;
 }
 
 static inline int natcap_reset_synack(struct sk_buff *oskb, const struct net_device *dev, struct nf_conn *ct)
@@ -855,7 +1631,7 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 			natcap_knock_info_select(iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
 			NATCAP_INFO("(CD)" DEBUG_TCP_FMT ": new connection, knock select target server=" TUPLE_FMT "\n", DEBUG_TCP_ARG(iph,l4), TUPLE_ARG(&server));
 		} else if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0 ||
-		           IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0 ||
+		           IP_SET_test_dst_cniplist(state, in, out, skb) > 0 ||
 		           IP_SET_test_dst_ip(state, in, out, skb, "cone_wan_ip") > 0) {
 bypass_tcp:
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -904,7 +1680,7 @@ bypass_tcp:
 							return NF_ACCEPT;
 						}
 
-						ns = natcap_session_in(ct);
+						ns = natcap_session_in_mp(ct, server.tcp_encode == UDP_ENCODE);
 						if (!ns) {
 							NATCAP_WARN("(CD)" DEBUG_TCP_FMT ": natcap_session_in failed\n", DEBUG_TCP_ARG(iph,l4));
 							set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
@@ -956,7 +1732,7 @@ bypass_tcp:
 				return NF_ACCEPT;
 			}
 
-			ns = natcap_session_in(ct);
+			ns = natcap_session_in_mp(ct, server.tcp_encode == UDP_ENCODE);
 			if (!ns) {
 				NATCAP_WARN("(CD)" DEBUG_TCP_FMT ": natcap_session_in failed\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -1123,7 +1899,7 @@ natcap_dual_out_udp:
 		}
 
 		if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0 ||
-		        IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0 ||
+		        IP_SET_test_dst_cniplist(state, in, out, skb) > 0 ||
 		        IP_SET_test_dst_ip(state, in, out, skb, "cone_wan_ip") > 0) {
 bypass_udp:
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -1310,6 +2086,12 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 		return NF_ACCEPT;
 	}
 	if (CTINFO2DIR(ctinfo) != IP_CT_DIR_REPLY) {
+		if (natcap_user_mode != NATCAP_USER_MODE_NONE && (IPS_NATCAP & ct->status)) {
+			ns = natcap_session_get(ct);
+			if (ns && ns->user_idx == 0) {
+				natcap_user_attach(skb, in, ct, ns);
+			}
+		}
 		if (iph->protocol == IPPROTO_TCP) {
 			if (!skb_make_writable(skb, iph->ihl * 4 + sizeof(struct tcphdr))) {
 				return NF_DROP;
@@ -1367,7 +2149,7 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (!(NS_NATCAP_NOLIMIT & ns->n.status) && natcap_rx_flow_ctrl(skb, ct) < 0) {
+	if (!(NS_NATCAP_NOLIMIT & ns->n.status) && natcap_rx_flow_ctrl(skb, ct, ns) < 0) {
 		return NF_DROP;
 	}
 
@@ -1389,6 +2171,7 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 			NATCAP_INFO("(CPCI)" DEBUG_TCP_FMT ": touch for server%d ip=%pI4\n", DEBUG_TCP_ARG(iph,l4),
 			            ns->n.group_x, &ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip);
 			natcap_server_in_touch(ns->n.group_x, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip);
+			natcap_server_syn_in(ct, ns, TCPH(l4)->rst);
 		}
 
 		NATCAP_DEBUG("(CPCI)" DEBUG_TCP_FMT ": before decode\n", DEBUG_TCP_ARG(iph,l4));
@@ -1431,15 +2214,14 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 		}
 
 		if ((NS_NATCAP_ENC & ns->n.status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_data_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 				NATCAP_ERROR("(CPCI)" DEBUG_UDP_FMT ": skb_make_writable() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
 			iph = ip_hdr(skb);
 			l4 = (void *)iph + iph->ihl * 4;
 
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
-			skb_rcsum_tcpudp(skb);
+			skb_data_hook_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
 		}
 
 		NATCAP_DEBUG("(CPCI)" DEBUG_UDP_FMT ": after decode\n", DEBUG_UDP_ARG(iph,l4));
@@ -1448,6 +2230,212 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 	return NF_ACCEPT;
 }
 
+/* multipath over the direct path and the confirmed peer relays (peer_tuple3[]):
+ * the server sends each segment direct plus a copy on one relay, so whichever copy
+ * comes in later tells how far its path lags behind. the copies that are late by no
+ * more than about twice the path lag are dropped here instead of being passed up,
+ * later ones may be real retransmissions and go up as before.
+ * the helpers below need natcap_session_mp(ns), peer_mark is only ever set when it is there.
+ */
+#define PEER_PATH_DIRECT MAX_PEER_NUM
+#define PEER_PATH_SMALL 256 /* payload up to this is always sent with a copy */
+#define PEER_PATH_SHARE_WINDOW 64
+
+static inline void peer_path_lag_update(struct peer_path *pp, unsigned int ms)
+{
+	if (ms > 4095)
+		ms = 4095;
+	pp->lag = pp->lag - (pp->lag >> 3) + ms;
+}
+
+static inline void peer_path_loss_update(struct peer_path *pp, unsigned int sample)
+{
+	pp->loss = pp->loss - ((pp->loss + 7) >> 3) + (sample >> 3);
+}
+
+static inline unsigned int peer_path_cost(const struct peer_path *pp)
+{
+	return ((unsigned int)pp->lag + 64) * 256 / (256 - min_t(unsigned int, pp->loss, 224));
+}
+
+/* the server spreads the relay copies evenly, a relay short of its share is losing them */
+static void natcap_peer_path_share(struct natcap_session *ns, unsigned int p)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	unsigned int i, n, expect;
+
+	if (mp->peer_path[p].rx < 255)
+		mp->peer_path[p].rx++;
+	if (++mp->peer_rx_total < PEER_PATH_SHARE_WINDOW)
+		return;
+
+	n = hweight16(ns->peer_mark);
+	expect = n ? PEER_PATH_SHARE_WINDOW / n : 0;
+	for (i = 0; i < MAX_PEER_NUM; i++) {
+		if (short_test_bit(i, &ns->peer_mark) && expect > 0) {
+			unsigned int rx = mp->peer_path[i].rx;
+			peer_path_loss_update(&mp->peer_path[i], rx >= expect ? 0 : (expect - rx) * 255 / expect);
+		}
+		mp->peer_path[i].rx = 0;
+	}
+	mp->peer_rx_total = 0;
+}
+
+/* a TCP segment came in on path @p, return 1 if it is a late copy of one already passed up */
+static int natcap_peer_path_rx(struct natcap_session *ns, void *l4, unsigned int p)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	unsigned int i;
+	unsigned short now = natcap_server_ms_now();
+	unsigned short ack = ntohl(TCPH(l4)->ack_seq) & 0xffff;
+	unsigned short win = ntohs(TCPH(l4)->window);
+	struct peer_path *pp = &mp->peer_path[p];
+	struct peer_dup *d;
+
+	if (p != PEER_PATH_DIRECT)
+		natcap_peer_path_share(ns, p);
+
+	for (i = 0; i < PEER_DUP_RING; i++) {
+		unsigned short lag;
+		d = &mp->peer_dup[i];
+		if (!(d->flags & PEER_DUP_USED) || d->seq != TCPH(l4)->seq || d->ack != ack || d->win != win)
+			continue;
+		if (d->path == p || (d->flags & PEER_DUP_SEEN))
+			return 0;
+		d->flags |= PEER_DUP_SEEN;
+		lag = now - d->ms;
+		peer_path_lag_update(pp, lag);
+		if (p == PEER_PATH_DIRECT) {
+			d->flags |= PEER_DUP_DIRECT;
+			peer_path_loss_update(pp, 0);
+		}
+		return lag <= (pp->lag >> 2) + 16;
+	}
+
+	d = &mp->peer_dup[mp->peer_dup_idx++ % PEER_DUP_RING];
+	if ((d->flags & PEER_DUP_USED) && d->path != PEER_PATH_DIRECT && !(d->flags & PEER_DUP_DIRECT)) {
+		/* the direct copy is overdue by now */
+		if ((unsigned short)(now - d->ms) > (mp->peer_path[PEER_PATH_DIRECT].lag >> 2) + 16)
+			peer_path_loss_update(&mp->peer_path[PEER_PATH_DIRECT], 255);
+	}
+	d->seq = TCPH(l4)->seq;
+	d->ack = ack;
+	d->win = win;
+	d->ms = now;
+	d->path = p;
+	d->flags = PEER_DUP_USED;
+	peer_path_lag_update(pp, 0);
+
+	return 0;
+}
+
+/* the relay to put the copy of a segment on, -1 if none is confirmed */
+static int natcap_peer_path_relay(struct natcap_session *ns)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	unsigned int i, idx, cost, best_cost = ~0U;
+	int best = -1;
+
+	for (i = 0; i < MAX_PEER_NUM; i++) {
+		idx = (i + ns->peer_idx) % MAX_PEER_NUM;
+		if (mp->peer_tuple3[idx].dip == 0 || !short_test_bit(idx, &ns->peer_mark))
+			continue;
+		if (peer_multipath_mode == NATCAP_PEER_MULTIPATH_RR) {
+			best = idx;
+			break;
+		}
+		/* ties go round robin */
+		cost = peer_path_cost(&mp->peer_path[idx]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = idx;
+		}
+	}
+	if (best >= 0)
+		ns->peer_idx = (best + 1) % MAX_PEER_NUM;
+
+	return best;
+}
+
+/* smooth weighted round robin over the direct path and the relays not lagging too far behind */
+static unsigned int natcap_peer_path_wrr(struct natcap_session *ns)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	unsigned int i, w, total = 0, best_cost;
+	unsigned int cost[MAX_PEER_NUM + 1];
+	int pick = -1;
+
+	best_cost = cost[PEER_PATH_DIRECT] = peer_path_cost(&mp->peer_path[PEER_PATH_DIRECT]);
+	for (i = 0; i < MAX_PEER_NUM; i++) {
+		cost[i] = ~0U;
+		if (mp->peer_tuple3[i].dip == 0 || !short_test_bit(i, &ns->peer_mark) || mp->peer_path[i].loss >= 128)
+			continue;
+		cost[i] = peer_path_cost(&mp->peer_path[i]);
+		if (cost[i] < best_cost)
+			best_cost = cost[i];
+	}
+
+	for (i = 0; i <= MAX_PEER_NUM; i++) {
+		struct peer_path *pp = &mp->peer_path[i];
+		if (cost[i] > best_cost * 2) {
+			pp->wrr = 0;
+			continue;
+		}
+		w = best_cost * 16 / cost[i];
+		pp->wrr += w;
+		total += w;
+		if (pick < 0 || pp->wrr > mp->peer_path[pick].wrr)
+			pick = i;
+	}
+	mp->peer_path[pick].wrr -= total;
+
+	return pick;
+}
+
+/* the relay conntrack went away, forget the path */
+static int natcap_peer_path_alive(struct net *net, struct natcap_session *ns, __be32 saddr, unsigned int idx)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	struct nf_conntrack_tuple tuple;
+	struct nf_conntrack_tuple_hash *h;
+
+	memset(&tuple, 0, sizeof(tuple));
+	tuple.src.u3.ip = saddr;
+	tuple.src.u.udp.port = mp->peer_tuple3[idx].sport;
+	tuple.dst.u3.ip = mp->peer_tuple3[idx].dip;
+	tuple.dst.u.udp.port = mp->peer_tuple3[idx].dport;
+	tuple.src.l3num = PF_INET;
+	tuple.dst.protonum = IPPROTO_UDP;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+	h = nf_conntrack_find_get(net, NF_CT_DEFAULT_ZONE, &tuple);
+#else
+	h = nf_conntrack_find_get(net, &nf_ct_zone_dflt, &tuple);
+#endif
+	if (h) {
+		nf_ct_put(nf_ct_tuplehash_to_ctrack(h));
+		return 1;
+	}
+
+	mp->peer_tuple3[idx].dip = 0;
+	mp->peer_tuple3[idx].dport = 0;
+	mp->peer_tuple3[idx].sport = 0;
+	short_clear_bit(idx, &ns->peer_mark);
+	memset(&mp->peer_path[idx], 0, sizeof(mp->peer_path[idx]));
+	return 0;
+}
+
+static inline void natcap_peer_path_set(struct sk_buff *skb, struct natcap_session *ns, unsigned int idx)
+{
+	struct natcap_session_mp *mp = natcap_session_mp(ns);
+	struct iphdr *iph = ip_hdr(skb);
+	void *l4 = (void *)iph + iph->ihl * 4;
+
+	iph->daddr = mp->peer_tuple3[idx].dip;
+	UDPH(l4)->dest = mp->peer_tuple3[idx].dport;
+	UDPH(l4)->source = mp->peer_tuple3[idx].sport;
+	set_byte4((void *)UDPH(l4) + 8, __constant_htonl(NATCAP_8_MAGIC));
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned int natcap_client_pre_in_hook(unsigned int hooknum,
         struct sk_buff *skb,
@@ -1709,6 +2697,9 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 			master->master = ct;
 			ns->peer_jiffies = jiffies; //set peer_jiffies once init
 		}
+		if (peer_ver && ns->peer_mark && natcap_peer_path_rx(ns, l4, PEER_PATH_DIRECT)) {
+			return NF_DROP;
+		}
 		return NF_ACCEPT;
 
 	} else if (get_byte4((void *)UDPH(l4) + 8) == __constant_htonl(NATCAP_9_MAGIC)) {
@@ -1728,6 +2719,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 
 		if (get_byte4((void *)UDPH(l4) + 8 + 4) == __constant_htonl(NATCAP_9_MAGIC_TYPE1)) {
 			__be32 sip, dip;
+			struct natcap_session_mp *mp;
 
 			ct = master->master;
 			if (!ct) {
@@ -1739,6 +2731,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 				NATCAP_WARN("(CPI)" DEBUG_UDP_FMT ": natcap_session_get failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
+			mp = natcap_session_mp(ns);
 
 			sip = get_byte4((void *)UDPH(l4) + 8 + 4 + 4);
 			dip = iph->saddr;
@@ -1755,7 +2748,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 			iph->saddr = iph->daddr;
 			UDPH(l4)->check = CSUM_MANGLED_0;
 
-			if (ns->peer_cnt == 0 && peer_multipath) {
+			if (ns->peer_cnt == 0 && peer_multipath && mp) {
 				//lock once
 				if (!(IPS_NATCAP_CFM & ct->status) && !test_and_set_bit(IPS_NATCAP_CFM_BIT, &ct->status)) {
 					__be32 ip;
@@ -1766,18 +2759,18 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 						ip = peer_pub_ip[idx];
 						if (ip != 0 && ip != sip && ip != dip) {
 							for (j = 0; j < MAX_PEER_NUM && j < peer_multipath; j++)
-								if (ns->peer_tuple3[j].dip == ip)
+								if (mp->peer_tuple3[j].dip == ip)
 									break;
 
 							if (j == MAX_PEER_NUM || j == peer_multipath)
 								for (j = 0; j < MAX_PEER_NUM && j < peer_multipath; j++)
-									if (ns->peer_tuple3[j].dip == 0) {
+									if (mp->peer_tuple3[j].dip == 0) {
 										ns->peer_cnt++;
-										ns->peer_tuple3[j].dip = ip;
-										ns->peer_tuple3[j].dport = htons(prandom_u32() % (65536 - 1024) + 1024);
-										ns->peer_tuple3[j].sport = htons(prandom_u32() % (65536 - 1024) + 1024);
+										mp->peer_tuple3[j].dip = ip;
+										mp->peer_tuple3[j].dport = htons(prandom_u32() % (65536 - 1024) + 1024);
+										mp->peer_tuple3[j].sport = htons(prandom_u32() % (65536 - 1024) + 1024);
 										NATCAP_DEBUG("(CPI)" DEBUG_UDP_FMT ": peer%px select %u-%pI4:%u j=%u\n", DEBUG_UDP_ARG(iph,l4), (void *)&ns,
-										             ntohs(ns->peer_tuple3[j].sport), &ns->peer_tuple3[j].dip, ntohs(ns->peer_tuple3[j].dport), j);
+										             ntohs(mp->peer_tuple3[j].sport), &mp->peer_tuple3[j].dip, ntohs(mp->peer_tuple3[j].dport), j);
 										break;
 									}
 						}
@@ -1791,7 +2784,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 				struct ethhdr *neth;
 				struct sk_buff *nskb;
 				for (i = 0; i < MAX_PEER_NUM; i++) {
-					if (ns->peer_tuple3[i].dip == 0)
+					if (mp->peer_tuple3[i].dip == 0)
 						break;
 					if (short_test_bit(i, &ns->peer_mark))
 						continue;
@@ -1811,9 +2804,9 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 					l4 = (void *)iph + iph->ihl * 4;
 
 					iph->id = htons(jiffies);
-					iph->daddr = ns->peer_tuple3[i].dip;
-					UDPH(l4)->dest = ns->peer_tuple3[i].dport;
-					UDPH(l4)->source = ns->peer_tuple3[i].sport;
+					iph->daddr = mp->peer_tuple3[i].dip;
+					UDPH(l4)->dest = mp->peer_tuple3[i].dport;
+					UDPH(l4)->source = mp->peer_tuple3[i].sport;
 					set_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2, htons(i));
 
 					nskb->ip_summed = CHECKSUM_UNNECESSARY;
@@ -1883,6 +2876,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 			int i, ret;
 			unsigned int tmp;
 			struct ethhdr *eth;
+			struct natcap_session_mp *mp;
 			if (!nf_ct_is_confirmed(master) && !master->master) {
 				struct nf_conntrack_tuple tuple;
 				struct nf_conntrack_tuple_hash *h;
@@ -1915,11 +2909,12 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 					i = get_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2);
 					i = ntohs(i) % MAX_PEER_NUM;
 
-					if (!short_test_bit(i, &ns->peer_mark)) {
+					mp = natcap_session_mp(ns);
+					if (mp && !short_test_bit(i, &ns->peer_mark)) {
 						short_set_bit(i, &ns->peer_mark);
-						ns->peer_tuple3[i].dip = iph->saddr;
-						ns->peer_tuple3[i].dport = UDPH(l4)->source;
-						ns->peer_tuple3[i].sport = UDPH(l4)->dest;
+						mp->peer_tuple3[i].dip = iph->saddr;
+						mp->peer_tuple3[i].dport = UDPH(l4)->source;
+						mp->peer_tuple3[i].sport = UDPH(l4)->dest;
 						ns->peer_cnt++;
 						NATCAP_INFO("(CPI)" DEBUG_UDP_FMT ": CFM=%u: ct[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u] peer_mark=0x%x\n", DEBUG_UDP_ARG(iph,l4), i,
 						            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all),
@@ -1987,6 +2982,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 		} else if (get_byte4((void *)UDPH(l4) + 8 + 4) == __constant_htonl(NATCAP_9_MAGIC_TYPE4)) {
 			int ret;
 			unsigned int i;
+			struct natcap_session_mp *mp;
 			if (!master->master) {
 				xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
 				NATCAP_DEBUG("(CPI)" DEBUG_UDP_FMT ": peer pass forward: type4\n", DEBUG_UDP_ARG(iph,l4));
@@ -2001,8 +2997,9 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 
 			i = get_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2);
 			i = ntohs(i) % MAX_PEER_NUM;
-			if (!short_test_bit(i, &ns->peer_mark) &&
-			        ns->peer_tuple3[i].dip == iph->saddr && ns->peer_tuple3[i].dport == UDPH(l4)->source && ns->peer_tuple3[i].sport == UDPH(l4)->dest) {
+			mp = natcap_session_mp(ns);
+			if (mp && !short_test_bit(i, &ns->peer_mark) &&
+			        mp->peer_tuple3[i].dip == iph->saddr && mp->peer_tuple3[i].dport == UDPH(l4)->source && mp->peer_tuple3[i].sport == UDPH(l4)->dest) {
 				short_set_bit(i, &ns->peer_mark);
 				NATCAP_INFO("(CPI)" DEBUG_UDP_FMT ": CFM=%u: ct[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u] peer_mark=0x%x\n", DEBUG_UDP_ARG(iph,l4), i,
 				            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all),
@@ -2027,6 +3024,7 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 		int offlen;
 		unsigned int i;
 		int dir = CTINFO2DIR(ctinfo);
+		struct natcap_session_mp *mp;
 
 		if (!inet_is_local(in, iph->daddr)) {
 			set_bit(IPS_NATCAP_PRE_BIT, &master->status);
@@ -2070,13 +3068,16 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		if (ns->peer_mark != 0xff)
+		i = MAX_PEER_NUM;
+		mp = natcap_session_mp(ns);
+		if (mp) {
 			for (i = 0; i < MAX_PEER_NUM; i++)
-				if (!short_test_bit(i, &ns->peer_mark) &&
-				        ns->peer_tuple3[i].dip == iph->saddr && ns->peer_tuple3[i].dport == UDPH(l4)->source && ns->peer_tuple3[i].sport == UDPH(l4)->dest) {
-					short_set_bit(i, &ns->peer_mark);
+				if (mp->peer_tuple3[i].dip == iph->saddr && mp->peer_tuple3[i].dport == UDPH(l4)->source && mp->peer_tuple3[i].sport == UDPH(l4)->dest) {
+					if (!short_test_bit(i, &ns->peer_mark))
+						short_set_bit(i, &ns->peer_mark);
 					break;
 				}
+		}
 
 		NATCAP_DEBUG("(CPI)" DEBUG_UDP_FMT ": peer pass up: before\n", DEBUG_UDP_ARG(iph,l4));
 
@@ -2103,6 +3104,11 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		skb_rcsum_tcpudp(skb);
 
+		if (i < MAX_PEER_NUM && natcap_peer_path_rx(ns, l4, i)) {
+			NATCAP_DEBUG("(CPI)" DEBUG_TCP_FMT ": peer pass up: drop the late copy from path %u\n", DEBUG_TCP_ARG(iph,l4), i);
+			return NF_DROP;
+		}
+
 		if (in)
 			net = dev_net(in);
 		else if (out)
@@ -2287,7 +3293,7 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (!(NS_NATCAP_NOLIMIT & ns->n.status) && natcap_tx_flow_ctrl(skb, ct) < 0) {
+	if (!(NS_NATCAP_NOLIMIT & ns->n.status) && natcap_tx_flow_ctrl(skb, ct, ns) < 0) {
 		return NF_DROP;
 	}
 
@@ -2295,6 +3301,10 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		struct sk_buff *skb2 = NULL;
 		struct sk_buff *skb_htp = NULL;
 
+		if (TCPH(l4)->syn && !TCPH(l4)->ack) {
+			natcap_server_syn_out(ct, ns);
+		}
+
 		if ((NS_NATCAP_ENC & ns->n.status)) {
 			status |= NATCAP_NEED_ENC;
 		}
@@ -2457,7 +3467,7 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = skb_gso_segment(skb, NATCAP_GSO_FEATURES);
 			if (IS_ERR(segs)) {
 				if (skb2) {
 					consume_skb(skb2);
@@ -2501,58 +3511,36 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 			skb->next = NULL;
 
 			if (ns->peer_ver == 1 && ns->peer_mark) {
-				unsigned int i, idx;
-				for (i = 0; i < MAX_PEER_NUM; i++) {
-					idx = (i + ns->peer_idx) % MAX_PEER_NUM;
-					if (ns->peer_tuple3[idx].dip != 0 && short_test_bit(idx, &ns->peer_mark)) {
-						struct nf_conntrack_tuple tuple;
-						struct nf_conntrack_tuple_hash *h;
-
-						ns->peer_idx = (idx + 1) % MAX_PEER_NUM;
-
-						memset(&tuple, 0, sizeof(tuple));
-						tuple.src.u3.ip = iph->saddr;
-						tuple.src.u.udp.port = ns->peer_tuple3[idx].sport;
-						tuple.dst.u3.ip = ns->peer_tuple3[idx].dip;
-						tuple.dst.u.udp.port = ns->peer_tuple3[idx].dport;
-						tuple.src.l3num = PF_INET;
-						tuple.dst.protonum = IPPROTO_UDP;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-						h = nf_conntrack_find_get(net, NF_CT_DEFAULT_ZONE, &tuple);
-#else
-						h = nf_conntrack_find_get(net, &nf_ct_zone_dflt, &tuple);
-#endif
-						if (h) {
-							ct = nf_ct_tuplehash_to_ctrack(h);
-							nf_ct_put(ct);
-						} else {
-							ns->peer_tuple3[idx].dip = 0;
-							ns->peer_tuple3[idx].dport = 0;
-							ns->peer_tuple3[idx].sport = 0;
-							short_clear_bit(idx, &ns->peer_mark);
-							break;
-						}
-
-						dup_skb = skb_copy(skb, GFP_ATOMIC);
-						if (dup_skb) {
-							iph = ip_hdr(dup_skb);
-							l4 = (void *)iph + iph->ihl * 4;
+				int relay = -1;
+				unsigned int pick = PEER_PATH_DIRECT;
+				unsigned int len = ntohs(iph->tot_len) - iph->ihl * 4 - 8 - TCPH(l4 + 8)->doff * 4;
+
+				if (peer_multipath_mode == NATCAP_PEER_MULTIPATH_WRR && len > PEER_PATH_SMALL) {
+					pick = natcap_peer_path_wrr(ns);
+					if (pick != PEER_PATH_DIRECT && !natcap_peer_path_alive(net, ns, iph->saddr, pick))
+						pick = PEER_PATH_DIRECT;
+				} else {
+					relay = natcap_peer_path_relay(ns);
+					if (relay >= 0 && !natcap_peer_path_alive(net, ns, iph->saddr, relay))
+						relay = -1;
+				}
 
-							iph->daddr = ns->peer_tuple3[idx].dip;
-							UDPH(l4)->dest = ns->peer_tuple3[idx].dport;
-							UDPH(l4)->source = ns->peer_tuple3[idx].sport;
-							set_byte4((void *)UDPH(l4) + 8, __constant_htonl(NATCAP_8_MAGIC));
+				if (pick != PEER_PATH_DIRECT) {
+					natcap_peer_path_set(skb, ns, pick);
+				} else if (relay >= 0) {
+					dup_skb = skb_copy(skb, GFP_ATOMIC);
+					if (dup_skb) {
+						natcap_peer_path_set(dup_skb, ns, relay);
 
-							dup_skb->ip_summed = CHECKSUM_UNNECESSARY;
-							skb_rcsum_tcpudp(dup_skb);
-							flow_total_tx_bytes += dup_skb->len;
-						}
-						break;
+						dup_skb->ip_summed = CHECKSUM_UNNECESSARY;
+						skb_rcsum_tcpudp(dup_skb);
+						flow_total_tx_bytes += dup_skb->len;
 					}
 				}
 			}
 
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			if (skb->ip_summed != CHECKSUM_PARTIAL)
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			skb_rcsum_tcpudp(skb);
 
 			NATCAP_DEBUG("(CPO)" DEBUG_UDP_FMT ": after natcap post out\n", DEBUG_UDP_ARG(iph,l4));
@@ -2569,15 +3557,14 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		return NF_STOLEN;
 	} else if (iph->protocol == IPPROTO_UDP) {
 		if ((NS_NATCAP_ENC & ns->n.status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_data_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 				NATCAP_ERROR("(CPO)" DEBUG_UDP_FMT ": skb_make_writable() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
 			iph = ip_hdr(skb);
 			l4 = (void *)iph + iph->ihl * 4;
 
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			skb_data_hook_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
 		}
 
 		if (!(IPS_NATCAP_CFM & ct->status)) {
@@ -2854,19 +3841,14 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			unsigned int range_size, min, i;
 			struct nf_conntrack_tuple tuple;
 
-			if (cone_nat_array && cone_snat_array &&
+			if (cone_nat_table && cone_snat_table &&
 			        (!(ns->n.status & NS_NATCAP_TCPUDPENC)) &&
 			        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
 			        ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53) &&
-			        IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip") > 0) {
-				unsigned int idx;
+			        IP_SET_test_cached(ns, NATCAP_IPSET_CONE_WAN_SRC, IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip"))) {
 				struct cone_snat_session css;
 
-				idx = cone_snat_hash(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, iph->saddr) % 32768;
-				memcpy(&css, &cone_snat_array[idx], sizeof(css));
-				if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip == css.lan_ip &&
-				        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port == css.lan_port &&
-				        iph->saddr == css.wan_ip) {
+				if (cone_snat_lookup(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, iph->saddr, &css) == 0) {
 					ns->n.new_source = css.wan_port;
 				}
 			}
@@ -2910,48 +3892,27 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		UDPH(l4)->dest = ns->n.target_port;
 		iph->daddr = ns->n.target_ip;
 
-		if (cone_nat_array && cone_snat_array && ntohs(UDPH(l4)->source) >= 1024 &&
+		if (cone_nat_table && cone_snat_table && ntohs(UDPH(l4)->source) >= 1024 &&
 		        (!(ns->n.status & NS_NATCAP_TCPUDPENC)) &&
 		        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
 		        ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53) &&
-		        IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip") > 0) {
-			unsigned int idx;
-			struct cone_nat_session cns;
+		        IP_SET_test_cached(ns, NATCAP_IPSET_CONE_WAN_SRC, IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip"))) {
 			struct cone_snat_session css;
 
-			idx = ntohs(UDPH(l4)->source) % 65536;
-			memcpy(&cns, &cone_nat_array[idx], sizeof(cns));
-			if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip != cns.ip ||
-			        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port != cns.port) {
-
-				NATCAP_INFO("(CPMO)" DEBUG_UDP_FMT ": update mapping from %pI4:%u to %pI4:%u @port=%u\n", DEBUG_UDP_ARG(iph,l4),
-				            &cns.ip, ntohs(cns.port),
-				            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip,
-				            ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
-				            idx);
-
-				cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-				cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-				memcpy(&cone_nat_array[idx], &cns, sizeof(cns));
-			}
-
-			idx = cone_snat_hash(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, iph->saddr) % 32768;
-			memcpy(&css, &cone_snat_array[idx], sizeof(css));
-			if ((css.wan_ip != iph->saddr || css.wan_port != UDPH(l4)->source) ||
+			if (cone_nat_lookup(iph->saddr, UDPH(l4)->source, &css) != 0 ||
 			        css.lan_ip != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip ||
-			        css.lan_port != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port) {
-
-				NATCAP_INFO("(CPMO)" DEBUG_UDP_FMT ": update SNAT mapping from %pI4:%u=>%pI4:%u to %pI4:%u=>%pI4:%u\n", DEBUG_UDP_ARG(iph,l4),
-				            &css.lan_ip, ntohs(css.lan_port),
-				            &css.wan_ip, ntohs(css.wan_port),
-				            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
-				            &iph->saddr, ntohs(UDPH(l4)->source));
-
+			        css.lan_port != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port ||
+			        cone_snat_lookup(css.lan_ip, css.lan_port, iph->saddr, &css) != 0 ||
+			        css.wan_port != UDPH(l4)->source) {
 				css.wan_ip = iph->saddr;
 				css.wan_port = UDPH(l4)->source;
 				css.lan_ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
 				css.lan_port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-				memcpy(&cone_snat_array[idx], &css, sizeof(css));
+
+				NATCAP_INFO("(CPMO)" DEBUG_UDP_FMT ": update mapping %pI4:%u=>%pI4:%u\n", DEBUG_UDP_ARG(iph,l4),
+				            &css.lan_ip, ntohs(css.lan_port), &css.wan_ip, ntohs(css.wan_port));
+
+				cone_nat_update(&css);
 			}
 		}
 	}
@@ -3006,7 +3967,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		nf_conntrack_get(&ct->ct_general);
 		master->master = ct;
 		if (!(IPS_NATCAP & master->status) && !test_and_set_bit(IPS_NATCAP_BIT, &master->status)) {
-			if (natcap_session_init(master, GFP_ATOMIC) != 0) {
+			if (natcap_session_init(master, GFP_ATOMIC, 0) != 0) {
 				switch(iph->protocol) {
 				case IPPROTO_TCP:
 					NATCAP_WARN("(CPMO)" DEBUG_TCP_FMT ": natcap_session_init failed\n", DEBUG_TCP_ARG(iph,l4));
@@ -3072,7 +4033,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		return ret;
 	}
 
-	if (!(NS_NATCAP_NOLIMIT & master_ns->n.status) && natcap_tx_flow_ctrl(skb, master) < 0) {
+	if (!(NS_NATCAP_NOLIMIT & master_ns->n.status) && natcap_tx_flow_ctrl(skb, master, master_ns) < 0) {
 		consume_skb(skb);
 		goto out;
 	}
@@ -3240,7 +4201,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = skb_gso_segment(skb, NATCAP_GSO_FEATURES);
 			consume_skb(skb);
 			if (IS_ERR(segs)) {
 				if (skb2) {
@@ -3280,7 +4241,8 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			set_byte4((void *)UDPH(l4) + 8, __constant_htonl(NATCAP_F_MAGIC)); //no multipath for this case
 			iph->protocol = IPPROTO_UDP;
 			skb->next = NULL;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			if (skb->ip_summed != CHECKSUM_PARTIAL)
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			skb_rcsum_tcpudp(skb);
 
 			NATCAP_DEBUG("(CPMO)" DEBUG_UDP_FMT ": after natcap post out\n", DEBUG_UDP_ARG(iph,l4));
@@ -3293,7 +4255,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 
 	} else {
 		if ((NS_NATCAP_ENC & master_ns->n.status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_data_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 				NATCAP_ERROR("(CPMO)" DEBUG_UDP_FMT ": skb_make_writable() failed\n", DEBUG_UDP_ARG(iph,l4));
 				consume_skb(skb);
 				return NF_ACCEPT;
@@ -3301,8 +4263,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			iph = ip_hdr(skb);
 			l4 = (void *)iph + iph->ihl * 4;
 
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			skb_data_hook_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
 		}
 
 		if (!(IPS_NATCAP_CFM & master->status)) {
@@ -3545,7 +4506,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 					iph->saddr = master->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip;
 					TCPH(l4)->dest = master->tuplehash[IP_CT_DIR_REPLY].tuple.dst.u.all;
 					TCPH(l4)->source = master->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all;
-					if (!is_natcap_server(iph->saddr) && IP_SET_test_src_ip(state, in, out, skb, "cniplist") <= 0) {
+					if (!is_natcap_server(iph->saddr) && IP_SET_test_src_cniplist(state, in, out, skb) <= 0) {
 						NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": multi-conn natcap got response add target to gfwlist0\n", DEBUG_TCP_ARG(iph,l4));
 						IP_SET_add_src_ip(state, in, out, skb, "gfwlist0");
 					}
@@ -3612,7 +4573,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 		} else {
 			if (TCPH(l4)->rst && cnipwhitelist_mode == 0) {
 				if ((TCPH(l4)->source == __constant_htons(80) || TCPH(l4)->source == __constant_htons(443)) &&
-				        IP_SET_test_src_ip(state, in, out, skb, "cniplist") <= 0) {
+				        IP_SET_test_src_cniplist(state, in, out, skb) <= 0) {
 					NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": bypass get reset add target to gfwlist0\n", DEBUG_TCP_ARG(iph,l4));
 					IP_SET_add_src_ip(state, in, out, skb, "gfwlist0");
 				}
@@ -3620,7 +4581,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 			if (!(IPS_NATCAP_CFM & ct->status) && !test_and_set_bit(IPS_NATCAP_CFM_BIT, &ct->status)) {
 				NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": got cfm\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
-				if (cnipwhitelist_mode == 0 && !TCPH(l4)->rst && IP_SET_test_src_ip(state, in, out, skb, "cniplist") > 0) {
+				if (cnipwhitelist_mode == 0 && !TCPH(l4)->rst && IP_SET_test_src_cniplist(state, in, out, skb) > 0) {
 					NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": multi-conn bypass got response add target to bypasslist\n", DEBUG_TCP_ARG(iph,l4));
 					IP_SET_add_src_ip(state, in, out, skb, "bypasslist");
 				}
@@ -3834,7 +4795,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 				}
 
 				is_cn_domain = 0;
-				if (cn_domain) {
+				if (rcu_access_pointer(cn_domain)) {
 					int name_len;
 					char name[128];
 					if ((name_len = get_rdata(p, len, pos, name, 127)) > 0) {
@@ -3897,13 +4858,13 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 							if ((IPS_NATCAP & ct->status)) {
 								old_ip = iph->daddr;
 								iph->daddr = ip;
-								if (IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0 && dns_proxy_drop) {
+								if (IP_SET_test_dst_cniplist(state, in, out, skb) > 0 && dns_proxy_drop) {
 									NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x proxy DNS ANS is in cniplist ip = %pI4, ignore\n",
 									            DEBUG_UDP_ARG(iph,l4), id, &ip);
 									return NF_DROP;
 								}
 								iph->daddr = old_ip;
-								if (is_cn_domain && cn_domain) {
+								if (is_cn_domain && rcu_access_pointer(cn_domain)) {
 									NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x proxy DNS ANS drop cn_domain\n",
 									            DEBUG_UDP_ARG(iph,l4), id);
 									return NF_DROP;
@@ -3911,9 +4872,9 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 							} else {
 								old_ip = iph->daddr;
 								iph->daddr = ip;
-								if (IP_SET_test_dst_ip(state, in, out, skb, "dnsdroplist") > 0 || IP_SET_test_dst_ip(state, in, out, skb, "cniplist") <= 0) {
+								if (IP_SET_test_dst_ip(state, in, out, skb, "dnsdroplist") > 0 || IP_SET_test_dst_cniplist(state, in, out, skb) <= 0) {
 									iph->daddr = old_ip;
-									if (!is_cn_domain && cn_domain) {
+									if (!is_cn_domain && rcu_access_pointer(cn_domain)) {
 										NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x direct DNS ANS is not cniplist ip = %pI4, drop\n",
 										            DEBUG_UDP_ARG(iph,l4), id, &ip);
 										return NF_DROP;
@@ -3929,7 +4890,21 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 					if (rdlength == 16) {
 						unsigned char *ipv6 = p + pos;
 						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ipv6=%pI6\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength, ipv6);
-					}
+						if ((IPS_NATCAP & ct->status)) {
+							if (cniplist6_lookup((const struct in6_addr *)ipv6) > 0 && dns_proxy_drop) {
+								NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x proxy DNS ANS is in cniplist6 ip = %pI6, ignore\n",
+								            DEBUG_UDP_ARG(iph,l4), id, ipv6);
+								return NF_DROP;
+							}
+						} else {
+							if (cniplist6_lookup((const struct in6_addr *)ipv6) == 0 &&
+							        !is_cn_domain && rcu_access_pointer(cn_domain)) {
+								NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x direct DNS ANS is not cniplist6 ip = %pI6, drop\n",
+								            DEBUG_UDP_ARG(iph,l4), id, ipv6);
+								return NF_DROP;
+							}
+						}
+					}
 					break;
 
 				case 2: //NS
@@ -3966,14 +4941,207 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 	return NF_ACCEPT;
 }
 
-void cn_domain_clean(void)
+/* builder: collects encoded keys, see cn_domain_build.h */
+#define CN_DOMAIN_BLOB_MAX (64 * 1024 * 1024)
+
+struct cn_domain_builder {
+	char *pool;
+	unsigned int pool_len;
+	unsigned int pool_size;
+	unsigned int *keys;
+	unsigned int count;
+	unsigned int size;
+};
+
+static DEFINE_MUTEX(cn_domain_mutex);
+/* cn_domain_queue= keys waiting for cn_domain_commit, under cn_domain_mutex */
+static struct cn_domain_builder cn_domain_pending;
+
+static void cn_domain_builder_init(struct cn_domain_builder *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+static void cn_domain_builder_free(struct cn_domain_builder *b)
+{
+	if (b->pool)
+		vfree(b->pool);
+	if (b->keys)
+		vfree(b->keys);
+	memset(b, 0, sizeof(*b));
+}
+
+static int cn_domain_builder_add_key(struct cn_domain_builder *b, const char *key, int len)
 {
-	if (cn_domain) {
-		vfree(cn_domain);
-		cn_domain = NULL;
-		cn_domain_size = 0;
-		cn_domain_count = 0;
+	if (b->pool_len + len + 1 > b->pool_size) {
+		char *tmp;
+		unsigned int size = b->pool_size ? b->pool_size * 2 : 256 * 1024;
+		while (b->pool_len + len + 1 > size)
+			size *= 2;
+		tmp = vmalloc(size);
+		if (tmp == NULL)
+			return -ENOMEM;
+		if (b->pool) {
+			memcpy(tmp, b->pool, b->pool_len);
+			vfree(b->pool);
+		}
+		b->pool = tmp;
+		b->pool_size = size;
+	}
+	if (b->count + 1 > b->size) {
+		unsigned int *tmp;
+		unsigned int size = b->size ? b->size * 2 : 16 * 1024;
+		tmp = vmalloc(size * sizeof(unsigned int));
+		if (tmp == NULL)
+			return -ENOMEM;
+		if (b->keys) {
+			memcpy(tmp, b->keys, b->count * sizeof(unsigned int));
+			vfree(b->keys);
+		}
+		b->keys = tmp;
+		b->size = size;
 	}
+
+	memcpy(b->pool + b->pool_len, key, len);
+	b->pool[b->pool_len + len] = 0;
+	b->keys[b->count++] = b->pool_len;
+	b->pool_len += len + 1;
+
+	return 0;
+}
+
+static int cn_domain_builder_add(struct cn_domain_builder *b, const char *d, int len)
+{
+	char key[CN_DOMAIN_MAX_KEY];
+	int klen = cn_domain_key_encode(key, d, len);
+
+	if (klen <= 0)
+		return klen;
+
+	return cn_domain_builder_add_key(b, key, klen);
+}
+
+static struct cn_domain_trie *cn_domain_build(struct cn_domain_builder *b)
+{
+	struct cn_domain_trie *t;
+	const char **keys;
+	unsigned int i;
+	int err;
+
+	keys = vmalloc((b->count + 1) * sizeof(char *));
+	if (keys == NULL)
+		return ERR_PTR(-ENOMEM);
+	for (i = 0; i < b->count; i++)
+		keys[i] = b->pool + b->keys[i];
+
+	err = cn_domain_trie_build(keys, b->count, &t);
+	vfree(keys);
+	if (err != 0)
+		return ERR_PTR(err);
+
+	return t;
+}
+
+struct cn_domain_thaw_ctx {
+	unsigned int stack[CN_DOMAIN_MAX_KEY / 2 + 1];
+	unsigned int klen[CN_DOMAIN_MAX_KEY / 2 + 1];
+	char key[CN_DOMAIN_MAX_KEY];
+};
+
+/* walk the trie in key order and feed every domain back into a builder */
+static int __cn_domain_thaw(const struct cn_domain_trie *t, struct cn_domain_builder *b, struct cn_domain_thaw_ctx *ctx)
+{
+	unsigned int *stack = ctx->stack;
+	unsigned int *klen = ctx->klen;
+	const char *pool = cn_domain_trie_pool(t);
+	char *key = ctx->key;
+	int depth = 0;
+	int err;
+
+	stack[0] = 0;
+	klen[0] = 0;
+	while (depth >= 0) {
+		const struct cn_domain_node *node = &t->nodes[stack[depth]];
+		const struct cn_domain_node *parent;
+
+		if ((node->nchild & CN_DOMAIN_NODE_END) && (err = cn_domain_builder_add_key(b, key, klen[depth])) != 0)
+			return err;
+
+		if (CN_DOMAIN_NCHILD(node) > 0 && depth + 1 < ARRAY_SIZE(ctx->stack)) {
+			stack[depth + 1] = node->child;
+		} else {
+			/* go to the next sibling, climbing up as needed */
+			while (depth > 0) {
+				parent = &t->nodes[stack[depth - 1]];
+				if (stack[depth] + 1 < parent->child + CN_DOMAIN_NCHILD(parent)) {
+					stack[depth]++;
+					break;
+				}
+				depth--;
+			}
+			if (depth == 0)
+				break;
+			depth--;
+		}
+
+		depth++;
+		node = &t->nodes[stack[depth]];
+		klen[depth] = klen[depth - 1];
+		if (klen[depth] + 1 + CN_DOMAIN_LABEL_LEN(node) >= CN_DOMAIN_MAX_KEY)
+			return -EINVAL;
+		if (klen[depth])
+			key[klen[depth]++] = CN_DOMAIN_SEP;
+		memcpy(key + klen[depth], pool + CN_DOMAIN_LABEL_OFF(node), CN_DOMAIN_LABEL_LEN(node));
+		klen[depth] += CN_DOMAIN_LABEL_LEN(node);
+	}
+
+	return 0;
+}
+
+/* the walk state is ~1.3KB, too much for the stack of the 32bit targets */
+static int cn_domain_thaw(const struct cn_domain_trie *t, struct cn_domain_builder *b)
+{
+	struct cn_domain_thaw_ctx *ctx;
+	int err;
+
+	ctx = kmalloc(sizeof(struct cn_domain_thaw_ctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+	err = __cn_domain_thaw(t, b, ctx);
+	kfree(ctx);
+
+	return err;
+}
+
+static void cn_domain_publish(struct cn_domain_trie *t)
+{
+	struct cn_domain_trie *old;
+
+	old = rcu_dereference_protected(cn_domain, lockdep_is_held(&cn_domain_mutex));
+	rcu_assign_pointer(cn_domain, t);
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+}
+
+static int cn_domain_commit(struct cn_domain_builder *b)
+{
+	struct cn_domain_trie *t = cn_domain_build(b);
+
+	if (IS_ERR(t))
+		return PTR_ERR(t);
+
+	cn_domain_publish(t);
+	return 0;
+}
+
+void cn_domain_clean(void)
+{
+	mutex_lock(&cn_domain_mutex);
+	cn_domain_builder_free(&cn_domain_pending);
+	cn_domain_publish(NULL);
+	mutex_unlock(&cn_domain_mutex);
 }
 
 void domain_copy(char *dst, char *from)
@@ -3991,179 +5159,136 @@ void domain_copy(char *dst, char *from)
 	}
 }
 
-int domain_cmp(char *dst, char *src)
+/* called with cn_domain_mutex held: rebuild the trie once with everything queued */
+static int __cn_domain_insert_commit(void)
 {
-	int i;
-	int len = strlen(src);
-	for (i = CN_DOMAIN_SIZE - 1; i >= 0 && len > 0;)
-	{
-		len--;
-		if (dst[i] == 0) {
-			return -1;
-		}
-		if (dst[i] == '.' && src[len] == '.') {
-			i--;
-			continue;
-		}
-		if (dst[i] == '.' && src[len] != '.') {
-			return -1;
-		}
-		if (dst[i] != '.' && src[len] == '.') {
-			return 1;
-		}
-		if (dst[i] < src[len]) {
-			return -1;
-		} else if (dst[i] > src[len]) {
-			return 1;
-		}
-		i--;
-	}
+	int err = 0;
+	unsigned int i;
+	struct cn_domain_trie *t;
+	struct cn_domain_builder b;
 
-	if (len == 0 && (i == -1 || (i > 0 && dst[i] == 0))) {
+	if (cn_domain_pending.count == 0)
 		return 0;
-	}
-	if (i == -1 && len > 0) {
-		return -1;
-	}
 
-	return 1;
+	cn_domain_builder_init(&b);
+	t = rcu_dereference_protected(cn_domain, lockdep_is_held(&cn_domain_mutex));
+	if (t && (err = cn_domain_thaw(t, &b)) != 0)
+		goto out;
+	for (i = 0; i < cn_domain_pending.count; i++) {
+		const char *key = cn_domain_pending.pool + cn_domain_pending.keys[i];
+		err = cn_domain_builder_add_key(&b, key, strlen(key));
+		if (err)
+			goto out;
+	}
+	err = cn_domain_commit(&b);
+	if (err == 0)
+		cn_domain_builder_free(&cn_domain_pending);
+out:
+	cn_domain_builder_free(&b);
+	return err;
 }
 
+/* rebuilds the whole trie, use cn_domain_queue() + cn_domain_insert_commit() for many domains */
 int cn_domain_insert(char *d)
 {
-	int low;
-	int high;
-	int mid;
-	int res = 0;
+	int err;
 
-	if (cn_domain == NULL) {
-		cn_domain_count = 0;
-		cn_domain_size = 128 * 1024 / CN_DOMAIN_SIZE;
-		cn_domain = vmalloc(CN_DOMAIN_SIZE * cn_domain_size);
-		if (cn_domain == NULL) {
-			return -ENOMEM;
-		}
-		memset(cn_domain, 0, CN_DOMAIN_SIZE * cn_domain_size);
-	}
-	if (cn_domain_count + 1 > cn_domain_size) {
-		char *tmp;
-		cn_domain_size = cn_domain_size + 128 * 1024 / CN_DOMAIN_SIZE;
-		tmp = vmalloc(CN_DOMAIN_SIZE * cn_domain_size);
-		if (tmp == NULL) {
-			return -ENOMEM;
-		}
-		memset(tmp, 0, CN_DOMAIN_SIZE * cn_domain_size);
-		memcpy(tmp, cn_domain, (cn_domain_size - 128 * 1024 / CN_DOMAIN_SIZE) * CN_DOMAIN_SIZE);
-		vfree(cn_domain);
-		cn_domain = tmp;
-		printk("cn_domain_insert cn_domain_size=%d mem=%d\n", cn_domain_size, cn_domain_size * CN_DOMAIN_SIZE);
-	}
-	if (cn_domain_count == 0) {
-		domain_copy(cn_domain + cn_domain_count * CN_DOMAIN_SIZE, d);
-		cn_domain_count++;
-		return 0;
-	}
+	mutex_lock(&cn_domain_mutex);
+	err = cn_domain_builder_add(&cn_domain_pending, d, strlen(d));
+	if (err == 0)
+		err = __cn_domain_insert_commit();
+	mutex_unlock(&cn_domain_mutex);
 
-	low = 0;
-	high = cn_domain_count - 1;
-	while (low <= high) {
-		mid = (low + high) / 2;
-		res = domain_cmp(cn_domain + mid * CN_DOMAIN_SIZE, d);
-		if (res == 0) {
-			return 0;
-		}
-		if (res < 0) {
-			low = mid + 1;
-		} else {
-			high = mid - 1;
-		}
-	}
+	return err;
+}
 
-	if (res < 0) {
-		memmove(cn_domain + mid * CN_DOMAIN_SIZE + CN_DOMAIN_SIZE + CN_DOMAIN_SIZE, cn_domain + mid * CN_DOMAIN_SIZE + CN_DOMAIN_SIZE, (cn_domain_count - mid - 1) * CN_DOMAIN_SIZE);
-		domain_copy(cn_domain + (mid + 1) * CN_DOMAIN_SIZE, d);
-		cn_domain_count++;
-	} else {
-		memmove(cn_domain + mid * CN_DOMAIN_SIZE + CN_DOMAIN_SIZE, cn_domain + mid * CN_DOMAIN_SIZE, (cn_domain_count - mid) * CN_DOMAIN_SIZE);
-		domain_copy(cn_domain + mid * CN_DOMAIN_SIZE, d);
-		cn_domain_count++;
-	}
+/* only queues the domain, it takes effect with the next cn_domain_insert_commit() or cn_domain_insert() */
+int cn_domain_queue(char *d)
+{
+	int err;
 
-	return 0;
+	mutex_lock(&cn_domain_mutex);
+	err = cn_domain_builder_add(&cn_domain_pending, d, strlen(d));
+	mutex_unlock(&cn_domain_mutex);
+
+	return err;
 }
 
-int domain_match(char *dst, char *src)
+int cn_domain_insert_commit(void)
 {
-	int i;
-	int len = strlen(src);
-	for (i = CN_DOMAIN_SIZE - 1; i >= 0 && len > 0;)
-	{
-		len--;
-		if (dst[i] == 0) {
-			if (src[len] == '.')
-				return 0;
-			else
-				return -1;
-		}
-		if (dst[i] == '.' && src[len] == '.') {
-			i--;
-			continue;
-		}
-		if (dst[i] == '.' && src[len] != '.') {
-			return -1;
-		}
-		if (dst[i] != '.' && src[len] == '.') {
-			return 1;
+	int err;
+
+	mutex_lock(&cn_domain_mutex);
+	err = __cn_domain_insert_commit();
+	mutex_unlock(&cn_domain_mutex);
+
+	return err;
+}
+
+static int cn_domain_trie_match(const struct cn_domain_trie *t, const char *d, int len)
+{
+	const struct cn_domain_node *node = &t->nodes[0];
+	const char *pool = cn_domain_trie_pool(t);
+	int end = len;
+
+	while (end > 0) {
+		const struct cn_domain_node *found = NULL;
+		unsigned int lo, hi, mid;
+		unsigned int llen;
+		int start = end;
+		int res;
+
+		while (start > 0 && d[start - 1] != '.')
+			start--;
+		llen = end - start;
+
+		lo = node->child;
+		hi = lo + CN_DOMAIN_NCHILD(node);
+		while (lo < hi) {
+			const struct cn_domain_node *c;
+			unsigned int clen;
+
+			mid = lo + (hi - lo) / 2;
+			c = &t->nodes[mid];
+			clen = CN_DOMAIN_LABEL_LEN(c);
+			res = memcmp(pool + CN_DOMAIN_LABEL_OFF(c), d + start, min(clen, llen));
+			if (res == 0)
+				res = (int)clen - (int)llen;
+			if (res == 0) {
+				found = c;
+				break;
+			}
+			if (res < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
 		}
-		if (dst[i] < src[len]) {
-			return -1;
-		} else if (dst[i] > src[len]) {
+		if (found == NULL)
+			return 0;
+		if ((found->nchild & CN_DOMAIN_NODE_END))
 			return 1;
-		}
-		i--;
-	}
 
-	if (len == 0 && (i == -1 || (i > 0 && dst[i] == 0))) {
-		return 0;
-	}
-	if (i == -1 && len > 0) {
-		if (src[len] == '.')
-			return 0;
-		else
-			return -1;
+		node = found;
+		end = start - 1;
 	}
 
-	return 1;
+	return 0;
 }
 
 int cn_domain_lookup(char *d)
 {
-	int low;
-	int high;
-	int mid;
-	int res;
+	int ret = 0;
+	struct cn_domain_trie *t;
 
-	if (cn_domain == NULL || cn_domain_count == 0) {
-		return 0;
+	rcu_read_lock();
+	t = rcu_dereference(cn_domain);
+	if (t) {
+		ret = cn_domain_trie_match(t, d, strlen(d));
 	}
+	rcu_read_unlock();
 
-	low = 0;
-	high = cn_domain_count - 1;
-	while (low <= high) {
-		mid = (low + high) / 2;
-		res = domain_match(cn_domain + mid * CN_DOMAIN_SIZE, d);
-		if (res == 0) {
-			/* found match */
-			return 1;
-		}
-		if (res < 0) {
-			low = mid + 1;
-		} else {
-			high = mid - 1;
-		}
-	}
-
-	return 0;
+	return ret;
 }
 
 int cn_domain_load_from_path(char *path)
@@ -4171,132 +5296,907 @@ int cn_domain_load_from_path(char *path)
 	loff_t pos = 0;
 	ssize_t bytes = 0;
 	struct file *filp;
+	struct cn_domain_builder b;
 	char *buf;
 	int r_idx = 0;
 	int r_cnt = 0;
 	int i, s;
-	int err;
+	int err = 0;
 	int count = 0;
 
 	buf = kmalloc(4096, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
 	filp = filp_open(path, O_RDONLY, 0);
 	if (IS_ERR(filp)) {
 		printk("unable to open cn_domain file: %s\n", path);
+		kfree(buf);
 		return -1;
 	}
 
+	cn_domain_builder_init(&b);
+
 	while ((bytes = kernel_read(filp, buf + r_idx, 4096 - r_idx, &pos)) > 0) {
 		r_cnt = r_idx + bytes;
 		s = 0;
-		for (i = 0; i < r_cnt;) {
-			s = i;
-			for (; i < r_cnt;) {
-				if (buf[i] == '\n') {
+		for (i = 0; i < r_cnt; i++) {
+			if (buf[i] == '\n') {
+				err = cn_domain_builder_add(&b, buf + s, (i > s && buf[i - 1] == '\r') ? i - s - 1 : i - s);
+				if (err == -ENOMEM) {
+					goto out;
+				}
+				if (err) {
 					buf[i] = 0;
-					err = cn_domain_insert(buf + s);
-					if (err) {
-						return err;
-					}
-					if (strlen(buf + s) > CN_DOMAIN_SIZE) printk("cn_domain_insert %d(%s)\n", count, buf + s);
-					count++;
-					s = i + 1;
-					i++;
-					break;
+					printk("cn_domain_load_from_path skip %d(%s)\n", count, buf + s);
 				}
-				i++;
+				count++;
+				s = i + 1;
 			}
 		}
-		memmove(buf, buf + s, i - s);
-		r_idx = i - s;
+		if (s == 0 && r_cnt == 4096) {
+			/* line too long, drop it */
+			s = r_cnt;
+		}
+		memmove(buf, buf + s, r_cnt - s);
+		r_idx = r_cnt - s;
+	}
+	if (r_idx > 0 && cn_domain_builder_add(&b, buf, r_idx) == 0) {
+		count++;
 	}
+
+	mutex_lock(&cn_domain_mutex);
+	err = cn_domain_commit(&b);
+	mutex_unlock(&cn_domain_mutex);
+	if (err == 0)
+		printk("cn_domain_load_from_path %d records loaded\n", count);
+
+out:
+	cn_domain_builder_free(&b);
 	kfree(buf);
 	filp_close(filp, NULL);
-	printk("cn_domain_load_from_path %d records loaded\n", count);
-	return 0;
+	return err;
 }
 
+/* load the legacy dump: CN_DOMAIN_SIZE bytes per domain, right aligned */
 int cn_domain_load_from_raw(char *path)
 {
-	int ret = -1;
+	int err = 0;
 	loff_t pos = 0;
 	ssize_t bytes = 0;
 	struct file *filp;
+	struct cn_domain_builder b;
 	char *buf;
-	char *cn_domain_tmp = NULL;
-	int cn_domain_tmp_size = 0;
 	int nbytes = 0;
+	int r_idx = 0;
+	int i, s;
 
 	buf = kmalloc(4096, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
 	filp = filp_open(path, O_RDONLY, 0);
 	if (IS_ERR(filp)) {
 		printk("unable to open cn_domain raw: %s\n", path);
+		kfree(buf);
 		return -1;
 	}
 
-	while ((bytes = kernel_read(filp, buf, 4096, &pos)) > 0) {
-		if (cn_domain_tmp == NULL || nbytes + bytes > cn_domain_tmp_size * CN_DOMAIN_SIZE) {
-			char *tmp;
-			cn_domain_tmp_size += 128 * 1024 / CN_DOMAIN_SIZE;
-			tmp = vmalloc(cn_domain_tmp_size * CN_DOMAIN_SIZE);
-			if (tmp == NULL) {
-				if (cn_domain_tmp)
-					vfree(cn_domain_tmp);
-				ret = -ENOMEM;
-				goto out;
+	cn_domain_builder_init(&b);
+
+	while ((bytes = kernel_read(filp, buf + r_idx, 4096 - r_idx, &pos)) > 0) {
+		nbytes += bytes;
+		r_idx += bytes;
+		for (i = 0; i + CN_DOMAIN_SIZE <= r_idx; i += CN_DOMAIN_SIZE) {
+			for (s = 0; s < CN_DOMAIN_SIZE && buf[i + s] == 0; s++);
+			if (s < CN_DOMAIN_SIZE) {
+				err = cn_domain_builder_add(&b, buf + i + s, CN_DOMAIN_SIZE - s);
+				if (err == -ENOMEM) {
+					goto out;
+				}
 			}
-			if (cn_domain_tmp) {
-				memcpy(tmp, cn_domain_tmp, (cn_domain_tmp_size - 128 * 1024 / CN_DOMAIN_SIZE) * CN_DOMAIN_SIZE);
-				vfree(cn_domain_tmp);
+		}
+		memmove(buf, buf + i, r_idx - i);
+		r_idx -= i;
+	}
+
+	mutex_lock(&cn_domain_mutex);
+	err = cn_domain_commit(&b);
+	mutex_unlock(&cn_domain_mutex);
+	if (err == 0)
+		printk("cn_domain_load_from_raw count:%u bytes:%d\n", b.count, nbytes);
+
+out:
+	cn_domain_builder_free(&b);
+	kfree(buf);
+	filp_close(filp, NULL);
+	return err;
+}
+
+static int cn_domain_verify(const struct cn_domain_trie *t, size_t size)
+{
+	unsigned int i, j, len;
+	size_t remain;
+	unsigned char *klen;
+	int err = 0;
+
+	if (t->magic != CN_DOMAIN_MAGIC) {
+		if (t->magic == swab32(CN_DOMAIN_MAGIC))
+			printk("cn_domain blob has the wrong byte order\n");
+		return -EINVAL;
+	}
+	if (t->version != CN_DOMAIN_VERSION) {
+		return -EINVAL;
+	}
+	/* take each part off what is left, so no count from the blob is ever multiplied or added unchecked */
+	if (size < sizeof(struct cn_domain_trie)) {
+		return -EINVAL;
+	}
+	remain = size - sizeof(struct cn_domain_trie);
+	if (t->node_count == 0 || t->node_count > remain / sizeof(struct cn_domain_node)) {
+		return -EINVAL;
+	}
+	remain -= (size_t)t->node_count * sizeof(struct cn_domain_node);
+	if (t->pool_size != remain) {
+		return -EINVAL;
+	}
+
+	/* klen[i]: the longest encoded key reaching node i, final by the time i is looked at */
+	klen = vmalloc(t->node_count);
+	if (klen == NULL) {
+		return -ENOMEM;
+	}
+	memset(klen, 0, t->node_count);
+
+	/* a child always comes after its parent, so the layout cannot loop */
+	for (i = 0; i < t->node_count; i++) {
+		const struct cn_domain_node *node = &t->nodes[i];
+		if (CN_DOMAIN_LABEL_LEN(node) > CN_DOMAIN_MAX_LABEL ||
+		        CN_DOMAIN_LABEL_OFF(node) + CN_DOMAIN_LABEL_LEN(node) > t->pool_size) {
+			err = -EINVAL;
+			break;
+		}
+		if (CN_DOMAIN_NCHILD(node) > 0 &&
+		        (node->child <= i || node->child >= t->node_count || CN_DOMAIN_NCHILD(node) > t->node_count - node->child)) {
+			err = -EINVAL;
+			break;
+		}
+		for (j = node->child; j < node->child + CN_DOMAIN_NCHILD(node); j++) {
+			len = klen[i] + (klen[i] ? 1 : 0) + CN_DOMAIN_LABEL_LEN(&t->nodes[j]);
+			if (len >= CN_DOMAIN_MAX_KEY) {
+				err = -EINVAL;
+				break;
 			}
-			cn_domain_tmp = tmp;
+			if (len > klen[j])
+				klen[j] = len;
 		}
-		memcpy(cn_domain_tmp + nbytes, buf, bytes);
-		nbytes += bytes;
+		if (err)
+			break;
 	}
 
-	cn_domain_clean();
+	vfree(klen);
+	return err;
+}
 
-	cn_domain = cn_domain_tmp;
-	cn_domain_size = cn_domain_tmp_size;
-	cn_domain_count = nbytes / CN_DOMAIN_SIZE;
+/* adopt a blob built by natcapd/cn_domain_compile with one copy, no parsing */
+int cn_domain_load_from_blob(char *path)
+{
+	int err = 0;
+	loff_t pos = 0;
+	loff_t size;
+	ssize_t bytes = 0;
+	struct file *filp;
+	struct cn_domain_trie *t;
 
-	printk("cn_domain_load_from_raw size:%d count:%d bytes:%d\n", cn_domain_size, cn_domain_count, nbytes);
+	filp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(filp)) {
+		printk("unable to open cn_domain blob: %s\n", path);
+		return -1;
+	}
+
+	size = i_size_read(file_inode(filp));
+	if (size < sizeof(struct cn_domain_trie) || size > CN_DOMAIN_BLOB_MAX) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	t = vmalloc(size);
+	if (t == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	while (pos < size && (bytes = kernel_read(filp, (char *)t + pos, size - pos, &pos)) > 0);
+	if (pos != size) {
+		vfree(t);
+		err = -EIO;
+		goto out;
+	}
+
+	err = cn_domain_verify(t, size);
+	if (err) {
+		printk("cn_domain blob %s is invalid\n", path);
+		vfree(t);
+		goto out;
+	}
+
+	mutex_lock(&cn_domain_mutex);
+	cn_domain_publish(t);
+	mutex_unlock(&cn_domain_mutex);
+
+	printk("cn_domain_load_from_blob count:%u nodes:%u bytes:%u\n", t->count, t->node_count, (unsigned int)size);
 
 out:
-	kfree(buf);
 	filp_close(filp, NULL);
-	return 0;
+	return err;
 }
 
+/* dump in the legacy raw format, so cn_domain_raw= can read it back */
 int cn_domain_dump_path(char *path)
 {
 	loff_t pos = 0;
 	ssize_t bytes = 0;
 	struct file *filp;
+	struct cn_domain_trie *t;
+	struct cn_domain_builder b;
+	char *buf;
+	char name[CN_DOMAIN_MAX_KEY];
+	unsigned int i;
+	int n = 0;
+	int err = 0;
+
+	cn_domain_builder_init(&b);
 
-	if (cn_domain == NULL) {
+	mutex_lock(&cn_domain_mutex);
+	t = rcu_dereference_protected(cn_domain, lockdep_is_held(&cn_domain_mutex));
+	if (t == NULL) {
+		mutex_unlock(&cn_domain_mutex);
 		return -1;
 	}
+	err = cn_domain_thaw(t, &b);
+	mutex_unlock(&cn_domain_mutex);
+	if (err) {
+		cn_domain_builder_free(&b);
+		return err;
+	}
+
+	buf = kmalloc(4096, GFP_KERNEL);
+	if (!buf) {
+		cn_domain_builder_free(&b);
+		return -ENOMEM;
+	}
 
 	filp = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE | O_DSYNC, 0);
 	if (IS_ERR(filp)) {
 		printk("unable to open cn_domain dump: %s\n", path);
+		kfree(buf);
+		cn_domain_builder_free(&b);
 		return -1;
 	}
 
-	bytes = kernel_write(filp, cn_domain + pos, cn_domain_count * CN_DOMAIN_SIZE - pos, &pos);
-	printk("cn_domain dump: write %d\n", (int)bytes);
+	for (i = 0; i < b.count; i++) {
+		const char *k = b.pool + b.keys[i];
+		int len = strlen(k);
+		int end = len;
+		int l = 0;
+
+		/* decode "com\001baidu" back to "baidu.com" */
+		while (end > 0) {
+			int start = end;
+			while (start > 0 && k[start - 1] != CN_DOMAIN_SEP)
+				start--;
+			if (l)
+				name[l++] = '.';
+			memcpy(name + l, k + start, end - start);
+			l += end - start;
+			end = start - 1;
+		}
+		name[l] = 0;
+
+		domain_copy(buf + n, name);
+		n += CN_DOMAIN_SIZE;
+		if (n == 4096 || i + 1 == b.count) {
+			bytes = kernel_write(filp, buf, n, &pos);
+			if (bytes != n) {
+				err = -1;
+				break;
+			}
+			n = 0;
+		}
+	}
+	printk("cn_domain dump: write %d\n", (int)pos);
 
 	filp_close(filp, NULL);
+	kfree(buf);
+	cn_domain_builder_free(&b);
 
-	if (bytes != cn_domain_count * CN_DOMAIN_SIZE) {
-		return -1;
+	return err;
+}
+
+/* cniplist is a 16-8-8 multibit trie over the cniplist prefixes: l1 is indexed by the
+ * top 16 bits, l2 nodes by the next octet and l3 nodes are bitmaps of the last octet.
+ * l1/l2 slots hold CNIPLIST_MISS, CNIPLIST_HIT or CNIPLIST_NODE + index of the child */
+#define CNIPLIST_MISS 0
+#define CNIPLIST_HIT 1
+#define CNIPLIST_NODE 2
+#define CNIPLIST_L3_LONGS BITS_TO_LONGS(256)
+#define CNIPLIST_MAX_L3 65536
+
+struct cniplist_trie {
+	unsigned int prefixes;
+	unsigned int l2_count;
+	unsigned int l3_count;
+	u32 *l2;
+	unsigned long *l3;
+	u32 l1[1 << 16];
+};
+
+struct cniplist_builder {
+	u32 *l1;
+	u32 *l2;
+	unsigned long *l3;
+	unsigned int l2_count;
+	unsigned int l2_size;
+	unsigned int l3_count;
+	unsigned int l3_size;
+	unsigned int prefixes;
+};
+
+static struct cniplist_trie __rcu *cniplist = NULL;
+static DEFINE_MUTEX(cniplist_mutex);
+
+static int cniplist_builder_init(struct cniplist_builder *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->l1 = vmalloc(sizeof(u32) << 16);
+	if (!b->l1)
+		return -ENOMEM;
+	memset(b->l1, 0, sizeof(u32) << 16);
+	return 0;
+}
+
+static void cniplist_builder_free(struct cniplist_builder *b)
+{
+	if (b->l1)
+		vfree(b->l1);
+	if (b->l2)
+		vfree(b->l2);
+	if (b->l3)
+		vfree(b->l3);
+	memset(b, 0, sizeof(*b));
+}
+
+/* double a node array, the old one is kept on failure */
+static void *cniplist_builder_grow(void *old, unsigned int count, unsigned int *size, unsigned int elem)
+{
+	unsigned int n = *size ? *size * 2 : 64;
+	void *tmp = vmalloc((size_t)n * elem);
+
+	if (!tmp)
+		return NULL;
+	if (old) {
+		memcpy(tmp, old, (size_t)count * elem);
+		vfree(old);
+	}
+	*size = n;
+	return tmp;
+}
+
+static int cniplist_builder_l2(struct cniplist_builder *b)
+{
+	if (b->l2_count == b->l2_size) {
+		u32 *tmp = cniplist_builder_grow(b->l2, b->l2_count, &b->l2_size, 256 * sizeof(u32));
+		if (!tmp)
+			return -ENOMEM;
+		b->l2 = tmp;
 	}
+	memset(b->l2 + b->l2_count * 256, 0, 256 * sizeof(u32));
+	return b->l2_count++;
+}
+
+static int cniplist_builder_l3(struct cniplist_builder *b)
+{
+	if (b->l3_count >= CNIPLIST_MAX_L3)
+		return -ENOSPC;
+	if (b->l3_count == b->l3_size) {
+		unsigned long *tmp = cniplist_builder_grow(b->l3, b->l3_count, &b->l3_size, CNIPLIST_L3_LONGS * sizeof(unsigned long));
+		if (!tmp)
+			return -ENOMEM;
+		b->l3 = tmp;
+	}
+	memset(b->l3 + b->l3_count * CNIPLIST_L3_LONGS, 0, CNIPLIST_L3_LONGS * sizeof(unsigned long));
+	return b->l3_count++;
+}
+
+static int cniplist_builder_add(struct cniplist_builder *b, u32 ip, unsigned int cidr)
+{
+	unsigned int i;
+	u32 *slot;
+	int idx;
+
+	if (cidr > 32)
+		return -EINVAL;
+	ip &= cidr ? ~0U << (32 - cidr) : 0;
+	b->prefixes++;
+
+	if (cidr <= 16) {
+		for (i = 0; i < (1U << (16 - cidr)); i++)
+			b->l1[(ip >> 16) + i] = CNIPLIST_HIT;
+		return 0;
+	}
+
+	if (b->l1[ip >> 16] == CNIPLIST_HIT)
+		return 0;
+	if (b->l1[ip >> 16] == CNIPLIST_MISS) {
+		idx = cniplist_builder_l2(b);
+		if (idx < 0)
+			return idx;
+		b->l1[ip >> 16] = CNIPLIST_NODE + idx;
+	}
+	slot = b->l2 + (b->l1[ip >> 16] - CNIPLIST_NODE) * 256 + ((ip >> 8) & 0xff);
+
+	if (cidr <= 24) {
+		for (i = 0; i < (1U << (24 - cidr)); i++)
+			slot[i] = CNIPLIST_HIT;
+		return 0;
+	}
+
+	if (*slot == CNIPLIST_HIT)
+		return 0;
+	if (*slot == CNIPLIST_MISS) {
+		/* only l3 can move here, slot points into l2 */
+		idx = cniplist_builder_l3(b);
+		if (idx < 0)
+			return idx;
+		*slot = CNIPLIST_NODE + idx;
+	}
+	bitmap_set(b->l3 + (*slot - CNIPLIST_NODE) * CNIPLIST_L3_LONGS, ip & 0xff, 1U << (32 - cidr));
+
 	return 0;
 }
 
+/* one "a.b.c.d[/cidr]" line of cniplist.set */
+static int cniplist_add_line(void *b, const char *line, int len)
+{
+	unsigned int a, bb, c, d, cidr = 32;
+	char tmp[32];
+	int n;
+
+	while (len > 0 && isspace(line[len - 1]))
+		len--;
+	if (len <= 0 || len >= sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, line, len);
+	tmp[len] = 0;
+
+	n = sscanf(tmp, "%u.%u.%u.%u/%u", &a, &bb, &c, &d, &cidr);
+	if ((n != 4 && n != 5) || a > 255 || bb > 255 || c > 255 || d > 255)
+		return -EINVAL;
+
+	return cniplist_builder_add(b, (a << 24) | (bb << 16) | (c << 8) | d, cidr);
+}
+
+/* pack the builder into one vmalloc block */
+static struct cniplist_trie *cniplist_build(struct cniplist_builder *b)
+{
+	struct cniplist_trie *t;
+	size_t l2_len = (size_t)b->l2_count * 256 * sizeof(u32);
+	size_t l3_len = (size_t)b->l3_count * CNIPLIST_L3_LONGS * sizeof(unsigned long);
+
+	t = vmalloc(sizeof(*t) + l2_len + l3_len);
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+
+	t->prefixes = b->prefixes;
+	t->l2_count = b->l2_count;
+	t->l3_count = b->l3_count;
+	t->l2 = (u32 *)(t + 1);
+	t->l3 = (unsigned long *)((char *)t->l2 + l2_len);
+	memcpy(t->l1, b->l1, sizeof(t->l1));
+	if (l2_len)
+		memcpy(t->l2, b->l2, l2_len);
+	if (l3_len)
+		memcpy(t->l3, b->l3, l3_len);
+
+	return t;
+}
+
+static inline int cniplist_trie_match(const struct cniplist_trie *t, u32 ip)
+{
+	u32 n = t->l1[ip >> 16];
+
+	if (n < CNIPLIST_NODE)
+		return n;
+	n = t->l2[(n - CNIPLIST_NODE) * 256 + ((ip >> 8) & 0xff)];
+	if (n < CNIPLIST_NODE)
+		return n;
+	return !!test_bit(ip & 0xff, t->l3 + (n - CNIPLIST_NODE) * CNIPLIST_L3_LONGS);
+}
+
+static void cniplist_publish(struct cniplist_trie *t)
+{
+	struct cniplist_trie *old;
+
+	old = rcu_dereference_protected(cniplist, lockdep_is_held(&cniplist_mutex));
+	rcu_assign_pointer(cniplist, t);
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+}
+
+void cniplist_clean(void)
+{
+	mutex_lock(&cniplist_mutex);
+	cniplist_publish(NULL);
+	mutex_unlock(&cniplist_mutex);
+}
+
+/* return 1: in cniplist, 0: not in cniplist, -1: no built-in cniplist loaded */
+int cniplist_lookup(__be32 ip)
+{
+	int ret = -1;
+	struct cniplist_trie *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(cniplist);
+	if (t) {
+		ret = cniplist_trie_match(t, ntohl(ip));
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+unsigned int cniplist_prefixes(void)
+{
+	unsigned int n = 0;
+	struct cniplist_trie *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(cniplist);
+	if (t) {
+		n = t->prefixes;
+	}
+	rcu_read_unlock();
+
+	return n;
+}
+
+/* feed every line of @path to @add, returns the number of lines taken or -errno */
+static int cniplist_read_path(const char *name, char *path, int (*add)(void *, const char *, int), void *b)
+{
+	loff_t pos = 0;
+	ssize_t bytes = 0;
+	struct file *filp;
+	char *buf;
+	int r_idx = 0;
+	int r_cnt = 0;
+	int i, s;
+	int err = 0;
+	int count = 0;
+
+	buf = kmalloc(4096, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	filp = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(filp)) {
+		printk("unable to open %s file: %s\n", name, path);
+		kfree(buf);
+		return -ENOENT;
+	}
+
+	while ((bytes = kernel_read(filp, buf + r_idx, 4096 - r_idx, &pos)) > 0) {
+		r_cnt = r_idx + bytes;
+		s = 0;
+		for (i = 0; i < r_cnt; i++) {
+			if (buf[i] == '\n') {
+				err = add(b, buf + s, i - s);
+				if (err == -ENOMEM || err == -ENOSPC) {
+					goto out;
+				}
+				if (err) {
+					buf[i] = 0;
+					printk("%s_load_from_path skip %d(%s)\n", name, count, buf + s);
+				} else {
+					count++;
+				}
+				s = i + 1;
+			}
+		}
+		if (s == 0 && r_cnt == 4096) {
+			/* line too long, drop it */
+			s = r_cnt;
+		}
+		memmove(buf, buf + s, r_cnt - s);
+		r_idx = r_cnt - s;
+	}
+	if (r_idx > 0 && add(b, buf, r_idx) == 0) {
+		count++;
+	}
+	err = count;
+
+out:
+	kfree(buf);
+	filp_close(filp, NULL);
+	return err;
+}
+
+int cniplist_load_from_path(char *path)
+{
+	struct cniplist_builder b;
+	struct cniplist_trie *t;
+	unsigned int l2_count, l3_count;
+	int count;
+
+	count = cniplist_builder_init(&b);
+	if (count)
+		return count;
+
+	count = cniplist_read_path("cniplist", path, cniplist_add_line, &b);
+	if (count < 0)
+		goto out;
+
+	t = cniplist_build(&b);
+	if (IS_ERR(t)) {
+		count = PTR_ERR(t);
+		goto out;
+	}
+
+	/* t may be replaced and freed by another load as soon as the mutex is dropped */
+	l2_count = t->l2_count;
+	l3_count = t->l3_count;
+	mutex_lock(&cniplist_mutex);
+	cniplist_publish(t);
+	mutex_unlock(&cniplist_mutex);
+	printk("cniplist_load_from_path %d prefixes loaded, %u l2 %u l3 nodes\n", count, l2_count, l3_count);
+
+out:
+	cniplist_builder_free(&b);
+	return count < 0 ? count : 0;
+}
+
+/* cniplist6 only keys on the routing prefix: a 16-bit l1 followed by 8-bit stride
+ * nodes down to /64, longer prefixes are widened to their /64. slots use the same
+ * CNIPLIST_MISS/CNIPLIST_HIT/CNIPLIST_NODE encoding as cniplist */
+#define CNIPLIST6_MAX_NODES 65536
+
+struct cniplist6_trie {
+	unsigned int prefixes;
+	unsigned int node_count;
+	u32 *nodes;
+	u32 l1[1 << 16];
+};
+
+struct cniplist6_builder {
+	u32 *l1;
+	u32 *nodes;
+	unsigned int node_count;
+	unsigned int node_size;
+	unsigned int prefixes;
+};
+
+static struct cniplist6_trie __rcu *cniplist6 = NULL;
+static DEFINE_MUTEX(cniplist6_mutex);
+
+static int cniplist6_builder_init(struct cniplist6_builder *b)
+{
+	memset(b, 0, sizeof(*b));
+	b->l1 = vmalloc(sizeof(u32) << 16);
+	if (!b->l1)
+		return -ENOMEM;
+	memset(b->l1, 0, sizeof(u32) << 16);
+	return 0;
+}
+
+static void cniplist6_builder_free(struct cniplist6_builder *b)
+{
+	if (b->l1)
+		vfree(b->l1);
+	if (b->nodes)
+		vfree(b->nodes);
+	memset(b, 0, sizeof(*b));
+}
+
+static int cniplist6_builder_node(struct cniplist6_builder *b)
+{
+	if (b->node_count >= CNIPLIST6_MAX_NODES)
+		return -ENOSPC;
+	if (b->node_count == b->node_size) {
+		u32 *tmp = cniplist_builder_grow(b->nodes, b->node_count, &b->node_size, 256 * sizeof(u32));
+		if (!tmp)
+			return -ENOMEM;
+		b->nodes = tmp;
+	}
+	memset(b->nodes + b->node_count * 256, 0, 256 * sizeof(u32));
+	return b->node_count++;
+}
+
+static int cniplist6_builder_add(struct cniplist6_builder *b, const struct in6_addr *addr, unsigned int cidr)
+{
+	unsigned int i, pos, span;
+	int parent = -1;
+	u32 *slot;
+	u8 a[8];
+	int idx;
+
+	if (cidr > 128)
+		return -EINVAL;
+	if (cidr > 64)
+		cidr = 64;
+	for (i = 0; i < 8; i++) {
+		if (cidr >= 8 * (i + 1))
+			a[i] = addr->s6_addr[i];
+		else if (cidr > 8 * i)
+			a[i] = addr->s6_addr[i] & (0xff << (8 * (i + 1) - cidr));
+		else
+			a[i] = 0;
+	}
+	b->prefixes++;
+
+	/* walk down to the stride the prefix ends in, slot covers bits [0, 8 * i) */
+	pos = (a[0] << 8) | a[1];
+	slot = b->l1 + pos;
+	for (i = 2; i < 8 && cidr > 8 * i; i++) {
+		if (*slot == CNIPLIST_HIT)
+			return 0;
+		if (*slot == CNIPLIST_MISS) {
+			idx = cniplist6_builder_node(b);
+			if (idx < 0)
+				return idx;
+			/* nodes may have moved */
+			slot = parent < 0 ? b->l1 + pos : b->nodes + parent * 256 + pos;
+			*slot = CNIPLIST_NODE + idx;
+		}
+		parent = *slot - CNIPLIST_NODE;
+		pos = a[i];
+		slot = b->nodes + parent * 256 + pos;
+	}
+
+	span = 1U << (8 * i - cidr);
+	for (i = 0; i < span; i++)
+		slot[i] = CNIPLIST_HIT;
+
+	return 0;
+}
+
+/* one "addr[/cidr]" line of cniplist6.set */
+static int cniplist6_add_line(void *b, const char *line, int len)
+{
+	struct in6_addr addr;
+	unsigned int cidr = 128;
+	const char *end;
+	char tmp[64];
+
+	while (len > 0 && isspace(line[len - 1]))
+		len--;
+	if (len <= 0 || len >= sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, line, len);
+	tmp[len] = 0;
+
+	if (in6_pton(tmp, len, addr.s6_addr, '/', &end) != 1)
+		return -EINVAL;
+	if (*end == '/' && sscanf(end + 1, "%u", &cidr) != 1)
+		return -EINVAL;
+
+	return cniplist6_builder_add(b, &addr, cidr);
+}
+
+static struct cniplist6_trie *cniplist6_build(struct cniplist6_builder *b)
+{
+	struct cniplist6_trie *t;
+	size_t len = (size_t)b->node_count * 256 * sizeof(u32);
+
+	t = vmalloc(sizeof(*t) + len);
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+
+	t->prefixes = b->prefixes;
+	t->node_count = b->node_count;
+	t->nodes = (u32 *)(t + 1);
+	memcpy(t->l1, b->l1, sizeof(t->l1));
+	if (len)
+		memcpy(t->nodes, b->nodes, len);
+
+	return t;
+}
+
+static inline int cniplist6_trie_match(const struct cniplist6_trie *t, const struct in6_addr *addr)
+{
+	const u8 *a = addr->s6_addr;
+	u32 n = t->l1[(a[0] << 8) | a[1]];
+	int i;
+
+	for (i = 2; i < 8 && n >= CNIPLIST_NODE; i++)
+		n = t->nodes[(n - CNIPLIST_NODE) * 256 + a[i]];
+
+	return n == CNIPLIST_HIT;
+}
+
+static void cniplist6_publish(struct cniplist6_trie *t)
+{
+	struct cniplist6_trie *old;
+
+	old = rcu_dereference_protected(cniplist6, lockdep_is_held(&cniplist6_mutex));
+	rcu_assign_pointer(cniplist6, t);
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+}
+
+void cniplist6_clean(void)
+{
+	mutex_lock(&cniplist6_mutex);
+	cniplist6_publish(NULL);
+	mutex_unlock(&cniplist6_mutex);
+}
+
+/* return 1: in cniplist6, 0: not in cniplist6, -1: no cniplist6 loaded */
+int cniplist6_lookup(const struct in6_addr *addr)
+{
+	int ret = -1;
+	struct cniplist6_trie *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(cniplist6);
+	if (t) {
+		ret = cniplist6_trie_match(t, addr);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+unsigned int cniplist6_prefixes(void)
+{
+	unsigned int n = 0;
+	struct cniplist6_trie *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(cniplist6);
+	if (t) {
+		n = t->prefixes;
+	}
+	rcu_read_unlock();
+
+	return n;
+}
+
+int cniplist6_load_from_path(char *path)
+{
+	struct cniplist6_builder b;
+	struct cniplist6_trie *t;
+	unsigned int node_count;
+	int count;
+
+	count = cniplist6_builder_init(&b);
+	if (count)
+		return count;
+
+	count = cniplist_read_path("cniplist6", path, cniplist6_add_line, &b);
+	if (count < 0)
+		goto out;
+
+	t = cniplist6_build(&b);
+	if (IS_ERR(t)) {
+		count = PTR_ERR(t);
+		goto out;
+	}
+
+	node_count = t->node_count;
+	mutex_lock(&cniplist6_mutex);
+	cniplist6_publish(t);
+	mutex_unlock(&cniplist6_mutex);
+	printk("cniplist6_load_from_path %d prefixes loaded, %u nodes\n", count, node_count);
+
+out:
+	cniplist6_builder_free(&b);
+	return count < 0 ? count : 0;
+}
+
 static struct nf_hook_ops client_hooks[] = {
 	{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
@@ -4379,24 +6279,48 @@ int natcap_client_init(void)
 
 	need_conntrack();
 
-	natcap_ntc_init(&tx_ntc);
-	natcap_ntc_init(&rx_ntc);
+	ret = natcap_ntc_init(&tx_ntc);
+	if (ret != 0) {
+		goto err0;
+	}
+	ret = natcap_ntc_init(&rx_ntc);
+	if (ret != 0) {
+		goto err0;
+	}
 
+	natcap_server_hash_seed = prandom_u32();
 	for (x = 0; x < SERVER_GROUP_MAX; x++) {
 		natcap_server_info_cleanup(x);
 	}
 
 	default_mac_addr_init();
 	ret = nf_register_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+	if (ret != 0) {
+		goto err0;
+	}
+	return 0;
+
+err0:
+	natcap_ntc_exit(&rx_ntc);
+	natcap_ntc_exit(&tx_ntc);
 	return ret;
 }
 
 void natcap_client_exit(void)
 {
+	int x;
+
 	nf_unregister_hooks(client_hooks, ARRAY_SIZE(client_hooks));
 
-	if (cn_domain) {
-		vfree(cn_domain);
-		cn_domain = NULL;
+	for (x = 0; x < SERVER_GROUP_MAX; x++) {
+		natcap_server_info_cleanup(x);
 	}
+
+	natcap_user_exit();
+	natcap_ntc_exit(&rx_ntc);
+	natcap_ntc_exit(&tx_ntc);
+
+	cn_domain_clean();
+	cniplist_clean();
+	cniplist6_clean();
 }
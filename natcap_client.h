@@ -46,6 +46,22 @@ extern const char *ipfilter_acl_str[NATCAP_ACL_MAX];
 extern unsigned int dns_proxy_drop;
 extern unsigned int server_persist_lock;
 extern unsigned int server_persist_timeout;
+enum {
+	NATCAP_SERVER_SELECT_CURRENT,
+	NATCAP_SERVER_SELECT_HASH,
+	NATCAP_SERVER_SELECT_RTT,
+	NATCAP_SERVER_SELECT_MAX
+};
+extern unsigned int server_select_mode;
+extern const char *server_select_mode_str[NATCAP_SERVER_SELECT_MAX];
+enum {
+	NATCAP_PEER_MULTIPATH_RR,
+	NATCAP_PEER_MULTIPATH_RTT,
+	NATCAP_PEER_MULTIPATH_WRR,
+	NATCAP_PEER_MULTIPATH_MAX
+};
+extern unsigned int peer_multipath_mode;
+extern const char *peer_multipath_mode_str[NATCAP_PEER_MULTIPATH_MAX];
 extern unsigned int encode_http_only;
 extern unsigned int http_confusion;
 extern unsigned int sproxy;
@@ -70,21 +86,22 @@ void natcap_server_info_change(enum server_group_t x, int change);
 void natcap_server_info_cleanup(enum server_group_t x);
 int natcap_server_info_add(enum server_group_t x, const struct tuple *dst);
 int natcap_server_info_delete(enum server_group_t x, const struct tuple *dst);
-void *natcap_server_info_get(enum server_group_t x, loff_t idx);
+void *natcap_server_info_get(enum server_group_t x, loff_t idx, struct tuple *dst);
 void natcap_server_in_touch(enum server_group_t x, __be32 ip);
 
 extern unsigned int natcap_server_use_peer;
 
-const struct tuple *natcap_server_info_current(enum server_group_t x);
+const struct tuple *natcap_server_info_current(enum server_group_t x, struct tuple *dst);
 
 int natcap_client_init(void);
 void natcap_client_exit(void);
 
 struct natcap_token_ctrl {
-	int tokens;
+	atomic_t tokens; /* shared pool */
 	int tokens_per_jiffy;
+	int batch; /* tokens moved to a cpu at a time */
 	unsigned long jiffies;
-	spinlock_t lock;
+	int __percpu *local; /* per cpu credit */
 };
 
 extern int tx_pkts_threshold;
@@ -96,6 +113,27 @@ extern void natcap_rx_speed_set(int speed);
 extern int natcap_tx_speed_get(void);
 extern int natcap_rx_speed_get(void);
 
+enum {
+	NATCAP_USER_MODE_NONE,
+	NATCAP_USER_MODE_MAC,
+	NATCAP_USER_MODE_IP,
+	NATCAP_USER_MODE_MAX
+};
+
+extern unsigned int natcap_user_mode;
+extern const char *natcap_user_mode_str[NATCAP_USER_MODE_MAX];
+
+extern void natcap_user_tx_speed_set(int speed);
+extern void natcap_user_rx_speed_set(int speed);
+
+extern int natcap_user_tx_speed_get(void);
+extern int natcap_user_rx_speed_get(void);
+extern unsigned int natcap_user_count_get(void);
+extern void natcap_user_mode_set(unsigned int mode);
+
+extern int natcap_user_speed_limit(const unsigned char *key, unsigned int mode, int tx_speed, int rx_speed);
+extern void natcap_user_speed_clean(void);
+
 extern int is_natcap_server(__be32 ip);
 
 /* for DNS decode */
@@ -137,12 +175,36 @@ static inline int get_rdata(const unsigned char *src_ptr, int src_len, int src_p
 
 extern void cn_domain_clean(void);
 extern void domain_copy(char *dst, char *from);
-extern int domain_cmp(char *dst, char *src);
 extern int cn_domain_insert(char *d);
-extern int domain_match(char *dst, char *src);
+extern int cn_domain_queue(char *d);
+extern int cn_domain_insert_commit(void);
 extern int cn_domain_lookup(char *d);
 extern int cn_domain_load_from_path(char *path);
 extern int cn_domain_load_from_raw(char *path);
+extern int cn_domain_load_from_blob(char *path);
 extern int cn_domain_dump_path(char *path);
 
+extern void cniplist_clean(void);
+extern int cniplist_lookup(__be32 ip);
+extern unsigned int cniplist_prefixes(void);
+extern int cniplist_load_from_path(char *path);
+extern void cniplist6_clean(void);
+extern int cniplist6_lookup(const struct in6_addr *addr);
+extern unsigned int cniplist6_prefixes(void);
+extern int cniplist6_load_from_path(char *path);
+
+/* the built-in cniplist when loaded, else the "cniplist" ipset */
+#define IP_SET_test_dst_cniplist(state, in, out, skb) ({ \
+	int __ret = cniplist_lookup(ip_hdr(skb)->daddr); \
+	if (__ret < 0) \
+		__ret = IP_SET_test_dst_ip(state, in, out, skb, "cniplist"); \
+	__ret; \
+})
+#define IP_SET_test_src_cniplist(state, in, out, skb) ({ \
+	int __ret = cniplist_lookup(ip_hdr(skb)->saddr); \
+	if (__ret < 0) \
+		__ret = IP_SET_test_src_ip(state, in, out, skb, "cniplist"); \
+	__ret; \
+})
+
 #endif /* _NATCAP_CLIENT_H_ */
@@ -23,7 +23,11 @@
 #include <linux/mman.h>
 #include <linux/spinlock.h>
 #include <linux/rcupdate.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/timer.h>
 #include <linux/udp.h>
 #include <linux/netfilter.h>
 #include <net/netfilter/nf_conntrack.h>
@@ -34,6 +38,15 @@
 #include <linux/netfilter/ipset/ip_set.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_set.h>
+#if defined(CONFIG_X86_64) && (defined(CONFIG_AS_AVX2) || LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
+#define NATCAP_DATA_AVX2
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
 #include "natcap_common.h"
 #include "natcap_client.h"
 #include "natcap_server.h"
@@ -46,6 +59,9 @@ unsigned int natcap_max_pmtu = 1440;
 
 unsigned int natcap_touch_timeout = 32;
 
+unsigned int ipset_cache_timeout = 10; //seconds a cached per-ct ipset verdict stays valid, 0: no caching
+atomic_t natcap_ipset_flush_gen = ATOMIC_INIT(0);
+
 unsigned short natcap_redirect_port = 0;
 unsigned short natcap_client_redirect_port = 0;
 
@@ -126,6 +142,62 @@ static unsigned char natcap_map[256] = {
 };
 static unsigned char dnatcap_map[256];
 
+#ifdef NATCAP_DATA_AVX2
+/* below this the kernel_fpu_begin() cost eats the gain */
+#define NATCAP_DATA_AVX2_MIN 256
+
+static int natcap_data_avx2 = 0;
+static const unsigned char natcap_data_c70[32] __aligned(32) = { [0 ... 31] = 0x70 };
+static const unsigned char natcap_data_c10[32] __aligned(32) = { [0 ... 31] = 0x10 };
+
+/* one row of the map: the outputs for input bytes 0xh0..0xhf */
+#define NATCAP_DATA_ROW(map, h) (*(const unsigned char (*)[16])((map) + (h) * 16))
+
+/*
+ * pshufb nibble split: ymm0 holds the input minus h*0x10, so its high nibble is zero
+ * only for bytes in row h. adding 0x70 with saturation sets bit 7 on every other byte,
+ * which makes vpshufb return 0 for them, and the 16 row lookups are or'ed together.
+ */
+#define NATCAP_DATA_AVX2_ROW(map, h) \
+	asm volatile("vpaddusb %%ymm14,%%ymm0,%%ymm2\n\t" \
+	             "vbroadcasti128 %0,%%ymm3\n\t" \
+	             "vpshufb %%ymm2,%%ymm3,%%ymm3\n\t" \
+	             "vpor %%ymm3,%%ymm1,%%ymm1\n\t" \
+	             "vpsubb %%ymm15,%%ymm0,%%ymm0" \
+	             : : "m" (NATCAP_DATA_ROW(map, h)))
+
+/* len must be a multiple of 32, caller holds kernel_fpu_begin() */
+static void natcap_data_map_avx2(unsigned char *buf, int len, const unsigned char *map)
+{
+	int i;
+
+	asm volatile("vmovdqa %0,%%ymm14" : : "m" (natcap_data_c70));
+	asm volatile("vmovdqa %0,%%ymm15" : : "m" (natcap_data_c10));
+
+	for (i = 0; i < len; i += 32) {
+		asm volatile("vmovdqu %0,%%ymm0" : : "m" (*(unsigned char (*)[32])(buf + i)));
+		asm volatile("vpxor %ymm1,%ymm1,%ymm1");
+		NATCAP_DATA_AVX2_ROW(map, 0);
+		NATCAP_DATA_AVX2_ROW(map, 1);
+		NATCAP_DATA_AVX2_ROW(map, 2);
+		NATCAP_DATA_AVX2_ROW(map, 3);
+		NATCAP_DATA_AVX2_ROW(map, 4);
+		NATCAP_DATA_AVX2_ROW(map, 5);
+		NATCAP_DATA_AVX2_ROW(map, 6);
+		NATCAP_DATA_AVX2_ROW(map, 7);
+		NATCAP_DATA_AVX2_ROW(map, 8);
+		NATCAP_DATA_AVX2_ROW(map, 9);
+		NATCAP_DATA_AVX2_ROW(map, 10);
+		NATCAP_DATA_AVX2_ROW(map, 11);
+		NATCAP_DATA_AVX2_ROW(map, 12);
+		NATCAP_DATA_AVX2_ROW(map, 13);
+		NATCAP_DATA_AVX2_ROW(map, 14);
+		NATCAP_DATA_AVX2_ROW(map, 15);
+		asm volatile("vmovdqu %%ymm1,%0" : "=m" (*(unsigned char (*)[32])(buf + i)));
+	}
+}
+#endif
+
 static void dnatcap_map_init(void)
 {
 	int i;
@@ -135,25 +207,45 @@ static void dnatcap_map_init(void)
 	for (i = 0; i < 256; i++) {
 		dnatcap_map[natcap_map[i]] = i;
 	}
+
+#ifdef NATCAP_DATA_AVX2
+	natcap_data_avx2 = boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_OSXSAVE);
+#endif
 }
 
-void natcap_data_encode(unsigned char *buf, int len)
+static inline void natcap_data_map(unsigned char *buf, int len, const unsigned char *map)
 {
 	int i;
+
+#ifdef NATCAP_DATA_AVX2
+	if (natcap_data_avx2 && len >= NATCAP_DATA_AVX2_MIN && irq_fpu_usable()) {
+		int n = len & ~31;
+
+		kernel_fpu_begin();
+		natcap_data_map_avx2(buf, n, map);
+		kernel_fpu_end();
+		buf += n;
+		len -= n;
+	}
+#endif
+
 	for (i = 0; i < len; i++) {
-		buf[i] = natcap_map[buf[i]];
+		buf[i] = map[buf[i]];
 	}
 }
 
+void natcap_data_encode(unsigned char *buf, int len)
+{
+	natcap_data_map(buf, len, natcap_map);
+}
+
 void natcap_data_decode(unsigned char *buf, int len)
 {
-	int i;
-	for (i = 0; i < len; i++) {
-		buf[i] = dnatcap_map[buf[i]];
-	}
+	natcap_data_map(buf, len, dnatcap_map);
 }
 
-void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int))
+/* csum != NULL: also sum each chunk right after update() rewrote it, while it is still hot in cache */
+static void __skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int), __wsum *csum)
 {
 	int start = skb_headlen(skb);
 	int i, copy = start - offset;
@@ -164,6 +256,8 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 		if (copy > len)
 			copy = len;
 		update(skb->data + offset, copy);
+		if (csum)
+			*csum = csum_partial(skb->data + offset, copy, *csum);
 		if ((len -= copy) == 0)
 			return;
 		offset += copy;
@@ -190,6 +284,8 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 			                      copy, p, p_off, p_len, copied) {
 				vaddr = kmap_atomic(p);
 				update(vaddr + p_off, p_len);
+				if (csum)
+					*csum = csum_block_add(*csum, csum_partial(vaddr + p_off, p_len, 0), pos);
 				kunmap_atomic(vaddr);
 				pos += p_len;
 			}
@@ -203,6 +299,8 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 				copy = len;
 			vaddr = kmap_atomic(skb_frag_page(frag));
 			update(vaddr + frag->page_offset + offset - start, copy);
+			if (csum)
+				*csum = csum_block_add(*csum, csum_partial(vaddr + frag->page_offset + offset - start, copy, 0), pos);
 			kunmap_atomic(vaddr);
 			if (!(len -= copy))
 				return;
@@ -220,9 +318,13 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 
 		end = start + frag_iter->len;
 		if ((copy = end - offset) > 0) {
+			__wsum csum2 = 0;
+
 			if (copy > len)
 				copy = len;
-			skb_data_hook(frag_iter, offset - start, copy, update);
+			__skb_data_hook(frag_iter, offset - start, copy, update, csum ? &csum2 : NULL);
+			if (csum)
+				*csum = csum_block_add(*csum, csum2, pos);
 			if ((len -= copy) == 0)
 				return;
 			offset += copy;
@@ -235,6 +337,11 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 	return;
 }
 
+void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int))
+{
+	__skb_data_hook(skb, offset, len, update, NULL);
+}
+
 int skb_rcsum_verify(struct sk_buff *skb)
 {
 	struct iphdr *iph = ip_hdr(skb);
@@ -298,7 +405,19 @@ int skb_rcsum_verify(struct sk_buff *skb)
 	return ret;
 }
 
-int skb_rcsum_tcpudp(struct sk_buff *skb)
+/* checksum from the l4 header to len, data_csum already covers data_off to the end when data_off != 0 */
+static __wsum skb_l4_checksum(struct sk_buff *skb, int l4_off, int len, int data_off, __wsum data_csum)
+{
+	__wsum csum;
+
+	if (data_off == 0 || len != skb->len) {
+		return skb_checksum(skb, l4_off, len - l4_off, 0);
+	}
+	csum = skb_checksum(skb, l4_off, data_off - l4_off, 0);
+	return csum_block_add(csum, data_csum, data_off - l4_off);
+}
+
+static int __skb_rcsum_tcpudp(struct sk_buff *skb, int data_off, __wsum data_csum)
 {
 	struct iphdr *iph = ip_hdr(skb);
 	int len = ntohs(iph->tot_len);
@@ -324,7 +443,7 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 			iph->check = 0;
 			iph->check = ip_fast_csum(iph, iph->ihl);
 			tcph->check = 0;
-			skbcsum = skb_checksum(skb, iph->ihl * 4, len - iph->ihl * 4, 0);
+			skbcsum = skb_l4_checksum(skb, iph->ihl * 4, len, data_off, data_csum);
 			tcph->check = csum_tcpudp_magic(iph->saddr, iph->daddr, len - iph->ihl * 4, iph->protocol, skbcsum);
 			if (skb->ip_summed == CHECKSUM_COMPLETE) {
 				skb->ip_summed = CHECKSUM_UNNECESSARY;
@@ -345,7 +464,7 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 			iph->check = ip_fast_csum(iph, iph->ihl);
 			if (udph->check) {
 				udph->check = 0;
-				skbcsum = skb_checksum(skb, iph->ihl * 4, len - iph->ihl * 4, 0);
+				skbcsum = skb_l4_checksum(skb, iph->ihl * 4, len, data_off, data_csum);
 				udph->check = csum_tcpudp_magic(iph->saddr, iph->daddr, len - iph->ihl * 4, iph->protocol, skbcsum);
 				if (udph->check == 0)
 					udph->check = CSUM_MANGLED_0;
@@ -361,6 +480,27 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 	return 0;
 }
 
+int skb_rcsum_tcpudp(struct sk_buff *skb)
+{
+	return __skb_rcsum_tcpudp(skb, 0, 0);
+}
+
+/* skb_data_hook() + skb_rcsum_tcpudp() in one pass over the payload from offset to the end of skb */
+int skb_data_hook_rcsum(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int))
+{
+	__wsum csum = 0;
+	struct iphdr *iph = ip_hdr(skb);
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL || offset + len != skb->len ||
+	        (iph->protocol == IPPROTO_UDP && UDPH((void *)iph + iph->ihl * 4)->check == 0)) {
+		skb_data_hook(skb, offset, len, update);
+		return skb_rcsum_tcpudp(skb);
+	}
+
+	__skb_data_hook(skb, offset, len, update, &csum);
+	return __skb_rcsum_tcpudp(skb, offset, csum);
+}
+
 int natcap_tcpopt_setup(unsigned long status, struct sk_buff *skb, struct nf_conn *ct, struct natcap_TCPOPT *tcpopt, __be32 ip, __be16 port)
 {
 	int size;
@@ -507,15 +647,14 @@ int natcap_tcp_encode(struct nf_conn *ct, struct sk_buff *skb, const struct natc
 
 do_encode:
 	if (tcpopt->header.encryption) {
-		if (!skb_make_writable(skb, skb->len)) {
+		if (!skb_data_make_writable(skb, iph->ihl * 4 + tcph->doff * 4)) {
 			return -3;
 		}
 		iph = ip_hdr(skb);
 		tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
 
-		skb_data_hook(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_encode);
-	}
-	if (tcpopt->header.encryption || NATCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
+		skb_data_hook_rcsum(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_encode);
+	} else if (NATCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
 		skb_rcsum_tcpudp(skb);
 	}
 
@@ -561,15 +700,14 @@ int natcap_tcp_decode(struct nf_conn *ct, struct sk_buff *skb, struct natcap_TCP
 
 do_decode:
 	if (tcpopt->header.encryption) {
-		if (!skb_make_writable(skb, skb->len)) {
+		if (!skb_data_make_writable(skb, iph->ihl * 4 + tcph->doff * 4)) {
 			return -3;
 		}
 		iph = ip_hdr(skb);
 		tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
 
-		skb_data_hook(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_decode);
-	}
-	if (tcpopt->header.encryption || NATCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
+		skb_data_hook_rcsum(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_decode);
+	} else if (NATCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
 		skb_rcsum_tcpudp(skb);
 	}
 done:
@@ -1275,6 +1413,233 @@ u32 cone_snat_hash(__be32 ip, __be16 port, __be32 wan_ip)
 	return jhash_3words(ip, port, wan_ip, cone_snat_hashrnd);
 }
 
+/* with session_slab=1 the sessions live in their own slab cache instead of behind ct->ext,
+ * found through a side table hashed on the ct pointer. each node holds a ct reference, so the
+ * ct (and its address) stays around as long as the node does, and the node stays around as
+ * long as anybody else still holds the ct: the gc timer frees the nodes whose ct reference is
+ * the last one, which is the conntrack destroy path as far as natcap can see it.
+ * lookups walk the chain under rcu, inserts and the gc serialize on the bucket lock.
+ */
+unsigned int session_slab = 0;
+module_param(session_slab, int, 0);
+MODULE_PARM_DESC(session_slab, "Keep natcap sessions in a dedicated slab cache instead of growing ct->ext");
+
+static unsigned int session_slab_size = 65536;
+module_param(session_slab_size, int, 0);
+MODULE_PARM_DESC(session_slab_size, "Number of buckets of the session side table (session_slab=1)");
+
+#define NATCAP_SESSION_LOCKS 256
+#define NATCAP_SESSION_GC_SLICES 8 /* the whole table is swept once a second */
+
+struct natcap_session_node {
+	struct hlist_node hnode;
+	struct nf_conn *ct;
+	struct rcu_head rcu;
+	struct natcap_session ns __attribute__((aligned(__ALIGN_64BITS))); /* the multipath tail follows */
+};
+
+static struct kmem_cache *natcap_session_cache[2]; /* [mp] */
+static struct hlist_head *natcap_session_table;
+static unsigned int natcap_session_mask;
+static spinlock_t natcap_session_locks[NATCAP_SESSION_LOCKS];
+static struct timer_list natcap_session_gc_timer;
+static unsigned int natcap_session_gc_pos;
+static int natcap_session_gc_stop;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define natcap_ct_refcnt(ct) refcount_read(&(ct)->ct_general.use)
+#else
+#define natcap_ct_refcnt(ct) atomic_read(&(ct)->ct_general.use)
+#endif
+
+static inline unsigned int natcap_session_hash(const struct nf_conn *ct)
+{
+	return hash_ptr(ct, 32) & natcap_session_mask;
+}
+
+static struct natcap_session *natcap_session_slab_get(struct nf_conn *ct)
+{
+	struct natcap_session_node *node;
+	struct natcap_session *ns = NULL;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(node, &natcap_session_table[natcap_session_hash(ct)], hnode) {
+		if (node->ct == ct) {
+			ns = &node->ns;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return ns;
+}
+
+static int natcap_session_slab_init(struct nf_conn *ct, gfp_t gfp, int mp)
+{
+	unsigned int hash = natcap_session_hash(ct);
+	spinlock_t *lock = &natcap_session_locks[hash % NATCAP_SESSION_LOCKS];
+	struct natcap_session_node *node, *pos;
+
+	if (natcap_session_slab_get(ct)) {
+		return 0;
+	}
+
+	node = kmem_cache_zalloc(natcap_session_cache[!!mp], gfp);
+	if (!node) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "kmem_cache_zalloc mp=%d failed!\n", DEBUG_ARG_PREFIX, mp);
+		return -1;
+	}
+	if (mp) {
+		node->ns.n.status = NS_PEER_MP;
+	}
+
+	spin_lock_bh(lock);
+	hlist_for_each_entry(pos, &natcap_session_table[hash], hnode) {
+		if (pos->ct == ct) {
+			//natcap exist
+			spin_unlock_bh(lock);
+			kmem_cache_free(natcap_session_cache[!!mp], node);
+			return 0;
+		}
+	}
+	nf_conntrack_get(&ct->ct_general);
+	node->ct = ct;
+	hlist_add_head_rcu(&node->hnode, &natcap_session_table[hash]);
+	spin_unlock_bh(lock);
+
+	return 0;
+}
+
+static void natcap_session_node_free(struct rcu_head *head)
+{
+	struct natcap_session_node *node = container_of(head, struct natcap_session_node, rcu);
+
+	kmem_cache_free(natcap_session_cache[!!(NS_PEER_MP & node->ns.n.status)], node);
+}
+
+/* @all: drop the nodes whose ct is still in use too */
+static void natcap_session_sweep(unsigned int hash, int all)
+{
+	spinlock_t *lock = &natcap_session_locks[hash % NATCAP_SESSION_LOCKS];
+	struct natcap_session_node *node;
+	struct hlist_node *n;
+
+	if (hlist_empty(&natcap_session_table[hash])) {
+		return;
+	}
+
+	spin_lock_bh(lock);
+	hlist_for_each_entry_safe(node, n, &natcap_session_table[hash], hnode) {
+		if (!all && natcap_ct_refcnt(node->ct) > 1) {
+			continue;
+		}
+		hlist_del_rcu(&node->hnode);
+		nf_ct_put(node->ct);
+		call_rcu(&node->rcu, natcap_session_node_free);
+	}
+	spin_unlock_bh(lock);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void natcap_session_gc(unsigned long ignore)
+#else
+static void natcap_session_gc(struct timer_list *ignore)
+#endif
+{
+	unsigned int i;
+	unsigned int n = (natcap_session_mask + 1) / NATCAP_SESSION_GC_SLICES;
+
+	for (i = 0; i < n; i++) {
+		natcap_session_sweep(natcap_session_gc_pos++ & natcap_session_mask, 0);
+	}
+
+	if (natcap_session_gc_stop) {
+		return;
+	}
+	mod_timer(&natcap_session_gc_timer, jiffies + HZ / NATCAP_SESSION_GC_SLICES);
+}
+
+static int natcap_session_slab_setup(void)
+{
+	unsigned int i, buckets;
+
+	if (!session_slab) {
+		return 0;
+	}
+
+	if (session_slab_size < 1024)
+		session_slab_size = 1024;
+	else if (session_slab_size > 4 * 1024 * 1024)
+		session_slab_size = 4 * 1024 * 1024;
+	buckets = roundup_pow_of_two(session_slab_size);
+
+	natcap_session_table = vmalloc(sizeof(struct hlist_head) * buckets);
+	if (natcap_session_table == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < buckets; i++) {
+		INIT_HLIST_HEAD(&natcap_session_table[i]);
+	}
+	natcap_session_mask = buckets - 1;
+	for (i = 0; i < NATCAP_SESSION_LOCKS; i++) {
+		spin_lock_init(&natcap_session_locks[i]);
+	}
+
+	natcap_session_cache[0] = kmem_cache_create("natcap_session",
+	                          sizeof(struct natcap_session_node), __ALIGN_64BITS, 0, NULL);
+	natcap_session_cache[1] = kmem_cache_create("natcap_session_mp",
+	                          ALIGN(sizeof(struct natcap_session_node), __ALIGN_64BITS) + sizeof(struct natcap_session_mp), __ALIGN_64BITS, 0, NULL);
+	if (natcap_session_cache[0] == NULL || natcap_session_cache[1] == NULL) {
+		goto err_kmem_cache_create;
+	}
+
+	natcap_session_gc_stop = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	init_timer(&natcap_session_gc_timer);
+	natcap_session_gc_timer.data = 0;
+	natcap_session_gc_timer.function = natcap_session_gc;
+#else
+	timer_setup(&natcap_session_gc_timer, natcap_session_gc, 0);
+#endif
+	mod_timer(&natcap_session_gc_timer, jiffies + HZ / NATCAP_SESSION_GC_SLICES);
+
+	return 0;
+
+err_kmem_cache_create:
+	if (natcap_session_cache[1])
+		kmem_cache_destroy(natcap_session_cache[1]);
+	if (natcap_session_cache[0])
+		kmem_cache_destroy(natcap_session_cache[0]);
+	natcap_session_cache[0] = natcap_session_cache[1] = NULL;
+	vfree(natcap_session_table);
+	natcap_session_table = NULL;
+	return -ENOMEM;
+}
+
+/* called with the hooks gone, nobody looks the sessions up any more */
+static void natcap_session_slab_cleanup(void)
+{
+	unsigned int i;
+
+	if (!session_slab) {
+		return;
+	}
+
+	natcap_session_gc_stop = 1;
+	del_timer_sync(&natcap_session_gc_timer);
+
+	for (i = 0; i <= natcap_session_mask; i++) {
+		natcap_session_sweep(i, 1);
+	}
+	rcu_barrier();
+
+	kmem_cache_destroy(natcap_session_cache[1]);
+	kmem_cache_destroy(natcap_session_cache[0]);
+	natcap_session_cache[0] = natcap_session_cache[1] = NULL;
+	vfree(natcap_session_table);
+	natcap_session_table = NULL;
+}
+
 #if defined(nf_ct_ext_add)
 void *compat_nf_ct_ext_add(struct nf_conn *ct, int id, gfp_t gfp)
 {
@@ -1285,11 +1650,11 @@ void *compat_nf_ct_ext_add(struct nf_conn *ct, int id, gfp_t gfp)
 #endif
 
 #define NATCAP_MAX_OFF 512u
-#define __ALIGN_64BITS 8
 #define __ALIGN_64BYTES (__ALIGN_64BITS * 8)
 #define NATCAP_FACTOR (__ALIGN_64BITS * 2)
 
-int natcap_session_init(struct nf_conn *ct, gfp_t gfp)
+/* @mp: also reserve the peer multipath state behind the session */
+int natcap_session_init(struct nf_conn *ct, gfp_t gfp, int mp)
 {
 	unsigned int i;
 	struct nat_key_t *nk = NULL;
@@ -1298,10 +1663,18 @@ int natcap_session_init(struct nf_conn *ct, gfp_t gfp)
 	size_t alloc_size;
 	size_t var_alloc_len = ALIGN(sizeof(struct natcap_session), __ALIGN_64BITS);
 
+	if (mp) {
+		var_alloc_len += ALIGN(sizeof(struct natcap_session_mp), __ALIGN_64BITS);
+	}
+
 	if (nf_ct_is_confirmed(ct)) {
 		return -1;
 	}
 
+	if (session_slab) {
+		return natcap_session_slab_init(ct, gfp, mp);
+	}
+
 	for (i = 0; i < ARRAY_SIZE((((struct nf_ct_ext *)0)->offset)); i++) {
 		if (!nf_ct_ext_exist(ct, i)) compat_nf_ct_ext_add(ct, i, gfp);
 	}
@@ -1369,6 +1742,9 @@ int natcap_session_init(struct nf_conn *ct, gfp_t gfp)
 	nk->ext_magic = (unsigned long)ct & 0xffffffff;
 	nk->len = newlen;
 	nk->natcap_off = newoff;
+	if (mp) {
+		((struct natcap_session *)((void *)new + newoff))->n.status = NS_PEER_MP;
+	}
 
 	return 0;
 }
@@ -1378,6 +1754,10 @@ struct natcap_session *natcap_session_get(struct nf_conn *ct)
 	struct nat_key_t *nk;
 	struct natcap_session *ns = NULL;
 
+	if (session_slab) {
+		return natcap_session_slab_get(ct);
+	}
+
 	if (!ct->ext) {
 		return NULL;
 	}
@@ -1500,15 +1880,263 @@ int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m
 	return 0;
 }
 
-struct cone_nat_session *cone_nat_array = NULL;
-struct cone_snat_session *cone_snat_array = NULL;
+/* cone mappings lan_ip:lan_port <-> wan_ip:wan_port, indexed twice:
+ * cone_nat_table by (wan_ip, wan_port) for the inbound DNAT and cone_snat_table by
+ * (lan_ip, lan_port, wan_ip) for picking the same wan_port again.
+ * each key has two candidate buckets of one cache line, a new key goes to the emptier one,
+ * when both are full an entry is moved on to its other bucket to make room, and only when
+ * that fails too the oldest entry is replaced.
+ * readers are lockless under the per bucket seqcount (and cone_nat_move_seq for a miss racing
+ * with a move), writers serialize on cone_nat_lock.
+ */
+static unsigned int cone_nat_size = 65536;
+module_param(cone_nat_size, int, 0);
+MODULE_PARM_DESC(cone_nat_size, "Number of cone nat mappings to keep over all wan ips");
+
+struct cone_nat_bucket *cone_nat_table = NULL;
+struct cone_nat_bucket *cone_snat_table = NULL;
+static unsigned int cone_nat_mask;
+static unsigned int cone_snat_mask;
+static DEFINE_SPINLOCK(cone_nat_lock);
+static seqcount_t cone_nat_move_seq;
+
+static inline int cone_entry_match(const struct cone_snat_session *e, const struct cone_snat_session *key, int snat)
+{
+	if (e->wan_port == 0)
+		return 0;
+	if (snat)
+		return e->lan_ip == key->lan_ip && e->lan_port == key->lan_port && e->wan_ip == key->wan_ip;
+	return e->wan_ip == key->wan_ip && e->wan_port == key->wan_port;
+}
+
+static inline u32 cone_key_hash(const struct cone_snat_session *key, int snat)
+{
+	if (snat)
+		return cone_snat_hash(key->lan_ip, key->lan_port, key->wan_ip);
+	return cone_snat_hash(key->wan_ip, key->wan_port, 0);
+}
+
+static inline struct cone_nat_bucket *cone_bucket(struct cone_nat_bucket *tab, unsigned int mask, u32 hash, int which)
+{
+	return &tab[which ? hash_32(hash, fls(mask)) : hash & mask];
+}
+
+static int cone_table_lookup(struct cone_nat_bucket *tab, unsigned int mask, const struct cone_snat_session *key, int snat, struct cone_snat_session *css)
+{
+	unsigned int i, j, seq, move_seq;
+	u32 hash = cone_key_hash(key, snat);
+
+again:
+	move_seq = read_seqcount_begin(&cone_nat_move_seq);
+	for (i = 0; i < 2; i++) {
+		struct cone_nat_bucket *b = cone_bucket(tab, mask, hash, i);
+		int found;
+		do {
+			seq = read_seqcount_begin(&b->seq);
+			found = 0;
+			for (j = 0; j < CONE_BUCKET_WAYS; j++) {
+				if (cone_entry_match(&b->ent[j], key, snat)) {
+					memcpy(css, &b->ent[j], sizeof(*css));
+					found = 1;
+					break;
+				}
+			}
+		} while (read_seqcount_retry(&b->seq, seq));
+		if (found)
+			return 0;
+	}
+	if (read_seqcount_retry(&cone_nat_move_seq, move_seq))
+		goto again;
+
+	return -ENOENT;
+}
+
+/* cone_nat_lock held */
+static void cone_table_update(struct cone_nat_bucket *tab, unsigned int mask, const struct cone_snat_session *css, int snat)
+{
+	unsigned int i, j, used[2] = {0, 0};
+	unsigned short now = jiffies / HZ;
+	unsigned short age, oldest = 0;
+	u32 hash = cone_key_hash(css, snat);
+	struct cone_nat_bucket *b, *vb = NULL;
+	int vj = -1;
+
+	for (i = 0; i < 2; i++) {
+		b = cone_bucket(tab, mask, hash, i);
+		for (j = 0; j < CONE_BUCKET_WAYS; j++) {
+			if (cone_entry_match(&b->ent[j], css, snat)) {
+				vb = b;
+				vj = j;
+				goto set_out;
+			}
+			if (b->ent[j].wan_port != 0)
+				used[i]++;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		b = cone_bucket(tab, mask, hash, used[1] < used[0] ? 1 - i : i);
+		for (j = 0; j < CONE_BUCKET_WAYS; j++) {
+			if (b->ent[j].wan_port == 0) {
+				vb = b;
+				vj = j;
+				goto set_out;
+			}
+		}
+	}
+
+	/* both full: move one of their entries on to its other bucket */
+	for (i = 0; i < 2; i++) {
+		b = cone_bucket(tab, mask, hash, i);
+		for (j = 0; j < CONE_BUCKET_WAYS; j++) {
+			u32 h = cone_key_hash(&b->ent[j], snat);
+			struct cone_nat_bucket *ob = cone_bucket(tab, mask, h, b == cone_bucket(tab, mask, h, 0));
+			unsigned int k;
+			if (ob == b)
+				continue;
+			for (k = 0; k < CONE_BUCKET_WAYS; k++) {
+				if (ob->ent[k].wan_port == 0) {
+					write_seqcount_begin(&cone_nat_move_seq);
+					write_seqcount_begin(&ob->seq);
+					memcpy(&ob->ent[k], &b->ent[j], sizeof(ob->ent[k]));
+					ob->stamp[k] = b->stamp[j];
+					write_seqcount_end(&ob->seq);
+					write_seqcount_end(&cone_nat_move_seq);
+					vb = b;
+					vj = j;
+					goto set_out;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		b = cone_bucket(tab, mask, hash, i);
+		for (j = 0; j < CONE_BUCKET_WAYS; j++) {
+			age = now - b->stamp[j];
+			if (vj < 0 || age > oldest) {
+				oldest = age;
+				vb = b;
+				vj = j;
+			}
+		}
+	}
+
+	NATCAP_INFO(DEBUG_FMT_PREFIX "cone %s table full, drop %pI4:%u=>%pI4:%u [AS %us]\n", DEBUG_ARG_PREFIX, snat ? "snat" : "nat",
+	            &vb->ent[vj].lan_ip, ntohs(vb->ent[vj].lan_port), &vb->ent[vj].wan_ip, ntohs(vb->ent[vj].wan_port), oldest);
+
+set_out:
+	write_seqcount_begin(&vb->seq);
+	memcpy(&vb->ent[vj], css, sizeof(*css));
+	vb->stamp[vj] = now;
+	write_seqcount_end(&vb->seq);
+}
+
+/* look up the mapping of wan_ip:wan_port */
+int cone_nat_lookup(__be32 wan_ip, __be16 wan_port, struct cone_snat_session *css)
+{
+	struct cone_snat_session key = { .wan_ip = wan_ip, .wan_port = wan_port };
+
+	if (!cone_nat_table)
+		return -ENOENT;
+	return cone_table_lookup(cone_nat_table, cone_nat_mask, &key, 0, css);
+}
+
+/* look up the wan_port lan_ip:lan_port got on wan_ip */
+int cone_snat_lookup(__be32 lan_ip, __be16 lan_port, __be32 wan_ip, struct cone_snat_session *css)
+{
+	struct cone_snat_session key = { .lan_ip = lan_ip, .wan_ip = wan_ip, .lan_port = lan_port };
+
+	if (!cone_snat_table)
+		return -ENOENT;
+	return cone_table_lookup(cone_snat_table, cone_snat_mask, &key, 1, css);
+}
+
+/* record the mapping in both tables, the caller already looked it up and found it stale */
+void cone_nat_update(const struct cone_snat_session *css)
+{
+	if (!cone_nat_table || !cone_snat_table)
+		return;
+
+	spin_lock_bh(&cone_nat_lock);
+	cone_table_update(cone_nat_table, cone_nat_mask, css, 0);
+	cone_table_update(cone_snat_table, cone_snat_mask, css, 1);
+	spin_unlock_bh(&cone_nat_lock);
+}
+
+static void cone_table_clear(struct cone_nat_bucket *tab, unsigned int mask)
+{
+	unsigned int i;
+
+	for (i = 0; i <= mask; i++) {
+		write_seqcount_begin(&tab[i].seq);
+		memset(tab[i].ent, 0, sizeof(tab[i].ent));
+		write_seqcount_end(&tab[i].seq);
+	}
+}
 
 void cone_nat_cleanup(void)
 {
-	if (cone_nat_array)
-		memset(cone_nat_array, 0, sizeof(struct cone_nat_session) * 65536);
-	if (cone_snat_array)
-		memset(cone_snat_array, 0, sizeof(struct cone_snat_session) * 32768);
+	spin_lock_bh(&cone_nat_lock);
+	if (cone_nat_table)
+		cone_table_clear(cone_nat_table, cone_nat_mask);
+	if (cone_snat_table)
+		cone_table_clear(cone_snat_table, cone_snat_mask);
+	spin_unlock_bh(&cone_nat_lock);
+}
+
+static struct cone_nat_bucket *cone_table_alloc(unsigned int buckets)
+{
+	unsigned int i;
+	struct cone_nat_bucket *tab;
+
+	tab = vmalloc(sizeof(struct cone_nat_bucket) * buckets);
+	if (tab == NULL)
+		return NULL;
+	memset(tab, 0, sizeof(struct cone_nat_bucket) * buckets);
+	for (i = 0; i < buckets; i++) {
+		seqcount_init(&tab[i].seq);
+	}
+
+	return tab;
+}
+
+static int cone_nat_init(void)
+{
+	unsigned int buckets;
+
+	if (cone_nat_size < 1024)
+		cone_nat_size = 1024;
+	else if (cone_nat_size > 4 * 1024 * 1024)
+		cone_nat_size = 4 * 1024 * 1024;
+	buckets = roundup_pow_of_two(cone_nat_size / CONE_BUCKET_WAYS);
+
+	cone_nat_table = cone_table_alloc(buckets);
+	if (cone_nat_table == NULL)
+		return -ENOMEM;
+	cone_nat_mask = buckets - 1;
+
+	cone_snat_table = cone_table_alloc(buckets);
+	if (cone_snat_table == NULL) {
+		vfree(cone_nat_table);
+		cone_nat_table = NULL;
+		return -ENOMEM;
+	}
+	cone_snat_mask = buckets - 1;
+	seqcount_init(&cone_nat_move_seq);
+
+	return 0;
+}
+
+static void cone_nat_exit(void)
+{
+	void *nat = cone_nat_table, *snat = cone_snat_table;
+
+	cone_nat_table = NULL;
+	cone_snat_table = NULL;
+	synchronize_rcu();
+	vfree(nat);
+	vfree(snat);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
@@ -1554,7 +2182,7 @@ static unsigned int natcap_common_cone_in_hook(void *priv,
 	struct nf_conn *ct;
 	struct iphdr *iph;
 	void *l4;
-	struct cone_nat_session cns;
+	struct cone_snat_session css;
 
 	iph = ip_hdr(skb);
 	if (iph->protocol != IPPROTO_UDP) {
@@ -1598,23 +2226,22 @@ static unsigned int natcap_common_cone_in_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (cone_nat_array && cone_snat_array &&
-	        IP_SET_test_dst_ip(state, in, out, skb, "cone_wan_ip") > 0) {
-		if (IP_SET_test_dst_port(state, in, out, skb, "cone_nat_unused_port") > 0 &&
+	if (cone_nat_table && cone_snat_table &&
+	        IP_SET_test_cached(ns, NATCAP_IPSET_CONE_WAN_DST, IP_SET_test_dst_ip(state, in, out, skb, "cone_wan_ip"))) {
+		if (IP_SET_test_cached(ns, NATCAP_IPSET_CONE_UNUSED_DPORT, IP_SET_test_dst_port(state, in, out, skb, "cone_nat_unused_port")) &&
 		        !is_natcap_server(iph->saddr)) {
 			return NF_ACCEPT;
 		}
 
-		memcpy(&cns, &cone_nat_array[ntohs(UDPH(l4)->dest)], sizeof(cns));
-		if (cns.ip != 0 && cns.port != 0) {
-			if (natcap_dnat_setup(ct, cns.ip, cns.port) != NF_ACCEPT) {
+		if (cone_nat_lookup(iph->daddr, UDPH(l4)->dest, &css) == 0 && css.lan_ip != 0 && css.lan_port != 0) {
+			if (natcap_dnat_setup(ct, css.lan_ip, css.lan_port) != NF_ACCEPT) {
 				NATCAP_ERROR("(CCI)" DEBUG_UDP_FMT ": do mapping failed, target=%pI4:%u @port=%u\n",
-				             DEBUG_UDP_ARG(iph,l4), &cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
+				             DEBUG_UDP_ARG(iph,l4), &css.lan_ip, ntohs(css.lan_port), ntohs(UDPH(l4)->dest));
 				return NF_ACCEPT;
 			}
 
 			NATCAP_INFO("(CCI)" DEBUG_UDP_FMT ": do mapping, target=%pI4:%u @port=%u\n",
-			            DEBUG_UDP_ARG(iph,l4), &cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
+			            DEBUG_UDP_ARG(iph,l4), &css.lan_ip, ntohs(css.lan_port), ntohs(UDPH(l4)->dest));
 
 			set_bit(IPS_NATCAP_CONE_BIT, &ct->status);
 			xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
@@ -1667,7 +2294,6 @@ static unsigned int natcap_common_cone_out_hook(void *priv,
 	struct nf_conn *ct;
 	struct iphdr *iph;
 	void *l4;
-	struct cone_nat_session cns;
 	struct cone_snat_session css;
 
 	iph = ip_hdr(skb);
@@ -1734,47 +2360,26 @@ static unsigned int natcap_common_cone_out_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (cone_nat_array && cone_snat_array && ntohs(UDPH(l4)->source) >= 1024 &&
+	if (cone_nat_table && cone_snat_table && ntohs(UDPH(l4)->source) >= 1024 &&
 	        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
 	        ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53) &&
 	        ((IPS_NATCAP & ct->status) ||
 	         (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip != iph->saddr &&
-	          IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip") > 0))) {
-		unsigned int idx;
-
-		idx = ntohs(UDPH(l4)->source) % 65536;
-		memcpy(&cns, &cone_nat_array[idx], sizeof(cns));
-		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip != cns.ip ||
-		        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port != cns.port) {
-
-			NATCAP_INFO("(CCO)" DEBUG_UDP_FMT ": update mapping from %pI4:%u to %pI4:%u @port=%u\n", DEBUG_UDP_ARG(iph,l4),
-			            &cns.ip, ntohs(cns.port),
-			            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip,
-			            ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
-			            idx);
-
-			cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-			cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-			memcpy(&cone_nat_array[idx], &cns, sizeof(cns));
-		}
-
-		idx = cone_snat_hash(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, iph->saddr) % 32768;
-		memcpy(&css, &cone_snat_array[idx], sizeof(css));
-		if ((css.wan_ip != iph->saddr || css.wan_port != UDPH(l4)->source) ||
+	          IP_SET_test_cached(ns, NATCAP_IPSET_CONE_WAN_SRC, IP_SET_test_src_ip(state, in, out, skb, "cone_wan_ip"))))) {
+		if (cone_nat_lookup(iph->saddr, UDPH(l4)->source, &css) != 0 ||
 		        css.lan_ip != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip ||
-		        css.lan_port != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port) {
-
-			NATCAP_INFO("(CCO)" DEBUG_UDP_FMT ": update SNAT mapping from %pI4:%u=>%pI4:%u to %pI4:%u=>%pI4:%u\n", DEBUG_UDP_ARG(iph,l4),
-			            &css.lan_ip, ntohs(css.lan_port),
-			            &css.wan_ip, ntohs(css.wan_port),
-			            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
-			            &iph->saddr, ntohs(UDPH(l4)->source));
-
+		        css.lan_port != ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port ||
+		        cone_snat_lookup(css.lan_ip, css.lan_port, iph->saddr, &css) != 0 ||
+		        css.wan_port != UDPH(l4)->source) {
 			css.wan_ip = iph->saddr;
 			css.wan_port = UDPH(l4)->source;
 			css.lan_ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
 			css.lan_port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-			memcpy(&cone_snat_array[idx], &css, sizeof(css));
+
+			NATCAP_INFO("(CCO)" DEBUG_UDP_FMT ": update mapping %pI4:%u=>%pI4:%u\n", DEBUG_UDP_ARG(iph,l4),
+			            &css.lan_ip, ntohs(css.lan_port), &css.wan_ip, ntohs(css.wan_port));
+
+			cone_nat_update(&css);
 		}
 	}
 
@@ -1931,13 +2536,11 @@ static unsigned int natcap_common_cone_snat_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (cone_nat_array && cone_snat_array && IP_SET_test_src_ipport(state, in, out, skb, "cone_nat_unused_dst") <= 0) {
+	if (cone_nat_table && cone_snat_table && IP_SET_test_src_ipport(state, in, out, skb, "cone_nat_unused_dst") <= 0) {
 		int ret;
-		unsigned int idx;
 		const struct rtable *rt;
 		__be32 newsrc, nh;
-		struct cone_nat_session cns;
-		struct cone_snat_session css;
+		struct cone_snat_session css, cns;
 
 		rt = skb_rtable(skb);
 		nh = rt_nexthop(rt, ip_hdr(skb)->daddr);
@@ -1947,15 +2550,10 @@ static unsigned int natcap_common_cone_snat_hook(void *priv,
 			return NF_ACCEPT;
 		}
 
-		idx = cone_snat_hash(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, newsrc) % 32768;
-		memcpy(&css, &cone_snat_array[idx], sizeof(css));
-		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip == css.lan_ip &&
-		        ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port == css.lan_port &&
-		        css.wan_ip == newsrc && css.wan_port != 0) {
-			idx = ntohs(css.wan_port) % 65536;
-			memcpy(&cns, &cone_nat_array[idx], sizeof(cns));
+		if (cone_snat_lookup(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port, newsrc, &css) == 0) {
 			if (__IP_SET_test_src_port(state, in, out, skb, "cone_nat_unused_port", &UDPH(l4)->source, css.wan_port) <= 0 &&
-			        cns.ip == css.lan_ip && cns.port == css.lan_port) {
+			        cone_nat_lookup(css.wan_ip, css.wan_port, &cns) == 0 &&
+			        cns.lan_ip == css.lan_ip && cns.lan_port == css.lan_port) {
 				__be32 oldip;
 
 				oldip = iph->saddr;
@@ -2034,19 +2632,15 @@ int natcap_common_init(void)
 	}
 
 	dnatcap_map_init();
-	cone_nat_array = vmalloc(sizeof(struct cone_nat_session) * 65536);
-	if (cone_nat_array == NULL) {
-		ret = -ENOMEM;
-		goto err_alloc_cone_nat_array;
+	ret = natcap_session_slab_setup();
+	if (ret != 0) {
+		goto err_natcap_session_slab_setup;
 	}
-	memset(cone_nat_array, 0, sizeof(struct cone_nat_session) * 65536);
 
-	cone_snat_array = vmalloc(sizeof(struct cone_snat_session) * 32768);
-	if (cone_snat_array == NULL) {
-		ret = -ENOMEM;
-		goto err_alloc_cone_snat_array;
+	ret = cone_nat_init();
+	if (ret != 0) {
+		goto err_cone_nat_init;
 	}
-	memset(cone_snat_array, 0, sizeof(struct cone_snat_session) * 32768);
 
 	need_conntrack();
 	ret = nf_register_hooks(common_hooks, ARRAY_SIZE(common_hooks));
@@ -2058,10 +2652,10 @@ int natcap_common_init(void)
 
 	nf_unregister_hooks(common_hooks, ARRAY_SIZE(common_hooks));
 err_nf_register_hooks:
-	vfree(cone_snat_array);
-err_alloc_cone_snat_array:
-	vfree(cone_nat_array);
-err_alloc_cone_nat_array:
+	cone_nat_exit();
+err_cone_nat_init:
+	natcap_session_slab_cleanup();
+err_natcap_session_slab_setup:
 	return ret;
 }
 
@@ -2070,19 +2664,9 @@ void natcap_common_exit(void)
 	int i;
 	nf_unregister_hooks(common_hooks, ARRAY_SIZE(common_hooks));
 
-	if (cone_nat_array) {
-		void *tmp = cone_nat_array;
-		cone_nat_array = NULL;
-		synchronize_rcu();
-		vfree(tmp);
-	}
+	cone_nat_exit();
 
-	if (cone_snat_array) {
-		void *tmp = cone_snat_array;
-		cone_snat_array = NULL;
-		synchronize_rcu();
-		vfree(tmp);
-	}
+	natcap_session_slab_cleanup();
 
 	for (i = 0; i < NR_CPUS; i++) {
 		if (peer_user_uskbs[i]) {
@@ -37,6 +37,7 @@
 #include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_nat.h>
 #include <linux/inetdevice.h>
+#include <linux/seqlock.h>
 #include "natcap.h"
 
 #if defined(CONFIG_NF_CONNTRACK_MARK)
@@ -86,9 +87,19 @@ extern unsigned int peer_multipath;
 extern unsigned int natcap_ignore_forward;
 extern unsigned int natcap_ignore_mask;
 
-extern struct cone_nat_session *cone_nat_array;
-extern struct cone_snat_session *cone_snat_array;
+#define CONE_BUCKET_WAYS 4
+struct cone_nat_bucket {
+	seqcount_t seq;
+	unsigned short stamp[CONE_BUCKET_WAYS];
+	struct cone_snat_session ent[CONE_BUCKET_WAYS];
+} ____cacheline_aligned_in_smp;
 
+extern struct cone_nat_bucket *cone_nat_table;
+extern struct cone_nat_bucket *cone_snat_table;
+
+int cone_nat_lookup(__be32 wan_ip, __be16 wan_port, struct cone_snat_session *css);
+int cone_snat_lookup(__be32 lan_ip, __be16 lan_port, __be32 wan_ip, struct cone_snat_session *css);
+void cone_nat_update(const struct cone_snat_session *css);
 void cone_nat_cleanup(void);
 
 #define NATCAP_MIN_PMTU 68
@@ -98,6 +109,71 @@ extern unsigned int natcap_max_pmtu;
 
 extern unsigned int natcap_touch_timeout;
 
+/* per-ct ipset verdict cache, for sets tested on every packet of a flow */
+enum {
+	NATCAP_IPSET_CONE_WAN_SRC,
+	NATCAP_IPSET_CONE_WAN_DST,
+	NATCAP_IPSET_CONE_UNUSED_DPORT,
+	NATCAP_IPSET_CACHED_MAX = 8,
+};
+
+#define NATCAP_IPSET_CACHE_TIMEOUT_MAX 86400
+
+extern unsigned int ipset_cache_timeout;
+extern atomic_t natcap_ipset_flush_gen;
+
+static inline unsigned int natcap_ipset_gen(unsigned int timeout)
+{
+	/* both parts only ever move forward, so a flush can never alias an older epoch */
+	return (atomic_read(&natcap_ipset_flush_gen) + jiffies / ((unsigned long)timeout * HZ)) & 0xffff;
+}
+
+static inline void natcap_ipset_cache_flush(void)
+{
+	atomic_inc(&natcap_ipset_flush_gen);
+}
+
+static inline int natcap_ipset_cache_get(struct natcap_session *ns, int id, int *ret)
+{
+	unsigned int timeout = READ_ONCE(ipset_cache_timeout);
+	unsigned int c = READ_ONCE(ns->ipset_cache);
+
+	if (timeout == 0 || !(c & (1 << (8 + id))) || (c >> 16) != natcap_ipset_gen(timeout))
+		return -1;
+	*ret = !!(c & (1 << id));
+	return 0;
+}
+
+static inline void natcap_ipset_cache_set(struct natcap_session *ns, int id, int ret)
+{
+	unsigned int timeout = READ_ONCE(ipset_cache_timeout);
+	unsigned int gen, c;
+
+	if (timeout == 0)
+		return;
+	gen = natcap_ipset_gen(timeout);
+	c = READ_ONCE(ns->ipset_cache);
+	if ((c >> 16) != gen)
+		c = gen << 16;
+	c |= 1 << (8 + id);
+	if (ret > 0)
+		c |= 1 << id;
+	else
+		c &= ~(1 << id);
+	/* one word store: a racing cpu can only lose an update, never mix verdicts */
+	WRITE_ONCE(ns->ipset_cache, c);
+}
+
+/* evaluate @test once per ct and generation, returns 1 (in set) or 0 */
+#define IP_SET_test_cached(ns, id, test) ({ \
+	int __ret; \
+	if (natcap_ipset_cache_get((ns), (id), &__ret) != 0) { \
+		__ret = ((test) > 0); \
+		natcap_ipset_cache_set((ns), (id), __ret); \
+	} \
+	__ret; \
+})
+
 extern unsigned short natcap_redirect_port;
 extern unsigned short natcap_client_redirect_port;
 
@@ -246,6 +322,7 @@ extern void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*updat
 
 extern int skb_rcsum_verify(struct sk_buff *skb);
 extern int skb_rcsum_tcpudp(struct sk_buff *skb);
+extern int skb_data_hook_rcsum(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int));
 
 extern int natcap_tcpopt_setup(unsigned long status, struct sk_buff *skb, struct nf_conn *ct, struct natcap_TCPOPT *tcpopt, __be32 ip, __be16 port);
 extern int natcap_tcp_encode(struct nf_conn *ct, struct sk_buff *skb, const struct natcap_TCPOPT *tcpopt, int dir);
@@ -512,9 +589,13 @@ extern unsigned int natcap_snat_setup(struct nf_conn *ct, __be32 addr, __be16 ma
 
 extern u32 cone_snat_hash(__be32 ip, __be16 port, __be32 wan_ip);
 
-extern int natcap_session_init(struct nf_conn *ct, gfp_t gfp);
+#define __ALIGN_64BITS 8
+
+extern unsigned int session_slab;
+extern int natcap_session_init(struct nf_conn *ct, gfp_t gfp, int mp);
 extern struct natcap_session *natcap_session_get(struct nf_conn *ct);
-static inline struct natcap_session *natcap_session_in(struct nf_conn *ct)
+/* @mp: the flow may go peer multipath, a session that already exists is not grown */
+static inline struct natcap_session *natcap_session_in_mp(struct nf_conn *ct, int mp)
 {
 	struct natcap_session *ns = natcap_session_get(ct);
 
@@ -522,13 +603,26 @@ static inline struct natcap_session *natcap_session_in(struct nf_conn *ct)
 		return ns;
 	}
 
-	if (natcap_session_init(ct, GFP_ATOMIC) != 0) {
+	if (natcap_session_init(ct, GFP_ATOMIC, mp) != 0) {
 		return NULL;
 	}
 
 	return natcap_session_get(ct);
 }
 
+static inline struct natcap_session *natcap_session_in(struct nf_conn *ct)
+{
+	return natcap_session_in_mp(ct, 0);
+}
+
+static inline struct natcap_session_mp *natcap_session_mp(struct natcap_session *ns)
+{
+	if (!(NS_PEER_MP & ns->n.status)) {
+		return NULL;
+	}
+	return (void *)ns + ALIGN(sizeof(struct natcap_session), __ALIGN_64BITS);
+}
+
 extern void natcap_clone_timeout(struct nf_conn *dst, struct nf_conn *src);
 extern int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m);
 
@@ -742,6 +836,17 @@ static inline int inet_is_local(const struct net_device *dev, __be32 ip)
 #define skb_make_writable !skb_ensure_writable
 #endif
 
+/* make skb writable for an in-place payload rewrite. as in esp_input(), the page frags of an skb
+ * that is not cloned and has no frag_list or shared frags are ours to write, so only hdrlen
+ * is pulled and GRO/GSO skbs keep their frags instead of being linearized */
+static inline int skb_data_make_writable(struct sk_buff *skb, int hdrlen)
+{
+	if (!skb_cloned(skb) && !skb_has_frag_list(skb) && !skb_has_shared_frag(skb)) {
+		return skb_make_writable(skb, hdrlen);
+	}
+	return skb_make_writable(skb, skb->len);
+}
+
 static inline struct sk_buff *natcap_peer_ctrl_alloc(struct sk_buff *oskb)
 {
 	struct sk_buff *nskb;
@@ -68,6 +68,7 @@ static char *natcap_ctl_buffer = NULL;
 static void *natcap_start(struct seq_file *m, loff_t *pos)
 {
 	int n = 0;
+	struct tuple server[SERVER_GROUP_MAX];
 
 	if ((*pos) == 0) {
 		n = snprintf(natcap_ctl_buffer,
@@ -80,6 +81,7 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		             "#    delete [ip]:[port]-[e/o] -- delete one server\n"
 		             "#    clean -- remove all existing server(s)\n"
 		             "#    change_server -- change current server\n"
+		             "#    ipset_cache_flush -- drop cached per-conn ipset verdicts\n"
 		             "#\n"
 		             "# Info:\n"
 		             "#    mode=%s(%u)\n"
@@ -99,6 +101,10 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		             "#    rx_speed_limit=%d B/s\n"
 		             "#    tx_pkts_threshold=%d\n"
 		             "#    rx_pkts_threshold=%d\n"
+		             "#    user_speed_mode=%s(%u)\n"
+		             "#    user_tx_speed_limit=%d B/s\n"
+		             "#    user_rx_speed_limit=%d B/s\n"
+		             "#    user_speed_users=%u\n"
 		             "#    http_confusion=%u\n"
 		             "#    encode_http_only=%u\n"
 		             "#    sproxy=%u\n"
@@ -108,13 +114,19 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		             "#    natcap_client_redirect_port=%u\n"
 		             "#    natcap_max_pmtu=%u\n"
 		             "#    natcap_touch_timeout=%u\n"
+		             "#    session_slab=%u\n"
+		             "#    ipset_cache_timeout=%u\n"
+		             "#    cniplist_prefixes=%u\n"
+		             "#    cniplist6_prefixes=%u\n"
 		             "#    flow_total_tx_bytes=%llu\n"
 		             "#    flow_total_rx_bytes=%llu\n"
 		             "#    auth_http_redirect_url=%s\n"
 		             "#    htp_confusion_host=%s\n"
 		             "#    server_persist_lock=%u\n"
+		             "#    server_select_mode=%s(%u)\n"
 		             "#    dns_proxy_drop=%u\n"
 		             "#    peer_multipath=%u\n"
+		             "#    peer_multipath_mode=%s(%u)\n"
 		             "#    macfilter=%s(%u)\n"
 		             "#    ipfilter=%s(%u)\n"
 		             "#    dns_proxy_server=" TUPLE_FMT "\n"
@@ -131,8 +143,8 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		             "\n",
 		             NATCAP_VERSION,
 		             mode_str[mode], mode,
-		             TUPLE_ARG(natcap_server_info_current(SERVER_GROUP_0)),
-		             TUPLE_ARG(natcap_server_info_current(SERVER_GROUP_1)),
+		             TUPLE_ARG(natcap_server_info_current(SERVER_GROUP_0, &server[SERVER_GROUP_0])),
+		             TUPLE_ARG(natcap_server_info_current(SERVER_GROUP_1, &server[SERVER_GROUP_1])),
 		             default_mac_addr[0], default_mac_addr[1], default_mac_addr[2], default_mac_addr[3], default_mac_addr[4], default_mac_addr[5],
 		             ntohl(default_u_hash),
 		             ntohl(default_u_hash),
@@ -147,14 +159,22 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		             natcap_rx_speed_get(),
 		             tx_pkts_threshold,
 		             rx_pkts_threshold,
+		             natcap_user_mode_str[natcap_user_mode], natcap_user_mode,
+		             natcap_user_tx_speed_get(),
+		             natcap_user_rx_speed_get(),
+		             natcap_user_count_get(),
 		             http_confusion, encode_http_only, sproxy, ntohs(knock_port), knock_flood,
 		             ntohs(natcap_redirect_port), ntohs(natcap_client_redirect_port), natcap_max_pmtu, natcap_touch_timeout,
+		             session_slab,
+		             ipset_cache_timeout, cniplist_prefixes(), cniplist6_prefixes(),
 		             flow_total_tx_bytes, flow_total_rx_bytes,
 		             auth_http_redirect_url,
 		             htp_confusion_host,
 		             server_persist_lock,
+		             server_select_mode_str[server_select_mode], server_select_mode,
 		             dns_proxy_drop,
 		             peer_multipath,
+		             peer_multipath_mode_str[peer_multipath_mode], peer_multipath_mode,
 		             macfilter_acl_str[macfilter], macfilter,
 		             ipfilter_acl_str[ipfilter], ipfilter,
 		             TUPLE_ARG(dns_proxy_server),
@@ -168,7 +188,7 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 		int x = 0;
 
 		for (x = SERVER_GROUP_0; x < SERVER_GROUP_MAX; x++) {
-			dst = (struct tuple *)natcap_server_info_get(x, (*pos) - 1);
+			dst = (struct tuple *)natcap_server_info_get(x, (*pos) - 1, &server[0]);
 			if (dst) break;
 		}
 
@@ -447,6 +467,15 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 				goto done;
 			}
 		}
+	} else if (strncmp(data, "server_select_mode=", 19) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "server_select_mode=%u", &d);
+			if (n == 1 && d < NATCAP_SERVER_SELECT_MAX) {
+				server_select_mode = d;
+				goto done;
+			}
+		}
 	} else if (strncmp(data, "dns_proxy_drop=", 15) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			int d;
@@ -464,6 +493,26 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 			goto done;
 		}
 		err = -EINVAL;
+	} else if (strncmp(data, "peer_multipath_mode=", 20) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			char tmp[8];
+			n = sscanf(data, "peer_multipath_mode=%u", &d);
+			if (n == 1 && d < NATCAP_PEER_MULTIPATH_MAX) {
+				peer_multipath_mode = d;
+				goto done;
+			}
+			n = sscanf(data, "peer_multipath_mode=%7s", tmp);
+			if (n == 1) {
+				for (d = 0; d < NATCAP_PEER_MULTIPATH_MAX; d++) {
+					if (strcmp(tmp, peer_multipath_mode_str[d]) == 0) {
+						peer_multipath_mode = d;
+						goto done;
+					}
+				}
+			}
+			err = -EINVAL;
+		}
 	} else if (strncmp(data, "tx_speed_limit=", 15) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			int d;
@@ -500,6 +549,77 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 				goto done;
 			}
 		}
+	} else if (strncmp(data, "user_speed_mode=", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "user_speed_mode=%u", &d);
+			if (n == 1 && d < NATCAP_USER_MODE_MAX) {
+				natcap_user_mode_set(d);
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "user_tx_speed_limit=", 20) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "user_tx_speed_limit=%d", &d);
+			if (n == 1) {
+				natcap_user_tx_speed_set(d);
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "user_rx_speed_limit=", 20) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "user_rx_speed_limit=%d", &d);
+			if (n == 1) {
+				natcap_user_rx_speed_set(d);
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "user_speed_limit=", 17) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int a, b, c, d, e, f;
+			unsigned char key[ETH_ALEN] = { };
+			int tx, rx;
+			n = sscanf(data, "user_speed_limit=%02x:%02x:%02x:%02x:%02x:%02x,%d,%d\n", &a, &b, &c, &d, &e, &f, &tx, &rx);
+			if ( n == 8 &&
+			        ((a & 0xff) == a) &&
+			        ((b & 0xff) == b) &&
+			        ((c & 0xff) == c) &&
+			        ((d & 0xff) == d) &&
+			        ((e & 0xff) == e) &&
+			        ((f & 0xff) == f) ) {
+				key[0] = a;
+				key[1] = b;
+				key[2] = c;
+				key[3] = d;
+				key[4] = e;
+				key[5] = f;
+				if ((err = natcap_user_speed_limit(key, NATCAP_USER_MODE_MAC, tx, rx)) == 0) {
+					goto done;
+				}
+				NATCAP_println("natcap_user_speed_limit() failed ret=%d", err);
+			} else {
+				n = sscanf(data, "user_speed_limit=%u.%u.%u.%u,%d,%d\n", &a, &b, &c, &d, &tx, &rx);
+				if ( n == 6 &&
+				        ((a & 0xff) == a) &&
+				        ((b & 0xff) == b) &&
+				        ((c & 0xff) == c) &&
+				        ((d & 0xff) == d) ) {
+					__be32 ip = htonl((a<<24)|(b<<16)|(c<<8)|(d<<0));
+					memcpy(key, &ip, sizeof(ip));
+					if ((err = natcap_user_speed_limit(key, NATCAP_USER_MODE_IP, tx, rx)) == 0) {
+						goto done;
+					}
+					NATCAP_println("natcap_user_speed_limit() failed ret=%d", err);
+				}
+			}
+		}
+	} else if (strncmp(data, "user_speed_clean", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			natcap_user_speed_clean();
+			goto done;
+		}
 	} else if (strncmp(data, "http_confusion=", 15) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			int d;
@@ -601,6 +721,19 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 			natcap_touch_timeout = d;
 			goto done;
 		}
+	} else if (strncmp(data, "ipset_cache_timeout=", 20) == 0) {
+		unsigned int d;
+		n = sscanf(data, "ipset_cache_timeout=%u", &d);
+		if (n == 1) {
+			if (d > NATCAP_IPSET_CACHE_TIMEOUT_MAX)
+				d = NATCAP_IPSET_CACHE_TIMEOUT_MAX;
+			ipset_cache_timeout = d;
+			natcap_ipset_cache_flush();
+			goto done;
+		}
+	} else if (strncmp(data, "ipset_cache_flush", 17) == 0) {
+		natcap_ipset_cache_flush();
+		goto done;
 	} else if (strncmp(data, "natcap_max_pmtu=", 16) == 0) {
 		unsigned int d;
 		n = sscanf(data, "natcap_max_pmtu=%u", &d);
@@ -690,6 +823,22 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 			}
 			kfree(tmp);
 		}
+	} else if (strncmp(data, "cn_domain_blob=", 15) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			char *tmp = kmalloc(1024, GFP_KERNEL);
+			if (!tmp)
+				return -ENOMEM;
+			n = sscanf(data, "cn_domain_blob=%s\n", tmp);
+			tmp[1023] = 0;
+			if (n == 1) {
+				err = cn_domain_load_from_blob(tmp);
+				if (err == 0) {
+					kfree(tmp);
+					goto done;
+				}
+			}
+			kfree(tmp);
+		}
 	} else if (strncmp(data, "cn_domain=", 10) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			char tmp[128];
@@ -702,11 +851,72 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 				}
 			}
 		}
+	} else if (strncmp(data, "cn_domain_queue=", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			char tmp[128];
+			n = sscanf(data, "cn_domain_queue=%127s\n", tmp);
+			tmp[127] = 0;
+			if (n == 1) {
+				err = cn_domain_queue(tmp);
+				if (err == 0) {
+					goto done;
+				}
+			}
+		}
+	} else if (strncmp(data, "cn_domain_commit", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			err = cn_domain_insert_commit();
+			if (err == 0) {
+				goto done;
+			}
+		}
 	} else if (strncmp(data, "cn_domain_clean", 15) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			cn_domain_clean();
 			goto done;
 		}
+	} else if (strncmp(data, "cniplist_path=", 14) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			char *tmp = kmalloc(1024, GFP_KERNEL);
+			if (!tmp)
+				return -ENOMEM;
+			n = sscanf(data, "cniplist_path=%s\n", tmp);
+			tmp[1023] = 0;
+			if (n == 1) {
+				err = cniplist_load_from_path(tmp);
+				if (err == 0) {
+					kfree(tmp);
+					goto done;
+				}
+			}
+			kfree(tmp);
+		}
+	} else if (strncmp(data, "cniplist_clean", 14) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			cniplist_clean();
+			goto done;
+		}
+	} else if (strncmp(data, "cniplist6_path=", 15) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			char *tmp = kmalloc(1024, GFP_KERNEL);
+			if (!tmp)
+				return -ENOMEM;
+			n = sscanf(data, "cniplist6_path=%s\n", tmp);
+			tmp[1023] = 0;
+			if (n == 1) {
+				err = cniplist6_load_from_path(tmp);
+				if (err == 0) {
+					kfree(tmp);
+					goto done;
+				}
+			}
+			kfree(tmp);
+		}
+	} else if (strncmp(data, "cniplist6_clean", 15) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			cniplist6_clean();
+			goto done;
+		}
 	} else if (strncmp(data, "lk_domain=", 10) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			char tmp[128];
@@ -37,6 +37,9 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/timer.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <asm/unaligned.h>
@@ -58,123 +61,278 @@ struct peer_cache_node {
 	struct nf_conn *user;
 	struct sk_buff *skb;
 	unsigned long jiffies;
+	unsigned short prev; /* slot + 1, 0: none */
+	unsigned short next; /* slot + 1, 0: none, also links the free list */
 };
 
-DEFINE_SPINLOCK(peer_cache_lock);
-#define MAX_PEER_CACHE 64
-static unsigned short peer_cache_next_to_clean = 0;
-static unsigned short peer_cache_next_to_use = 0;
-static struct peer_cache_node peer_cache[MAX_PEER_CACHE];
+/* slot i belongs to shard i % PEER_CACHE_SHARDS, attached slots are kept oldest first for the cleaner */
+struct peer_cache_shard {
+	spinlock_t lock;
+	unsigned short free;
+	unsigned short head;
+	unsigned short tail;
+} ____cacheline_aligned_in_smp;
+
+#define PEER_CACHE_SHARDS 16
+struct peer_cache_table {
+	unsigned int size;
+	struct peer_cache_shard shard[PEER_CACHE_SHARDS];
+	struct peer_cache_node node[0];
+};
+
+static struct peer_cache_table __rcu *peer_cache = NULL;
+static DEFINE_MUTEX(peer_cache_mutex);
+#define PEER_CACHE_SIZE_DEFAULT 1024
+#define PEER_CACHE_SIZE_MAX (65536 - PEER_CACHE_SHARDS)
+static unsigned int peer_cache_size = PEER_CACHE_SIZE_DEFAULT;
+/* truesize of all cached skbs, attach fails beyond peer_cache_mem_limit */
+static atomic_t peer_cache_mem = ATOMIC_INIT(0);
+static unsigned int peer_cache_mem_limit = 4 * 1024 * 1024;
 #define PEER_CACHE_TIMEOUT 4
 
 __be32 peer_pub_ip[PEER_PUB_NUM];
 unsigned int peer_pub_active[PEER_PUB_NUM];
 unsigned int peer_pub_idx = 0;
 
-static inline void peer_cache_init(void)
+static struct peer_cache_table *peer_cache_table_alloc(unsigned int size)
+{
+	struct peer_cache_table *t;
+	struct peer_cache_shard *sh;
+	unsigned int i;
+
+	t = vmalloc(sizeof(struct peer_cache_table) + size * sizeof(struct peer_cache_node));
+	if (t == NULL)
+		return NULL;
+	memset(t, 0, sizeof(struct peer_cache_table) + size * sizeof(struct peer_cache_node));
+	t->size = size;
+	for (i = 0; i < PEER_CACHE_SHARDS; i++) {
+		spin_lock_init(&t->shard[i].lock);
+	}
+	for (i = size; i > 0; i--) {
+		sh = &t->shard[(i - 1) % PEER_CACHE_SHARDS];
+		t->node[i - 1].next = sh->free;
+		sh->free = i;
+	}
+	return t;
+}
+
+/* shard lock held: unlink slot i from the attached list and return it to the free list */
+static void peer_cache_node_release(struct peer_cache_table *t, struct peer_cache_shard *sh, unsigned int i)
+{
+	struct peer_cache_node *pc = &t->node[i];
+
+	if (pc->prev)
+		t->node[pc->prev - 1].next = pc->next;
+	else
+		sh->head = pc->next;
+	if (pc->next)
+		t->node[pc->next - 1].prev = pc->prev;
+	else
+		sh->tail = pc->prev;
+
+	pc->user = NULL;
+	pc->skb = NULL;
+	pc->prev = 0;
+	pc->next = sh->free;
+	sh->free = i + 1;
+}
+
+/* shard lock held */
+static void peer_cache_node_drop(struct peer_cache_table *t, struct peer_cache_shard *sh, unsigned int i)
+{
+	struct peer_cache_node *pc = &t->node[i];
+	struct natcap_session *ns = natcap_session_get(pc->user);
+
+	if (ns && ns->p.cache_index == i + 1)
+		ns->p.cache_index = 0;
+	nf_ct_put(pc->user);
+	if (pc->skb != NULL) {
+		atomic_sub(pc->skb->truesize, &peer_cache_mem);
+		consume_skb(pc->skb);
+	}
+	peer_cache_node_release(t, sh, i);
+}
+
+/* no reader left on t */
+static void peer_cache_table_free(struct peer_cache_table *t)
+{
+	struct peer_cache_shard *sh;
+	unsigned int i;
+
+	for (i = 0; i < PEER_CACHE_SHARDS; i++) {
+		sh = &t->shard[i];
+		spin_lock_bh(&sh->lock);
+		while (sh->head != 0) {
+			peer_cache_node_drop(t, sh, sh->head - 1);
+		}
+		spin_unlock_bh(&sh->lock);
+	}
+	vfree(t);
+}
+
+static void peer_cache_publish(struct peer_cache_table *t)
+{
+	struct peer_cache_table *old;
+
+	old = rcu_dereference_protected(peer_cache, lockdep_is_held(&peer_cache_mutex));
+	rcu_assign_pointer(peer_cache, t);
+	if (old) {
+		synchronize_rcu();
+		peer_cache_table_free(old);
+	}
+}
+
+static int peer_cache_resize(unsigned int size)
+{
+	struct peer_cache_table *t;
+
+	if (size < PEER_CACHE_SHARDS || size > PEER_CACHE_SIZE_MAX)
+		return -EINVAL;
+
+	t = peer_cache_table_alloc(size);
+	if (t == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&peer_cache_mutex);
+	peer_cache_size = size;
+	peer_cache_publish(t);
+	mutex_unlock(&peer_cache_mutex);
+
+	return 0;
+}
+
+static inline int peer_cache_init(void)
 {
-	spin_lock_bh(&peer_cache_lock);
-	memset(peer_cache, 0, sizeof(struct peer_cache_node) * MAX_PEER_CACHE);
-	spin_unlock_bh(&peer_cache_lock);
+	return peer_cache_resize(peer_cache_size);
 }
 
 static inline int peer_cache_attach(struct nf_conn *ct, struct sk_buff *skb)
 {
 	struct natcap_session *ns = natcap_session_get(ct);
+	struct peer_cache_table *t;
+	struct peer_cache_shard *sh;
+	struct peer_cache_node *pc;
+	unsigned int i, k, start;
+	int ret = -1;
+
 	//XXX we use p.cache_index - 1 as index
 	if (ns == NULL || ns->p.cache_index != 0) {
 		return -1;
 	}
-	spin_lock_bh(&peer_cache_lock);
-	if (peer_cache[peer_cache_next_to_use].user != NULL) {
-		spin_unlock_bh(&peer_cache_lock);
+	if (atomic_add_return(skb->truesize, &peer_cache_mem) > peer_cache_mem_limit) {
+		atomic_sub(skb->truesize, &peer_cache_mem);
 		return -1;
 	}
-	nf_conntrack_get(&ct->ct_general);
-	peer_cache[peer_cache_next_to_use].jiffies = jiffies;
-	peer_cache[peer_cache_next_to_use].user = ct;
-	peer_cache[peer_cache_next_to_use].skb = skb;
-	ns->p.cache_index = peer_cache_next_to_use + 1;
-	peer_cache_next_to_use = (peer_cache_next_to_use + 1) % MAX_PEER_CACHE;
-	spin_unlock_bh(&peer_cache_lock);
-	return 0;
+
+	rcu_read_lock();
+	t = rcu_dereference(peer_cache);
+	if (t == NULL)
+		goto out;
+
+	/* start from the shard of this ct and borrow from the next ones when it is full */
+	start = hash_ptr(ct, 32) % PEER_CACHE_SHARDS;
+	for (k = 0; k < PEER_CACHE_SHARDS; k++) {
+		sh = &t->shard[(start + k) % PEER_CACHE_SHARDS];
+		if (sh->free == 0)
+			continue;
+		spin_lock_bh(&sh->lock);
+		if (sh->free == 0) {
+			spin_unlock_bh(&sh->lock);
+			continue;
+		}
+		i = sh->free - 1;
+		pc = &t->node[i];
+		sh->free = pc->next;
+
+		nf_conntrack_get(&ct->ct_general);
+		pc->jiffies = jiffies;
+		pc->user = ct;
+		pc->skb = skb;
+		pc->next = 0;
+		pc->prev = sh->tail;
+		if (sh->tail)
+			t->node[sh->tail - 1].next = i + 1;
+		else
+			sh->head = i + 1;
+		sh->tail = i + 1;
+		ns->p.cache_index = i + 1;
+		spin_unlock_bh(&sh->lock);
+		ret = 0;
+		break;
+	}
+
+out:
+	rcu_read_unlock();
+	if (ret != 0)
+		atomic_sub(skb->truesize, &peer_cache_mem);
+	return ret;
 }
 
 static inline struct sk_buff *peer_cache_detach(struct nf_conn *ct)
 {
-	unsigned short i;
+	unsigned int i;
 	struct sk_buff *skb = NULL;
 	struct natcap_session *ns = natcap_session_get(ct);
+	struct peer_cache_table *t;
+	struct peer_cache_shard *sh;
 
 	if (ns == NULL)
 		return NULL;
 	i = ns->p.cache_index;
-	if (i == 0 || i > MAX_PEER_CACHE)
+	if (i == 0)
 		return NULL;
 	i = i - 1;
-	spin_lock_bh(&peer_cache_lock);
-	if (peer_cache[i].user == ct) {
+
+	rcu_read_lock();
+	t = rcu_dereference(peer_cache);
+	if (t == NULL || i >= t->size)
+		goto out;
+	sh = &t->shard[i % PEER_CACHE_SHARDS];
+	spin_lock_bh(&sh->lock);
+	if (t->node[i].user == ct) {
 		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			skb = peer_cache[i].skb;
-			peer_cache[i].skb = NULL;
-		}
+		nf_ct_put(t->node[i].user);
+		skb = t->node[i].skb;
+		if (skb != NULL)
+			atomic_sub(skb->truesize, &peer_cache_mem);
+		peer_cache_node_release(t, sh, i);
 	}
-	spin_unlock_bh(&peer_cache_lock);
+	spin_unlock_bh(&sh->lock);
+
+out:
+	rcu_read_unlock();
 	return skb;
 }
 
+/* run from peer_timer_flush: a shard is only locked when its oldest entry has expired */
 static inline void peer_cache_cleaner(void)
 {
-	unsigned short i;
-	struct natcap_session *ns;
-	if (peer_cache[peer_cache_next_to_clean].user != NULL &&
-	        !time_after(jiffies, peer_cache[peer_cache_next_to_clean].jiffies + PEER_CACHE_TIMEOUT * HZ))
-		return;
-	spin_lock_bh(&peer_cache_lock);
-	i = peer_cache_next_to_clean;
-	while (i != peer_cache_next_to_use) {
-		if (peer_cache[i].user == NULL) {
-			i = (i + 1) % MAX_PEER_CACHE;
+	struct peer_cache_table *t;
+	struct peer_cache_shard *sh;
+	unsigned short head;
+	unsigned int i;
+
+	rcu_read_lock();
+	t = rcu_dereference(peer_cache);
+	for (i = 0; t != NULL && i < PEER_CACHE_SHARDS; i++) {
+		sh = &t->shard[i];
+		head = READ_ONCE(sh->head);
+		if (head == 0 || !time_after(jiffies, t->node[head - 1].jiffies + PEER_CACHE_TIMEOUT * HZ))
 			continue;
+		spin_lock_bh(&sh->lock);
+		while (sh->head != 0 && time_after(jiffies, t->node[sh->head - 1].jiffies + PEER_CACHE_TIMEOUT * HZ)) {
+			peer_cache_node_drop(t, sh, sh->head - 1);
 		}
-		if (!time_after(jiffies, peer_cache[i].jiffies + PEER_CACHE_TIMEOUT * HZ))
-			break;
-		ns = natcap_session_get(peer_cache[i].user);
-		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			consume_skb(peer_cache[i].skb);
-			peer_cache[i].skb = NULL;
-		}
-		i = (i + 1) % MAX_PEER_CACHE;
+		spin_unlock_bh(&sh->lock);
 	}
-	peer_cache_next_to_clean = i;
-	spin_unlock_bh(&peer_cache_lock);
+	rcu_read_unlock();
 }
 
 static inline void peer_cache_cleanup(void)
 {
-	unsigned short i;
-	struct natcap_session *ns;
-	spin_lock_bh(&peer_cache_lock);
-	for (i = 0; i < MAX_PEER_CACHE; i++) {
-		if (peer_cache[i].user == NULL)
-			continue;
-		ns = natcap_session_get(peer_cache[i].user);
-		//BUG_ON(ns == NULL);
-		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			consume_skb(peer_cache[i].skb);
-			peer_cache[i].skb = NULL;
-		}
-	}
-	spin_unlock_bh(&peer_cache_lock);
+	mutex_lock(&peer_cache_mutex);
+	peer_cache_publish(NULL);
+	mutex_unlock(&peer_cache_mutex);
 }
 
 static unsigned int rt_out_magic = 0;
@@ -260,8 +418,21 @@ static __be16 peer_local_port = __constant_htons(443);
 
 #define ICMP_PAYLOAD_LIMIT 1024
 
-#define MAX_PEER_SERVER 8
-struct peer_server_node peer_server[MAX_PEER_SERVER];
+/* peer servers are hashed by ip; nodes are allocated on first use with port_map[conn_max].
+ * once peer_server_max is reached the least recently active one is replaced by a fresh node in its
+ * slot and freed after a grace period, so a ps pointer is only good under rcu_read_lock().
+ * a replaced node is unhashed: nothing may be stored in its port_map any more.
+ * lock order: peer_server_lock -> ps->lock
+ */
+#define PEER_SERVER_LIMIT 1024
+#define PEER_SERVER_DEFAULT 64
+#define PEER_SERVER_HASH_BITS 8
+static struct peer_server_node *peer_server[PEER_SERVER_LIMIT];
+static struct hlist_head peer_server_hash[1 << PEER_SERVER_HASH_BITS];
+static unsigned int peer_server_count = 0;
+static unsigned int peer_server_max = PEER_SERVER_DEFAULT;
+static unsigned int peer_conn_max = PEER_CONN_DEFAULT;
+static DEFINE_SPINLOCK(peer_server_lock);
 
 static inline __be16 peer_fakeuser_sport(struct nf_conn *user)
 {
@@ -277,10 +448,78 @@ static inline __be16 peer_fakeuser_dport(struct nf_conn *user)
 }
 
 #define MAX_PEER_PORT_MAP 65536
-static struct nf_conn **peer_port_map = NULL;
+/* lookups are lockless under RCU, peer_port_map_lock only serializes alloc and drop */
+static struct nf_conn __rcu **peer_port_map = NULL;
 DEFINE_SPINLOCK(peer_port_map_lock);
 static struct timer_list peer_timer;
 
+#define peer_port_mapped(port) rcu_access_pointer(peer_port_map[port])
+
+/* two level free port bitmap: bit w of peer_port_full is set when word w of peer_port_used has no free port */
+#define PEER_PORT_MAP_WORDS (MAX_PEER_PORT_MAP / BITS_PER_LONG)
+static unsigned long peer_port_used[BITS_TO_LONGS(MAX_PEER_PORT_MAP)];
+static unsigned long peer_port_full[BITS_TO_LONGS(PEER_PORT_MAP_WORDS)];
+
+static void peer_port_bitmap_init(void)
+{
+	bitmap_zero(peer_port_used, MAX_PEER_PORT_MAP);
+	bitmap_zero(peer_port_full, PEER_PORT_MAP_WORDS);
+	/* 0-1023 and 65535 are never handed out */
+	bitmap_set(peer_port_used, 0, 1024);
+	bitmap_set(peer_port_full, 0, 1024 / BITS_PER_LONG);
+	set_bit(MAX_PEER_PORT_MAP - 1, peer_port_used);
+}
+
+/* peer_port_map_lock held: the first free port at or after hint, wrapping around */
+static int peer_port_bitmap_get(unsigned int hint)
+{
+	unsigned int w = hint / BITS_PER_LONG;
+	unsigned long word;
+	unsigned int port;
+
+	word = peer_port_used[w] | ((1UL << (hint % BITS_PER_LONG)) - 1);
+	if (word == ~0UL) {
+		w = find_next_zero_bit(peer_port_full, PEER_PORT_MAP_WORDS, w + 1);
+		if (w >= PEER_PORT_MAP_WORDS) {
+			w = find_first_zero_bit(peer_port_full, PEER_PORT_MAP_WORDS);
+			if (w >= PEER_PORT_MAP_WORDS)
+				return -1;
+		}
+		word = peer_port_used[w];
+	}
+
+	port = w * BITS_PER_LONG + ffz(word);
+	__set_bit(port, peer_port_used);
+	if (peer_port_used[w] == ~0UL)
+		__set_bit(w, peer_port_full);
+
+	return port;
+}
+
+static inline void peer_port_bitmap_put(unsigned int port)
+{
+	__clear_bit(port, peer_port_used);
+	__clear_bit(port / BITS_PER_LONG, peer_port_full);
+}
+
+/* peer_port_map_lock held */
+static void peer_port_map_drop(unsigned int idx, struct nf_conn *user, const char *why)
+{
+	unsigned char client_mac[ETH_ALEN];
+	struct user_expect *ue = peer_user_expect(user);
+
+	set_byte4(client_mac, get_byte4((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip));
+	set_byte2(client_mac + 4, get_byte2((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all));
+	NATCAP_INFO(DEBUG_FMT_PREFIX "C[%02x:%02x:%02x:%02x:%02x:%02x,%pI4,%pI4] P=%u [AS %ds] %s\n", DEBUG_ARG_PREFIX,
+	            client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
+	            &ue->local_ip, &ue->ip, ntohs(ue->map_port), ue->last_active != 0 ? (uintmindiff(ue->last_active, jiffies) + HZ / 2) / HZ : (-1),
+	            why
+	           );
+	RCU_INIT_POINTER(peer_port_map[idx], NULL);
+	peer_port_bitmap_put(idx);
+	nf_ct_put(user);
+}
+
 #define NATCAP_PEER_EXPECT_TIMEOUT 5
 #define NATCAP_PEER_USER_TIMEOUT_DEFAULT 180
 
@@ -289,62 +528,141 @@ unsigned int peer_port_map_timeout = NATCAP_PEER_USER_TIMEOUT_DEFAULT;
 #define NATCAP_PEER_CONN_TIMEOUT_DEFAULT 180
 unsigned int peer_conn_timeout = NATCAP_PEER_CONN_TIMEOUT_DEFAULT;
 
-#define PEER_PORT_MAP_FLUSH_STEP 256
+/* lazy expiry wheel for peer users (id = map port) and fakeusers (id = MAX_PEER_PORT_MAP + ps->idx * PEER_CONN_LIMIT + pmi):
+ * an entry sits in the slot of its expected expiry and is only looked at when that slot comes due,
+ * so touching last_active costs nothing and a refreshed entry is just moved on to its new slot.
+ * lock order: peer_port_map_lock / ps->lock -> peer_wheel_lock
+ */
+#define PEER_WHEEL_SIZE 1024
+#define PEER_WHEEL_TICK (HZ / 2)
+#define PEER_WHEEL_IDS (MAX_PEER_PORT_MAP + PEER_SERVER_LIMIT * PEER_CONN_LIMIT)
+static unsigned int peer_wheel[PEER_WHEEL_SIZE];
+static unsigned int *peer_wheel_next = NULL;
+static unsigned long peer_wheel_linked[BITS_TO_LONGS(PEER_WHEEL_IDS)];
+static unsigned long peer_wheel_clock;
+static DEFINE_SPINLOCK(peer_wheel_lock);
+
+/* peer_wheel_lock held, id is not in any slot */
+static void __peer_wheel_add(unsigned int id, int remain)
+{
+	unsigned long ticks = remain > 0 ? (remain + PEER_WHEEL_TICK - 1) / PEER_WHEEL_TICK : 1;
+	unsigned int slot;
+
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks >= PEER_WHEEL_SIZE)
+		ticks = PEER_WHEEL_SIZE - 1; /* re-armed when the slot comes due */
+	slot = (peer_wheel_clock + ticks) % PEER_WHEEL_SIZE;
+	peer_wheel_next[id] = peer_wheel[slot];
+	peer_wheel[slot] = id;
+}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-static void peer_timer_flush(unsigned long ignore)
-#else
-static void peer_timer_flush(struct timer_list *ignore)
-#endif
+/* the entry was just (re)mapped, with the lock guarding it held */
+static void peer_wheel_link(unsigned int id, unsigned int timeout)
+{
+	spin_lock_bh(&peer_wheel_lock);
+	if (!test_bit(id, peer_wheel_linked)) {
+		__set_bit(id, peer_wheel_linked);
+		__peer_wheel_add(id, timeout);
+	}
+	spin_unlock_bh(&peer_wheel_lock);
+}
+
+/* the entry came due, with the lock guarding it held: move it on or forget it */
+static void peer_wheel_rearm(unsigned int id, int remain)
+{
+	spin_lock_bh(&peer_wheel_lock);
+	if (remain == INT_MIN)
+		__clear_bit(id, peer_wheel_linked);
+	else
+		__peer_wheel_add(id, remain);
+	spin_unlock_bh(&peer_wheel_lock);
+}
+
+static void peer_wheel_user_due(unsigned int port)
 {
-	static unsigned short flush_idx = 0;
-	unsigned int i, j = 0;
 	struct nf_conn *user;
-	for (i = 0; i < PEER_PORT_MAP_FLUSH_STEP; i++) {
-		if (peer_port_map[flush_idx] == NULL) {
-			flush_idx++;
-			continue;
+	struct user_expect *ue;
+	int remain = INT_MIN;
+
+	spin_lock_bh(&peer_port_map_lock);
+	user = rcu_dereference_protected(peer_port_map[port], lockdep_is_held(&peer_port_map_lock));
+	if (user != NULL) {
+		ue = peer_user_expect(user);
+		if (after(jiffies, ue->last_active + peer_port_map_timeout * HZ)) {
+			peer_port_map_drop(port, user, "timeout drop");
+		} else {
+			remain = (int)(ue->last_active + peer_port_map_timeout * HZ - (unsigned int)jiffies);
 		}
-		spin_lock_bh(&peer_port_map_lock);
-		user = peer_port_map[flush_idx];
-		if (user != NULL) {
-			unsigned char client_mac[ETH_ALEN];
-			struct user_expect *ue = peer_user_expect(user);
-			if (after(jiffies, ue->last_active + peer_port_map_timeout * HZ)) {
-				set_byte4(client_mac, get_byte4((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip));
-				set_byte2(client_mac + 4, get_byte2((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all));
-				NATCAP_INFO(DEBUG_FMT_PREFIX "C[%02x:%02x:%02x:%02x:%02x:%02x,%pI4,%pI4] P=%u [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
-				            client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-				            &ue->local_ip, &ue->ip, ntohs(ue->map_port), ue->last_active != 0 ? (uintmindiff(ue->last_active, jiffies) + HZ / 2) / HZ : (-1)
-				           );
-				peer_port_map[flush_idx] = NULL;
-				nf_ct_put(user);
-				j++;
-			}
+	}
+	peer_wheel_rearm(port, remain);
+	spin_unlock_bh(&peer_port_map_lock);
+}
+
+static void peer_wheel_fakeuser_due(unsigned int id)
+{
+	struct peer_server_node *ps;
+	unsigned int pmi = (id - MAX_PEER_PORT_MAP) % PEER_CONN_LIMIT;
+	struct nf_conn *user = NULL;
+	struct fakeuser_expect *fue;
+	int remain = INT_MIN;
+
+	rcu_read_lock();
+	ps = READ_ONCE(peer_server[(id - MAX_PEER_PORT_MAP) / PEER_CONN_LIMIT]);
+	spin_lock_bh(&ps->lock);
+	if (pmi < ps->conn_max)
+		user = ps->port_map[pmi];
+	if (user != NULL) {
+		fue = peer_fakeuser_expect(user);
+		if (after(jiffies, fue->last_active + peer_conn_timeout * HZ)) {
+			NATCAP_INFO(DEBUG_FMT_PREFIX "conn[%u:%u] @N[[%pI4:%u] [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
+			            ntohs(peer_fakeuser_sport(user)), ntohs(peer_fakeuser_dport(user)),
+			            &ps->ip, ntohs(ps->map_port), fue->last_active != 0 ?(uintmindiff(fue->last_active, jiffies) + HZ / 2) / HZ : (-1)
+			           );
+			ps->port_map[pmi] = NULL;
+			nf_ct_put(user);
+		} else {
+			remain = (int)(fue->last_active + peer_conn_timeout * HZ - (unsigned int)jiffies);
 		}
-		spin_unlock_bh(&peer_port_map_lock);
-		flush_idx++;
 	}
+	peer_wheel_rearm(id, remain);
+	spin_unlock_bh(&ps->lock);
+	rcu_read_unlock();
+}
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		struct peer_server_node *ps = &peer_server[i];
-		spin_lock_bh(&ps->lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
-			user = ps->port_map[j];
-			if (user != NULL) {
-				struct fakeuser_expect *fue = peer_fakeuser_expect(user);
-				if (after(jiffies, fue->last_active + peer_conn_timeout * HZ)) {
-					NATCAP_INFO(DEBUG_FMT_PREFIX "conn[%u:%u] @N[[%pI4:%u] [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
-					            ntohs(peer_fakeuser_sport(user)), ntohs(peer_fakeuser_dport(user)),
-					            &ps->ip, ntohs(ps->map_port), fue->last_active != 0 ?(uintmindiff(fue->last_active, jiffies) + HZ / 2) / HZ : (-1)
-					           );
-					peer_server[i].port_map[j] = NULL;
-					nf_ct_put(user);
-				}
-			}
+static inline void peer_wheel_fakeuser_link(struct peer_server_node *ps, unsigned int pmi)
+{
+	peer_wheel_link(MAX_PEER_PORT_MAP + ps->idx * PEER_CONN_LIMIT + pmi, peer_conn_timeout * HZ);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void peer_timer_flush(unsigned long ignore)
+#else
+static void peer_timer_flush(struct timer_list *ignore)
+#endif
+{
+	unsigned long now = jiffies / PEER_WHEEL_TICK;
+	unsigned int i, id, next;
+
+	for (i = 0; peer_wheel_clock != now && i < PEER_WHEEL_SIZE; i++) {
+		spin_lock_bh(&peer_wheel_lock);
+		peer_wheel_clock++;
+		id = peer_wheel[peer_wheel_clock % PEER_WHEEL_SIZE];
+		peer_wheel[peer_wheel_clock % PEER_WHEEL_SIZE] = 0;
+		spin_unlock_bh(&peer_wheel_lock);
+
+		while (id != 0) {
+			next = peer_wheel_next[id];
+			if (id < MAX_PEER_PORT_MAP)
+				peer_wheel_user_due(id);
+			else
+				peer_wheel_fakeuser_due(id);
+			id = next;
 		}
-		spin_unlock_bh(&ps->lock);
 	}
+	spin_lock_bh(&peer_wheel_lock);
+	peer_wheel_clock = now;
+	spin_unlock_bh(&peer_wheel_lock);
 
 	peer_cache_cleaner();
 
@@ -358,18 +676,9 @@ static inline void peer_port_map_kill(unsigned short idx)
 {
 	struct nf_conn *user;
 	spin_lock_bh(&peer_port_map_lock);
-	user = peer_port_map[idx];
+	user = rcu_dereference_protected(peer_port_map[idx], lockdep_is_held(&peer_port_map_lock));
 	if (user != NULL) {
-		unsigned char client_mac[ETH_ALEN];
-		struct user_expect *ue = peer_user_expect(user);
-		set_byte4(client_mac, get_byte4((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip));
-		set_byte2(client_mac + 4, get_byte2((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all));
-		NATCAP_INFO(DEBUG_FMT_PREFIX "C[%02x:%02x:%02x:%02x:%02x:%02x,%pI4,%pI4] P=%u [AS %ds] killed\n", DEBUG_ARG_PREFIX,
-		            client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-		            &ue->local_ip, &ue->ip, ntohs(ue->map_port), ue->last_active != 0 ? (uintmindiff(ue->last_active, jiffies) + HZ / 2) / HZ : (-1)
-		           );
-		peer_port_map[idx] = NULL;
-		nf_ct_put(user);
+		peer_port_map_drop(idx, user, "killed");
 	}
 	spin_unlock_bh(&peer_port_map_lock);
 }
@@ -399,18 +708,30 @@ static void peer_timer_exit(void)
 	del_timer(&peer_timer);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#define peer_user_tryget(user) refcount_inc_not_zero(&(user)->ct_general.use)
+#else
+#define peer_user_tryget(user) atomic_inc_not_zero(&(user)->ct_general.use)
+#endif
+
 static inline struct nf_conn *get_peer_user(unsigned int port)
 {
 	struct nf_conn *user;
-	if (port >= MAX_PEER_PORT_MAP || peer_port_map[port] == NULL)
+	if (port >= MAX_PEER_PORT_MAP)
 		return NULL;
 
-	spin_lock_bh(&peer_port_map_lock);
-	user = peer_port_map[port];
+	rcu_read_lock();
+	user = rcu_dereference(peer_port_map[port]);
 	if (user) {
-		nf_conntrack_get(&user->ct_general);
+		/* conntrack memory is SLAB_TYPESAFE_BY_RCU, only trust a ref that is still the mapped one */
+		if (!peer_user_tryget(user)) {
+			user = NULL;
+		} else if (user != rcu_access_pointer(peer_port_map[port])) {
+			nf_ct_put(user);
+			user = NULL;
+		}
 	}
-	spin_unlock_bh(&peer_port_map_lock);
+	rcu_read_unlock();
 	return user;
 }
 
@@ -422,45 +743,58 @@ static inline void put_peer_user(struct nf_conn *user)
 static __be16 alloc_peer_port(struct nf_conn *user, const unsigned char *mac)
 {
 	static unsigned int seed_rnd;
-	unsigned short port;
 	unsigned int hash;
 	unsigned int data = get_byte4(mac);
+	int port;
 
 	get_random_once(&seed_rnd, sizeof(seed_rnd));
 
 	hash = jhash2(&data, 1, get_byte2(mac + 4)^seed_rnd);
 
-	port = 1024 + hash % (MAX_PEER_PORT_MAP - 1024);
-
-	for (; port < MAX_PEER_PORT_MAP - 1; port++) {
-		if (peer_port_map[port] == NULL) {
-			spin_lock_bh(&peer_port_map_lock);
-			//re-check-in-lock
-			if (peer_port_map[port] == NULL) {
-				peer_port_map[port] = user;
-				nf_conntrack_get(&user->ct_general);
-				spin_unlock_bh(&peer_port_map_lock);
-				return htons(port);
-			}
-			spin_unlock_bh(&peer_port_map_lock);
-		}
+	spin_lock_bh(&peer_port_map_lock);
+	port = peer_port_bitmap_get(1024 + hash % (MAX_PEER_PORT_MAP - 1024));
+	if (port < 0) {
+		spin_unlock_bh(&peer_port_map_lock);
+		return 0;
 	}
+	nf_conntrack_get(&user->ct_general);
+	rcu_assign_pointer(peer_port_map[port], user);
+	peer_wheel_link(port, peer_port_map_timeout * HZ);
+	spin_unlock_bh(&peer_port_map_lock);
 
-	for (port = 1024; port < 1024 + hash % (MAX_PEER_PORT_MAP - 1024); port++) {
-		if (peer_port_map[port] == NULL) {
-			spin_lock_bh(&peer_port_map_lock);
-			//re-check-in-lock
-			if (peer_port_map[port] == NULL) {
-				peer_port_map[port] = user;
-				nf_conntrack_get(&user->ct_general);
-				spin_unlock_bh(&peer_port_map_lock);
-				return htons(port);
+	return htons(port);
+}
+
+static inline struct hlist_head *peer_server_bucket(__be32 ip)
+{
+	return &peer_server_hash[hash_32((__force u32)ip, PEER_SERVER_HASH_BITS)];
+}
+
+/* a lookup racing with a recycle may miss, new == 1 re-checks under peer_server_lock */
+static struct peer_server_node *peer_server_node_find(__be32 ip, unsigned short conn, int new)
+{
+	struct peer_server_node *ps;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(ps, peer_server_bucket(ip), hnode) {
+		if (ps->ip != ip)
+			continue;
+		spin_lock_bh(&ps->lock);
+		//re-check-in-lock
+		if (ps->ip == ip && !hlist_unhashed(&ps->hnode)) {
+			if (new == 1 && ps->conn != conn) {
+				ps->conn = min_t(unsigned short, conn, ps->conn_max);
 			}
-			spin_unlock_bh(&peer_port_map_lock);
+			spin_unlock_bh(&ps->lock);
+			rcu_read_unlock();
+			return ps;
 		}
+		spin_unlock_bh(&ps->lock);
+		break;
 	}
+	rcu_read_unlock();
 
-	return 0;
+	return NULL;
 }
 
 struct peer_server_node *peer_server_node_in(__be32 ip, unsigned short conn, int new)
@@ -469,66 +803,87 @@ struct peer_server_node *peer_server_node_in(__be32 ip, unsigned short conn, int
 	unsigned long maxdiff = 0;
 	unsigned long last_jiffies = jiffies;
 	struct peer_server_node *ps = NULL;
+	struct peer_server_node *ops = NULL;
 
 	if (conn <= 0)
 		conn = 1;
 	if (ip == 0)
 		return NULL;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		if (peer_server[i].ip == ip) {
-			spin_lock_bh(&peer_server[i].lock);
-			//re-check-in-lock
-			if (peer_server[i].ip == ip) {
-				if (new == 1 && peer_server[i].conn != conn) {
-					peer_server[i].conn = conn;
-				}
-				spin_unlock_bh(&peer_server[i].lock);
-				return &peer_server[i];
-			}
-			spin_unlock_bh(&peer_server[i].lock);
-			break;
+	ps = peer_server_node_find(ip, conn, new);
+	if (ps != NULL || new == 0)
+		return ps;
+
+	spin_lock_bh(&peer_server_lock);
+	ps = peer_server_node_find(ip, conn, new);
+	if (ps != NULL) {
+		spin_unlock_bh(&peer_server_lock);
+		return ps;
+	}
+
+	if (peer_server_count < peer_server_max) {
+		ps = kzalloc(sizeof(struct peer_server_node) + sizeof(struct nf_conn *) * peer_conn_max, GFP_ATOMIC);
+		if (ps != NULL) {
+			spin_lock_init(&ps->lock);
+			ps->idx = peer_server_count;
+			ps->conn_max = peer_conn_max;
+			spin_lock_bh(&ps->lock);
+			/* make the node visible to the wheel and the ctl listing only once it is set up */
+			smp_wmb();
+			WRITE_ONCE(peer_server[peer_server_count], ps);
+			peer_server_count++;
+			goto init_out;
 		}
 	}
-	if (new == 0)
-		return NULL;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		if (peer_server[i].ip == 0) {
-			spin_lock_bh(&peer_server[i].lock);
-			if (peer_server[i].ip == 0) {
-				ps = &peer_server[i];
-				goto init_out;
-			}
-			spin_unlock_bh(&peer_server[i].lock);
+	for (i = 0; i < peer_server_count; i++) {
+		if (maxdiff <= uintmindiff(peer_server[i]->last_active, last_jiffies)) {
+			maxdiff = uintmindiff(peer_server[i]->last_active, last_jiffies);
+			ops = peer_server[i];
 		}
-		if (maxdiff < uintmindiff(peer_server[i].last_active, last_jiffies)) {
-			maxdiff = uintmindiff(peer_server[i].last_active, last_jiffies);
-			ps = &peer_server[i];
+	}
+	if (ops == NULL) {
+		spin_unlock_bh(&peer_server_lock);
+		return NULL;
+	}
+
+	/* readers may still hold the old node: unhash it and hand its slot to a fresh one */
+	ps = kzalloc(sizeof(struct peer_server_node) + sizeof(struct nf_conn *) * peer_conn_max, GFP_ATOMIC);
+	if (ps == NULL) {
+		spin_unlock_bh(&peer_server_lock);
+		return NULL;
+	}
+
+	spin_lock_bh(&ops->lock);
+	NATCAP_WARN(DEBUG_FMT_PREFIX "drop the old server %pI4 map_port=%u replace new=%pI4\n",
+	            DEBUG_ARG_PREFIX, &ops->ip, ntohs(ops->map_port), &ip);
+	hlist_del_init_rcu(&ops->hnode);
+	for (i = 0; i < ops->conn_max; i++) {
+		if (ops->port_map[i] != NULL) {
+			nf_ct_put(ops->port_map[i]);
+			ops->port_map[i] = NULL;
 		}
 	}
+	spin_unlock_bh(&ops->lock);
+
+	spin_lock_init(&ps->lock);
+	ps->idx = ops->idx;
+	ps->conn_max = peer_conn_max;
+	spin_lock_bh(&ps->lock);
+	smp_wmb();
+	WRITE_ONCE(peer_server[ps->idx], ps);
+	kfree_rcu(ops, rcu);
 
-	if (ps) {
-		spin_lock_bh(&ps->lock);
 init_out:
-		if (ps->ip != 0) {
-			NATCAP_WARN(DEBUG_FMT_PREFIX "drop the old server %pI4 map_port=%u replace new=%pI4\n",
-			            DEBUG_ARG_PREFIX, &ps->ip, ntohs(ps->map_port), &ip);
-		}
-		for (i = 0; i < MAX_PEER_CONN; i++) {
-			if (ps->port_map[i] != NULL) {
-				nf_ct_put(ps->port_map[i]);
-				ps->port_map[i] = NULL;
-			}
-		}
-		ps->ip = ip;
-		ps->map_port = 0;
-		ps->conn = conn;
-		ps->last_active = 0;
-		ps->last_inuse = 0;
+	ps->ip = ip;
+	ps->map_port = 0;
+	ps->conn = min_t(unsigned short, conn, ps->conn_max);
+	ps->last_active = 0;
+	ps->last_inuse = 0;
+	hlist_add_head_rcu(&ps->hnode, peer_server_bucket(ip));
 
-		spin_unlock_bh(&ps->lock);
-	}
+	spin_unlock_bh(&ps->lock);
+	spin_unlock_bh(&peer_server_lock);
 
 	return ps;
 }
@@ -781,18 +1136,18 @@ struct nf_conn *peer_user_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __
 
 	ue = peer_user_expect(user);
 
-	if (user != peer_port_map[ntohs(ue->map_port)]) {
+	if (user != peer_port_mapped(ntohs(ue->map_port))) {
 		//XXX this can only happen when alloc_peer_port get 0 or old user got timeout.
 		//    so we re-alloc it
 		spin_lock_bh(&ue->lock);
 		//re-check-in-lock
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != peer_port_mapped(ntohs(ue->map_port))) {
 			//re-alloc-map_port
 			ue->map_port = alloc_peer_port(user, client_mac);
 		}
 		spin_unlock_bh(&ue->lock);
 
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != peer_port_mapped(ntohs(ue->map_port))) {
 			NATCAP_WARN("user [%02x:%02x:%02x:%02x:%02x:%02x] ct[%pI4:%u->%pI4:%u] alloc map_port fail\n",
 			            client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
 			            &saddr, ntohs(sport), &daddr, ntohs(dport));
@@ -1100,18 +1455,18 @@ int natcap_auth_request(const unsigned char *client_mac, __be32 client_ip)
 
 	ue = peer_user_expect(user);
 
-	if (user != peer_port_map[ntohs(ue->map_port)]) {
+	if (user != peer_port_mapped(ntohs(ue->map_port))) {
 		//XXX this can only happen when alloc_peer_port get 0 or old user got timeout.
 		//    so we re-alloc it
 		spin_lock_bh(&ue->lock);
 		//re-check-in-lock
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != peer_port_mapped(ntohs(ue->map_port))) {
 			//re-alloc-map_port
 			ue->map_port = alloc_peer_port(user, client_mac);
 		}
 		spin_unlock_bh(&ue->lock);
 
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != peer_port_mapped(ntohs(ue->map_port))) {
 			NATCAP_WARN("auth user [%02x:%02x:%02x:%02x:%02x:%02x] alloc map_port fail\n",
 			            client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5]);
 			/* alloc_peer_port fail: portmap would not work, but sni should work */
@@ -1662,7 +2017,7 @@ static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const
 	pmi = opmi;
 	if (ops == NULL) {
 		if (ps->last_inuse != 0 && before(jiffies, ps->last_inuse + peer_conn_timeout * HZ)) {
-			pmi = ntohs(ICMPH(otcph)->un.echo.sequence) % MAX_PEER_CONN;
+			pmi = ntohs(ICMPH(otcph)->un.echo.sequence) % ps->conn_max;
 		} else {
 			pmi = ntohs(ICMPH(otcph)->un.echo.sequence) % ps->conn;
 			if (pmi != 0) {
@@ -1701,9 +2056,10 @@ static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const
 			return NULL;
 		}
 	}
-	if (ps->port_map[pmi] == NULL) {
+	if (ps->port_map[pmi] == NULL && !hlist_unhashed(&ps->hnode)) {
 		nf_conntrack_get(&user->ct_general);
 		ps->port_map[pmi] = user;
+		peer_wheel_fakeuser_link(ps, pmi);
 	}
 	fue = peer_fakeuser_expect(user);
 	if (fue->pmi != pmi) {
@@ -2888,9 +3244,9 @@ sni_out:
 				pmi = fue->pmi;
 
 				spin_lock_bh(&ps->lock);
-				if (ps->port_map[pmi] != user || fue->local_seq + 1 != ntohl(TCPH(l4)->ack_seq)) {
+				if ((unsigned int)pmi >= ps->conn_max || ps->port_map[pmi] != user || fue->local_seq + 1 != ntohl(TCPH(l4)->ack_seq)) {
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": peer_server_node pmi user=%px,%px mismatch\n",
-					            DEBUG_TCP_ARG(iph,l4), ps->port_map[pmi], user);
+					            DEBUG_TCP_ARG(iph,l4), (unsigned int)pmi < ps->conn_max ? ps->port_map[pmi] : NULL, user);
 					spin_unlock_bh(&ps->lock);
 					nf_ct_put(user);
 					return NF_ACCEPT;
@@ -3820,8 +4176,8 @@ static unsigned int natcap_peer_dnat_hook(void *priv,
 		}
 
 		spin_lock_bh(&ps->lock);
-		if (ps->port_map[pmi] != user) {
-			NATCAP_WARN("(PD)" DEBUG_TCP_FMT ": mismatch pmi user=%p,%p, just bypass\n", DEBUG_TCP_ARG(iph,l4), ps->port_map[pmi], user);
+		if ((unsigned int)pmi >= ps->conn_max || ps->port_map[pmi] != user) {
+			NATCAP_WARN("(PD)" DEBUG_TCP_FMT ": mismatch pmi user=%p,%p, just bypass\n", DEBUG_TCP_ARG(iph,l4), (unsigned int)pmi < ps->conn_max ? ps->port_map[pmi] : NULL, user);
 			spin_unlock_bh(&ps->lock);
 			goto h_bypass;
 		}
@@ -4719,8 +5075,8 @@ static struct device *natcap_peer_dev;
 
 static inline struct peer_server_node *peer_server_node_get(unsigned int idx)
 {
-	if (idx < MAX_PEER_SERVER) {
-		return &(peer_server[idx]);
+	if (idx < PEER_SERVER_LIMIT) {
+		return READ_ONCE(peer_server[idx]);
 	}
 	return NULL;
 }
@@ -4747,6 +5103,10 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 		             "#    peer_sni_ban=%u\n"
 		             "#    peer_subtype=%u (auto=0, 1=SYN, 2=SSYN)\n"
 		             "#    peer_upstream_auth_ip=%pI4\n"
+		             "#    peer_cache_size=%u\n"
+		             "#    peer_cache_mem=%d/%u\n"
+		             "#    peer_server_max=%u (%u in use)\n"
+		             "#    peer_conn_max=%u\n"
 		             "#\n"
 		             "\n",
 		             &peer_local_ip, ntohs(peer_local_port),
@@ -4761,7 +5121,11 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 		             peer_max_pmtu,
 		             peer_sni_ban,
 		             peer_subtype,
-		             &peer_upstream_auth_ip
+		             &peer_upstream_auth_ip,
+		             peer_cache_size,
+		             atomic_read(&peer_cache_mem), peer_cache_mem_limit,
+		             peer_server_max, peer_server_count,
+		             peer_conn_max
 		            );
 		natcap_peer_ctl_buffer[n] = 0;
 		return natcap_peer_ctl_buffer;
@@ -4769,31 +5133,40 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 		unsigned char client_mac[ETH_ALEN];
 		struct nf_conn *user;
 		struct user_expect *ue;
-		struct peer_server_node *ps = peer_server_node_get((*pos) - 1);
+		struct peer_server_node *ps;
+		rcu_read_lock();
+		ps = peer_server_node_get((*pos) - 1);
 		if (ps) {
+			unsigned int i;
 			spin_lock_bh(&ps->lock);
 			natcap_peer_ctl_buffer[0] = 0;
 			n = snprintf(natcap_peer_ctl_buffer,
 			             PAGE_SIZE - 1,
 			             "N[%pI4:%u] [AS %ds]\n"
-			             "    conn[%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u]\n",
-			             &ps->ip, ntohs(ps->map_port), ps->last_active != 0 ? (uintmindiff(ps->last_active, jiffies) + HZ / 2) / HZ : (-1),
-			             ntohs(peer_fakeuser_sport(ps->port_map[0])), ntohs(peer_fakeuser_dport(ps->port_map[0])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[1])), ntohs(peer_fakeuser_dport(ps->port_map[1])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[2])), ntohs(peer_fakeuser_dport(ps->port_map[2])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[3])), ntohs(peer_fakeuser_dport(ps->port_map[3])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[4])), ntohs(peer_fakeuser_dport(ps->port_map[4])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[5])), ntohs(peer_fakeuser_dport(ps->port_map[5])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[6])), ntohs(peer_fakeuser_dport(ps->port_map[6])),
-			             ntohs(peer_fakeuser_sport(ps->port_map[7])), ntohs(peer_fakeuser_dport(ps->port_map[7]))
+			             "    conn[",
+			             &ps->ip, ntohs(ps->map_port), ps->last_active != 0 ? (uintmindiff(ps->last_active, jiffies) + HZ / 2) / HZ : (-1)
 			            );
+			for (i = 0; i < ps->conn_max; i++) {
+				n += snprintf(natcap_peer_ctl_buffer + n,
+				              PAGE_SIZE - 1 - n,
+				              "%s%u:%u", i == 0 ? "" : ",",
+				              ntohs(peer_fakeuser_sport(ps->port_map[i])), ntohs(peer_fakeuser_dport(ps->port_map[i]))
+				             );
+			}
+			n += snprintf(natcap_peer_ctl_buffer + n, PAGE_SIZE - 1 - n, "]\n");
 			spin_unlock_bh(&ps->lock);
+			rcu_read_unlock();
 			natcap_peer_ctl_buffer[n] = 0;
 			return natcap_peer_ctl_buffer;
 		}
+		rcu_read_unlock();
+		if ((*pos) - 1 < PEER_SERVER_LIMIT) {
+			/* skip the unused server slots */
+			(*pos) = PEER_SERVER_LIMIT + 1;
+		}
 
-		while ((*pos) - MAX_PEER_SERVER < MAX_PEER_PORT_MAP) {
-			user = get_peer_user((*pos) - MAX_PEER_SERVER);
+		while ((*pos) - PEER_SERVER_LIMIT < MAX_PEER_PORT_MAP) {
+			user = get_peer_user((*pos) - PEER_SERVER_LIMIT);
 			if (user == NULL) {
 				(*pos)++;
 				continue;
@@ -4816,8 +5189,8 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 			return natcap_peer_ctl_buffer;
 		}
 
-		while ((*pos) - MAX_PEER_SERVER - MAX_PEER_PORT_MAP < PEER_PUB_NUM) {
-			if (peer_pub_ip[(*pos) - MAX_PEER_SERVER - MAX_PEER_PORT_MAP] == 0) {
+		while ((*pos) - PEER_SERVER_LIMIT - MAX_PEER_PORT_MAP < PEER_PUB_NUM) {
+			if (peer_pub_ip[(*pos) - PEER_SERVER_LIMIT - MAX_PEER_PORT_MAP] == 0) {
 				(*pos)++;
 				continue;
 			}
@@ -4825,7 +5198,7 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 			n = snprintf(natcap_peer_ctl_buffer,
 			             PAGE_SIZE - 1,
 			             "peer=%pI4\n",
-			             &peer_pub_ip[(*pos) - MAX_PEER_SERVER - MAX_PEER_PORT_MAP]
+			             &peer_pub_ip[(*pos) - PEER_SERVER_LIMIT - MAX_PEER_PORT_MAP]
 			            );
 			natcap_peer_ctl_buffer[n] = 0;
 			return natcap_peer_ctl_buffer;
@@ -4932,6 +5305,38 @@ static ssize_t natcap_peer_write(struct file *file, const char __user *buf, size
 			peer_port_map_timeout = d;
 			goto done;
 		}
+	} else if (strncmp(data, "peer_cache_size=", 16) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_cache_size=%u", &d);
+		if (n == 1) {
+			if ((err = peer_cache_resize(d)) == 0) {
+				goto done;
+			}
+			NATCAP_println("peer_cache_resize() failed ret=%d", err);
+		}
+	} else if (strncmp(data, "peer_cache_mem_limit=", 21) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_cache_mem_limit=%u", &d);
+		if (n == 1) {
+			peer_cache_mem_limit = d;
+			goto done;
+		}
+	} else if (strncmp(data, "peer_server_max=", 16) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_server_max=%u", &d);
+		if (n == 1 && d >= 1 && d <= PEER_SERVER_LIMIT) {
+			/* servers already allocated beyond a lowered max are kept and recycled */
+			peer_server_max = d;
+			goto done;
+		}
+	} else if (strncmp(data, "peer_conn_max=", 14) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_conn_max=%u", &d);
+		if (n == 1 && d >= 1 && d <= PEER_CONN_LIMIT) {
+			/* applies to servers allocated from now on */
+			peer_conn_max = d;
+			goto done;
+		}
 	} else if (strncmp(data, "KN=", 3) == 0) {
 		unsigned int a, b, c, d, e, f;
 		unsigned int x0, x1, x2, x3, x4, x5;
@@ -5101,10 +5506,13 @@ static int peer_netdev_event(struct notifier_block *this, unsigned long event, v
 	if (event != NETDEV_UNREGISTER)
 		return NOTIFY_DONE;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		struct peer_server_node *ps = &peer_server[i];
+	rcu_read_lock();
+	for (i = 0; i < PEER_SERVER_LIMIT; i++) {
+		struct peer_server_node *ps = READ_ONCE(peer_server[i]);
+		if (ps == NULL)
+			break;
 		spin_lock_bh(&ps->lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
+		for (j = 0; j < ps->conn_max; j++) {
 			user = ps->port_map[j];
 			if (user != NULL) {
 				struct fakeuser_expect *fue = peer_fakeuser_expect(user);
@@ -5116,6 +5524,7 @@ static int peer_netdev_event(struct notifier_block *this, unsigned long event, v
 		}
 		spin_unlock_bh(&ps->lock);
 	}
+	rcu_read_unlock();
 
 	rt_out_magic += 1;
 
@@ -5145,16 +5554,30 @@ int natcap_peer_init(void)
 	memset(peer_pub_ip, 0, sizeof(peer_pub_ip));
 	memset(peer_pub_active, 0, sizeof(peer_pub_active));
 
-	peer_cache_init();
+	ret = peer_cache_init();
+	if (ret != 0)
+		return ret;
 	memset(peer_server, 0, sizeof(peer_server));
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		spin_lock_init(&peer_server[i].lock);
+	for (i = 0; i < (1 << PEER_SERVER_HASH_BITS); i++) {
+		INIT_HLIST_HEAD(&peer_server_hash[i]);
 	}
+	peer_server_count = 0;
 	peer_port_map = vmalloc(sizeof(struct nf_conn *) * MAX_PEER_PORT_MAP);
 	if (peer_port_map == NULL) {
+		peer_cache_cleanup();
 		return -ENOMEM;
 	}
 	memset(peer_port_map, 0, sizeof(struct nf_conn *) * MAX_PEER_PORT_MAP);
+	peer_port_bitmap_init();
+	peer_wheel_next = vmalloc(sizeof(unsigned int) * PEER_WHEEL_IDS);
+	if (peer_wheel_next == NULL) {
+		vfree(peer_port_map);
+		peer_cache_cleanup();
+		return -ENOMEM;
+	}
+	memset(peer_wheel, 0, sizeof(peer_wheel));
+	bitmap_zero(peer_wheel_linked, PEER_WHEEL_IDS);
+	peer_wheel_clock = jiffies / PEER_WHEEL_TICK;
 
 	register_netdevice_notifier(&peer_netdev_notifier);
 
@@ -5246,25 +5669,38 @@ void natcap_peer_exit(void)
 
 	spin_lock_bh(&peer_port_map_lock);
 	for (i = 0; i < MAX_PEER_PORT_MAP; i++) {
-		if (peer_port_map[i] != NULL) {
-			nf_ct_put(peer_port_map[i]);
-			peer_port_map[i] = NULL;
+		struct nf_conn *user = rcu_dereference_protected(peer_port_map[i], lockdep_is_held(&peer_port_map_lock));
+		if (user != NULL) {
+			RCU_INIT_POINTER(peer_port_map[i], NULL);
+			nf_ct_put(user);
 		}
 	}
 	spin_unlock_bh(&peer_port_map_lock);
+	synchronize_rcu();
 	vfree(peer_port_map);
+	vfree(peer_wheel_next);
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
+	spin_lock_bh(&peer_server_lock);
+	for (i = 0; i < peer_server_count; i++) {
 		unsigned int j;
-		spin_lock_bh(&peer_server[i].lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
-			if (peer_server[i].port_map[j]) {
-				nf_ct_put(peer_server[i].port_map[j]);
-				peer_server[i].port_map[j] = NULL;
+		struct peer_server_node *ps = peer_server[i];
+		spin_lock_bh(&ps->lock);
+		for (j = 0; j < ps->conn_max; j++) {
+			if (ps->port_map[j]) {
+				nf_ct_put(ps->port_map[j]);
+				ps->port_map[j] = NULL;
 			}
 		}
-		spin_unlock_bh(&peer_server[i].lock);
+		hlist_del_rcu(&ps->hnode);
+		spin_unlock_bh(&ps->lock);
+	}
+	spin_unlock_bh(&peer_server_lock);
+	synchronize_rcu();
+	for (i = 0; i < peer_server_count; i++) {
+		kfree(peer_server[i]);
+		peer_server[i] = NULL;
 	}
+	peer_server_count = 0;
 
 	peer_cache_cleanup();
 }
@@ -39,8 +39,13 @@ struct peer_server_node {
 	unsigned short conn;
 	unsigned int last_active;
 	unsigned int last_inuse;
-#define MAX_PEER_CONN 8
-	struct nf_conn *port_map[MAX_PEER_CONN];
+	struct hlist_node hnode;
+	unsigned short idx;
+#define PEER_CONN_DEFAULT 8
+#define PEER_CONN_LIMIT 32
+	unsigned short conn_max;
+	struct rcu_head rcu;
+	struct nf_conn *port_map[0];
 };
 
 struct natcap_route {
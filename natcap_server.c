@@ -1320,15 +1320,14 @@ static unsigned int natcap_server_pre_ct_in_hook(void *priv,
 			}
 
 			if ((NS_NATCAP_ENC & ns->n.status)) {
-				if (!skb_make_writable(skb, skb->len)) {
+				if (!skb_data_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 					NATCAP_ERROR("(SPCI)" DEBUG_UDP_FMT ": skb_make_writable() failed\n", DEBUG_UDP_ARG(iph,l4));
 					return NF_DROP;
 				}
 				iph = ip_hdr(skb);
 				l4 = (void *)iph + iph->ihl * 4;
 
-				skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
-				skb_rcsum_tcpudp(skb);
+				skb_data_hook_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
 			}
 
 			flow_total_rx_bytes += skb->len;
@@ -1554,7 +1553,7 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 			iph->protocol = IPPROTO_UDP;
 			skb->next = NULL;
 
-			if (nskb == NULL && ns->peer_ver == 1 && ns->peer_mark != 0xffff && ns->peer_req_cnt < 3 && uintmindiff(ns->peer_jiffies, jiffies) > 1*HZ ) {
+			if (nskb == NULL && ns->peer_ver == 1 && (NS_PEER_MP & ns->n.status) && ns->peer_mark != 0xffff && ns->peer_req_cnt < 3 && uintmindiff(ns->peer_jiffies, jiffies) > 1*HZ ) {
 				ns->peer_jiffies = jiffies;
 				pcskb = natcap_peer_ctrl_alloc(skb);
 				if (pcskb) {
@@ -1581,9 +1580,10 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 
 			if (ns->peer_ver == 1 && ns->peer_mark) {
 				unsigned int i, idx;
+				struct natcap_session_mp *mp = natcap_session_mp(ns);
 				for (i = 0; i < MAX_PEER_NUM; i++) {
 					idx = (i + ns->peer_idx) % MAX_PEER_NUM;
-					if (ns->peer_tuple3[idx].dip != 0 && short_test_bit(idx, &ns->peer_mark)) {
+					if (mp->peer_tuple3[idx].dip != 0 && short_test_bit(idx, &ns->peer_mark)) {
 						struct nf_conntrack_tuple tuple;
 						struct nf_conntrack_tuple_hash *h;
 
@@ -1591,9 +1591,9 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 
 						memset(&tuple, 0, sizeof(tuple));
 						tuple.src.u3.ip = iph->saddr;
-						tuple.src.u.udp.port = ns->peer_tuple3[idx].sport;
-						tuple.dst.u3.ip = ns->peer_tuple3[idx].dip;
-						tuple.dst.u.udp.port = ns->peer_tuple3[idx].dport;
+						tuple.src.u.udp.port = mp->peer_tuple3[idx].sport;
+						tuple.dst.u3.ip = mp->peer_tuple3[idx].dip;
+						tuple.dst.u.udp.port = mp->peer_tuple3[idx].dport;
 						tuple.src.l3num = PF_INET;
 						tuple.dst.protonum = IPPROTO_UDP;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
@@ -1605,9 +1605,9 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 							ct = nf_ct_tuplehash_to_ctrack(h);
 							nf_ct_put(ct);
 						} else {
-							ns->peer_tuple3[idx].dip = 0;
-							ns->peer_tuple3[idx].dport = 0;
-							ns->peer_tuple3[idx].sport = 0;
+							mp->peer_tuple3[idx].dip = 0;
+							mp->peer_tuple3[idx].dport = 0;
+							mp->peer_tuple3[idx].sport = 0;
 							short_clear_bit(idx, &ns->peer_mark);
 							break;
 						}
@@ -1617,9 +1617,9 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 							iph = ip_hdr(dup_skb);
 							l4 = (void *)iph + iph->ihl * 4;
 
-							iph->daddr = ns->peer_tuple3[idx].dip;
-							UDPH(l4)->dest = ns->peer_tuple3[idx].dport;
-							UDPH(l4)->source = ns->peer_tuple3[idx].sport;
+							iph->daddr = mp->peer_tuple3[idx].dip;
+							UDPH(l4)->dest = mp->peer_tuple3[idx].dport;
+							UDPH(l4)->source = mp->peer_tuple3[idx].sport;
 							set_byte4((void *)UDPH(l4) + 8, __constant_htonl(NATCAP_8_MAGIC));
 
 							dup_skb->ip_summed = CHECKSUM_UNNECESSARY;
@@ -1651,15 +1651,14 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 	} else if (iph->protocol == IPPROTO_UDP) {
 		NATCAP_DEBUG("(SPO)" DEBUG_UDP_FMT ": pass data reply\n", DEBUG_UDP_ARG(iph,l4));
 		if ((NS_NATCAP_ENC & ns->n.status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_data_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 				NATCAP_ERROR("(SPO)" DEBUG_UDP_FMT ": skb_make_writable() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
 			iph = ip_hdr(skb);
 			l4 = (void *)iph + iph->ihl * 4;
 
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			skb_data_hook_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
 		}
 
 		if ((NS_NATCAP_TCPUDPENC & ns->n.status)) {
@@ -1787,6 +1786,14 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 
 			NATCAP_DEBUG("(SPI)" DEBUG_TCP_FMT ": got UDP-to-TCP packet\n", DEBUG_TCP_ARG(iph,l4));
 
+			if (skb_is_gso(skb)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+				/* GRO merged several UDP-to-TCP packets, each one is a datagram of its own */
+				NATCAP_WARN("(SPI)" DEBUG_TCP_FMT ": GRO merged UDP-to-TCP packet not supported\n", DEBUG_TCP_ARG(iph,l4));
+				return NF_DROP;
+#endif
+			}
+
 			if (skb->ip_summed == CHECKSUM_NONE) {
 				if (skb_rcsum_verify(skb) != 0) {
 					NATCAP_WARN("(SPI)" DEBUG_TCP_FMT ": skb_rcsum_verify fail\n", DEBUG_TCP_ARG(iph,l4));
@@ -1816,7 +1823,17 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 			skb->len -= tcphdr_len - sizeof(struct udphdr);
 			skb->tail -= tcphdr_len - sizeof(struct udphdr);
 			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			if (skb_is_gso(skb)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+				/* GRO merged several UDP-to-TCP packets: every segment but the last is gso_size long,
+				 * exactly one datagram each, so pass it on as UDP GSO and let it split on the way out */
+				skb_shinfo(skb)->gso_type &= ~(SKB_GSO_TCPV4 | SKB_GSO_TCP_ECN | SKB_GSO_TCP_FIXEDID);
+				skb_shinfo(skb)->gso_type |= SKB_GSO_UDP_L4;
+#endif
+				skb->ip_summed = CHECKSUM_PARTIAL;
+			} else {
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
+			}
 			skb_rcsum_tcpudp(skb);
 
 			if (in)
@@ -1936,7 +1953,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 		}
 		natcap_clone_timeout(master, ct);
 
-		ns = natcap_session_in(ct);
+		ns = natcap_session_in_mp(ct, 1);
 		if (ns == NULL) {
 			NATCAP_WARN("(SPI)" DEBUG_TCP_FMT ": natcap_session_in failed\n", DEBUG_TCP_ARG(iph,l4));
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -1972,6 +1989,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 
 		if (get_byte4((void *)UDPH(l4) + 8 + 4) == __constant_htonl(NATCAP_9_MAGIC_TYPE1)) {
 			__be32 sip, dip;
+			struct natcap_session_mp *mp;
 
 			ct = master->master;
 			if (!ct) {
@@ -1983,6 +2001,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 				NATCAP_WARN("(SPI)" DEBUG_UDP_FMT ": natcap_session_get failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
+			mp = natcap_session_mp(ns);
 
 			sip = get_byte4((void *)UDPH(l4) + 8 + 4 + 4);
 			dip = iph->saddr;
@@ -1999,7 +2018,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 			iph->saddr = iph->daddr;
 			UDPH(l4)->check = CSUM_MANGLED_0;
 
-			if (ns->peer_cnt == 0 && peer_multipath) {
+			if (ns->peer_cnt == 0 && peer_multipath && mp) {
 				//lock once
 				if (!(IPS_NATCAP_CFM & ct->status) && !test_and_set_bit(IPS_NATCAP_CFM_BIT, &ct->status)) {
 					__be32 ip;
@@ -2010,18 +2029,18 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 						ip = peer_pub_ip[idx];
 						if (ip != 0 && ip != sip && ip != dip) {
 							for (j = 0; j < MAX_PEER_NUM && j < peer_multipath; j++)
-								if (ns->peer_tuple3[j].dip == ip)
+								if (mp->peer_tuple3[j].dip == ip)
 									break;
 
 							if (j == MAX_PEER_NUM || j == peer_multipath)
 								for (j = 0; j < MAX_PEER_NUM && j < peer_multipath; j++)
-									if (ns->peer_tuple3[j].dip == 0) {
+									if (mp->peer_tuple3[j].dip == 0) {
 										ns->peer_cnt++;
-										ns->peer_tuple3[j].dip = ip;
-										ns->peer_tuple3[j].dport = htons(prandom_u32() % (65536 - 1024) + 1024);
-										ns->peer_tuple3[j].sport = htons(prandom_u32() % (65536 - 1024) + 1024);
+										mp->peer_tuple3[j].dip = ip;
+										mp->peer_tuple3[j].dport = htons(prandom_u32() % (65536 - 1024) + 1024);
+										mp->peer_tuple3[j].sport = htons(prandom_u32() % (65536 - 1024) + 1024);
 										NATCAP_DEBUG("(SPI)" DEBUG_UDP_FMT ": peer%px select %u-%pI4:%u j=%u\n", DEBUG_UDP_ARG(iph,l4), (void *)&ns,
-										             ntohs(ns->peer_tuple3[j].sport), &ns->peer_tuple3[j].dip, ntohs(ns->peer_tuple3[j].dport), j);
+										             ntohs(mp->peer_tuple3[j].sport), &mp->peer_tuple3[j].dip, ntohs(mp->peer_tuple3[j].dport), j);
 										break;
 									}
 						}
@@ -2035,7 +2054,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 				struct ethhdr *neth;
 				struct sk_buff *nskb;
 				for (i = 0; i < MAX_PEER_NUM; i++) {
-					if (ns->peer_tuple3[i].dip == 0)
+					if (mp->peer_tuple3[i].dip == 0)
 						break;
 					if (short_test_bit(i, &ns->peer_mark))
 						continue;
@@ -2055,9 +2074,9 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 					l4 = (void *)iph + iph->ihl * 4;
 
 					iph->id = htons(jiffies);
-					iph->daddr = ns->peer_tuple3[i].dip;
-					UDPH(l4)->dest = ns->peer_tuple3[i].dport;
-					UDPH(l4)->source = ns->peer_tuple3[i].sport;
+					iph->daddr = mp->peer_tuple3[i].dip;
+					UDPH(l4)->dest = mp->peer_tuple3[i].dport;
+					UDPH(l4)->source = mp->peer_tuple3[i].sport;
 					set_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2, htons(i));
 
 					nskb->ip_summed = CHECKSUM_UNNECESSARY;
@@ -2135,6 +2154,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 			int ret;
 			unsigned int i, tmp;
 			struct ethhdr *eth;
+			struct natcap_session_mp *mp;
 			if (!nf_ct_is_confirmed(master) && !master->master) {
 				struct nf_conntrack_tuple tuple;
 				struct nf_conntrack_tuple_hash *h;
@@ -2167,11 +2187,12 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 					i = get_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2);
 					i = ntohs(i) % MAX_PEER_NUM;
 
-					if (!short_test_bit(i, &ns->peer_mark)) {
+					mp = natcap_session_mp(ns);
+					if (mp && !short_test_bit(i, &ns->peer_mark)) {
 						short_set_bit(i, &ns->peer_mark);
-						ns->peer_tuple3[i].dip = iph->saddr;
-						ns->peer_tuple3[i].dport = UDPH(l4)->source;
-						ns->peer_tuple3[i].sport = UDPH(l4)->dest;
+						mp->peer_tuple3[i].dip = iph->saddr;
+						mp->peer_tuple3[i].dport = UDPH(l4)->source;
+						mp->peer_tuple3[i].sport = UDPH(l4)->dest;
 						ns->peer_cnt++;
 						NATCAP_INFO("(SPI)" DEBUG_UDP_FMT ": CFM=%u: ct[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u] peer_mark=0x%x\n", DEBUG_UDP_ARG(iph,l4), i,
 						            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all),
@@ -2239,6 +2260,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 		} else if (get_byte4((void *)UDPH(l4) + 8 + 4) == __constant_htonl(NATCAP_9_MAGIC_TYPE4)) {
 			int ret;
 			unsigned int i;
+			struct natcap_session_mp *mp;
 			if (!master->master) {
 				xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
 				NATCAP_DEBUG("(SPI)" DEBUG_UDP_FMT ": peer pass forward: type4\n", DEBUG_UDP_ARG(iph,l4));
@@ -2253,8 +2275,9 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 
 			i = get_byte2((void *)UDPH(l4) + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 2);
 			i = ntohs(i) % MAX_PEER_NUM;
-			if (!short_test_bit(i, &ns->peer_mark) &&
-			        ns->peer_tuple3[i].dip == iph->saddr && ns->peer_tuple3[i].dport == UDPH(l4)->source && ns->peer_tuple3[i].sport == UDPH(l4)->dest) {
+			mp = natcap_session_mp(ns);
+			if (mp && !short_test_bit(i, &ns->peer_mark) &&
+			        mp->peer_tuple3[i].dip == iph->saddr && mp->peer_tuple3[i].dport == UDPH(l4)->source && mp->peer_tuple3[i].sport == UDPH(l4)->dest) {
 				short_set_bit(i, &ns->peer_mark);
 				NATCAP_INFO("(SPI)" DEBUG_UDP_FMT ": CFM=%u: ct[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u] peer_mark=0x%x\n", DEBUG_UDP_ARG(iph,l4), i,
 				            &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip, ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all),
@@ -2279,6 +2302,7 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 		int offlen;
 		unsigned int i;
 		int dir = CTINFO2DIR(ctinfo);
+		struct natcap_session_mp *mp;
 
 		if (skb->len < iph->ihl * 4 + sizeof(struct tcphdr) + 8) {
 			return NF_ACCEPT;
@@ -2321,10 +2345,11 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		if (ns->peer_mark != 0xff)
+		mp = natcap_session_mp(ns);
+		if (mp && ns->peer_mark != 0xff)
 			for (i = 0; i < MAX_PEER_NUM; i++)
 				if (!short_test_bit(i, &ns->peer_mark) &&
-				        ns->peer_tuple3[i].dip == iph->saddr && ns->peer_tuple3[i].dport == UDPH(l4)->source && ns->peer_tuple3[i].sport == UDPH(l4)->dest) {
+				        mp->peer_tuple3[i].dip == iph->saddr && mp->peer_tuple3[i].dport == UDPH(l4)->source && mp->peer_tuple3[i].sport == UDPH(l4)->dest) {
 					short_set_bit(i, &ns->peer_mark);
 					break;
 				}
@@ -0,0 +1,145 @@
+/*
+ * cn_domain_compile: build the cn_domain trie offline
+ *
+ *   cn_domain_compile [-s] accelerated-domains.china.raw.txt accelerated-domains.china.build
+ *   echo cn_domain_blob=/path/to/accelerated-domains.china.build >/dev/natcap_ctl
+ *
+ * The output is the exact in-kernel layout (see struct cn_domain_trie in natcap.h),
+ * so the module adopts it with a single copy. Use -s to write the opposite byte
+ * order when building for a target of different endianness.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#include "cn_domain_build.h"
+
+static char **keys = NULL;
+static unsigned int keys_count = 0;
+static unsigned int keys_size = 0;
+
+static int key_add(const char *d, int len)
+{
+	char key[CN_DOMAIN_MAX_KEY];
+	int klen = cn_domain_key_encode(key, d, len);
+
+	if (klen <= 0)
+		return klen;
+
+	if (keys_count + 1 > keys_size) {
+		keys_size = keys_size ? keys_size * 2 : 16 * 1024;
+		keys = realloc(keys, keys_size * sizeof(char *));
+		if (keys == NULL)
+			return -1;
+	}
+	keys[keys_count] = malloc(klen + 1);
+	if (keys[keys_count] == NULL)
+		return -1;
+	memcpy(keys[keys_count], key, klen);
+	keys[keys_count][klen] = 0;
+	keys_count++;
+
+	return 0;
+}
+
+/* same trie builder as cn_domain_build() in natcap_client.c */
+static struct cn_domain_trie *build(size_t *total)
+{
+	struct cn_domain_trie *t;
+	int err;
+
+	err = cn_domain_trie_build((const char **)keys, keys_count, &t);
+	if (err != 0) {
+		fprintf(stderr, "build: %s\n", strerror(-err));
+		return NULL;
+	}
+	*total = sizeof(struct cn_domain_trie) + t->node_count * sizeof(struct cn_domain_node) + t->pool_size;
+
+	return t;
+}
+
+static void swap_words(unsigned int *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] = __builtin_bswap32(p[i]);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s] <domain list> <output>\n"
+	        "  -s  swap byte order for a target of the other endianness\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int swap = 0;
+	int skip = 0;
+	char line[1024];
+	size_t total;
+	size_t words;
+	FILE *fp;
+	struct cn_domain_trie *t;
+
+	while ((opt = getopt(argc, argv, "sh")) != -1) {
+		switch (opt) {
+		case 's':
+			swap = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fp = fopen(argv[optind], "r");
+	if (fp == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		int len = strcspn(line, "\r\n");
+		if (key_add(line, len) != 0) {
+			line[len] = 0;
+			fprintf(stderr, "skip: %s\n", line);
+			skip++;
+		}
+	}
+	fclose(fp);
+
+	t = build(&total);
+	if (t == NULL) {
+		fprintf(stderr, "build failed\n");
+		return 1;
+	}
+	printf("%u domains, %u nodes, %u label bytes, %zu bytes total, %d skipped\n",
+	       t->count, t->node_count, t->pool_size, total, skip);
+
+	if (swap) {
+		/* header and nodes are all 32bit words, the label pool is bytes */
+		words = (sizeof(struct cn_domain_trie) + t->node_count * sizeof(struct cn_domain_node)) / sizeof(unsigned int);
+		swap_words((unsigned int *)t, words);
+	}
+
+	fp = fopen(argv[optind + 1], "wb");
+	if (fp == NULL) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (fwrite(t, 1, total, fp) != total) {
+		perror(argv[optind + 1]);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -25,6 +26,9 @@
 #include <sys/ioctl.h>
 #include <linux/netfilter_ipv4.h>
 #include "natcapd.h"
+#ifdef NATCAP_IO_URING
+#include <liburing.h>
+#endif
 
 #ifndef EAGAIN
 #define EAGAIN EWOULDBLOCK
@@ -62,6 +66,10 @@ static void close_and_free_server(EV_P_ server_t *server);
 int ito = 0;
 int verbose = 0;
 int reuse_port = 0;
+int worker_num = 0;
+int worker_affinity = 0;
+int use_splice = 0;
+int buf_size = BUF_SIZE;
 
 static int set_reuseport(int socket)
 {
@@ -69,11 +77,85 @@ static int set_reuseport(int socket)
 	return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 }
 
+/* with -z the data moves socket to pipe to socket by splice() and never enters user space,
+ * a buffer whose pipe can not be set up (or the socket can not splice) goes through data[]
+ */
+static buffer_t *new_buffer(void)
+{
+	buffer_t *buf = malloc(sizeof(buffer_t));
+
+	buf->len = 0;
+	buf->idx = 0;
+	buf->data = NULL;
+	if (use_splice && pipe2(buf->pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+		return buf;
+	}
+	buf->pipe[0] = -1;
+	buf->pipe[1] = -1;
+	buf->data = malloc(buf_size);
+
+	return buf;
+}
+
+static void free_buffer(buffer_t *buf)
+{
+	if (buf->pipe[0] != -1) {
+		close(buf->pipe[0]);
+		close(buf->pipe[1]);
+	}
+	if (buf->data != NULL) {
+		free(buf->data);
+	}
+	free(buf);
+}
+
+/* fall back to data[], only while the pipe is empty */
+static int buffer_nosplice(buffer_t *buf)
+{
+	if (buf->len != 0) {
+		return -1;
+	}
+	close(buf->pipe[0]);
+	close(buf->pipe[1]);
+	buf->pipe[0] = -1;
+	buf->pipe[1] = -1;
+	buf->data = malloc(buf_size);
+
+	return 0;
+}
+
+/* read what is there on @fd into the empty @buf, returns like recv() */
+static ssize_t buffer_recv(int fd, buffer_t *buf)
+{
+	if (buf->pipe[0] != -1) {
+		ssize_t r = splice(fd, NULL, buf->pipe[1], NULL, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r != -1 || errno != EINVAL || buffer_nosplice(buf) != 0) {
+			return r;
+		}
+	}
+	return recv(fd, buf->data, buf_size, 0);
+}
+
+/* write the pending buf->len bytes from buf->idx to @fd, returns like send() */
+static ssize_t buffer_send(int fd, buffer_t *buf)
+{
+	if (buf->pipe[0] != -1) {
+		return splice(buf->pipe[0], NULL, fd, NULL, buf->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+	return send(fd, buf->data + buf->idx, buf->len, 0);
+}
+
 static int remote_conn = 0;
 static int server_conn = 0;
 
-uint64_t tx                  = 0;
-uint64_t rx                  = 0;
+/* shared by all the workers, int sized so no libatomic is needed on the 32bit targets */
+#define stat_add(v, n) __atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+#define stat_sub(v, n) __atomic_sub_fetch(&(v), (n), __ATOMIC_RELAXED)
+
+/* the byte counters are per worker and only summed up on exit,
+ * the default loop counts into main_worker when there are no workers */
+static worker_t main_worker;
+static __thread worker_t *this_worker = &main_worker;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
@@ -160,9 +242,9 @@ int create_and_bind(const char *host, const char *port)
 }
 
 #ifdef NATCAP_CLIENT_MODE
-static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, server_t *server)
+static int remote_socket(struct addrinfo *res)
 #else
-static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *bind_addr, server_t *server)
+static int remote_socket(struct addrinfo *res, struct sockaddr *bind_addr)
 #endif
 {
 	int sockfd;
@@ -171,8 +253,7 @@ static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *
 	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 	if (sockfd == -1) {
 		perror("socket");
-		close(sockfd);
-		return NULL;
+		return -1;
 	}
 
 #ifndef NATCAP_CLIENT_MODE
@@ -215,6 +296,24 @@ static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *
 	if (setnonblocking(sockfd) == -1)
 		perror("setnonblocking");
 
+	return sockfd;
+}
+
+#ifdef NATCAP_CLIENT_MODE
+static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, server_t *server)
+#else
+static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *bind_addr, server_t *server)
+#endif
+{
+#ifdef NATCAP_CLIENT_MODE
+	int sockfd = remote_socket(res);
+#else
+	int sockfd = remote_socket(res, bind_addr);
+#endif
+	if (sockfd == -1) {
+		return NULL;
+	}
+
 	remote_t *remote = new_remote(sockfd);
 
 	int r = connect(sockfd, res->ai_addr, res->ai_addrlen);
@@ -278,7 +377,7 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 		return;
 	}
 
-	ssize_t r = recv(server->fd, remote->buf->data, BUF_SIZE, 0);
+	ssize_t r = buffer_recv(server->fd, remote->buf);
 	if (r == 0) {
 		// connection closed
 		if (verbose) {
@@ -299,13 +398,13 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 			return;
 		}
 	}
-	tx += r;
+	this_worker->tx += r;
 	remote->buf->len = r;
 
 	if (server->stage == STAGE_STREAM) {
 		ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-		int s = send(remote->fd, remote->buf->data, remote->buf->len, 0);
+		int s = buffer_send(remote->fd, remote->buf);
 		if (s == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
 				// no data, wait for send
@@ -354,7 +453,7 @@ static void server_send_cb(EV_P_ ev_io *w, int revents)
 		return;
 	} else {
 		// has data to send
-		ssize_t s = send(server->fd, server->buf->data + server->buf->idx, server->buf->len, 0);
+		ssize_t s = buffer_send(server->fd, server->buf);
 		if (s == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				perror("server_send_send");
@@ -405,7 +504,7 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 
 	ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-	ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+	ssize_t r = buffer_recv(remote->fd, server->buf);
 	if (r == 0) {
 		// connection closed
 		if (verbose) {
@@ -426,10 +525,10 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 			return;
 		}
 	}
-	rx += r;
+	this_worker->rx += r;
 	server->buf->len = r;
 
-	int s = send(server->fd, server->buf->data, server->buf->len, 0);
+	int s = buffer_send(server->fd, server->buf);
 	if (s == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			// no data, wait for send
@@ -509,7 +608,7 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 		return;
 	} else {
 		// has data to send
-		ssize_t s = send(remote->fd, remote->buf->data + remote->buf->idx, remote->buf->len, 0);
+		ssize_t s = buffer_send(remote->fd, remote->buf);
 		if (s == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				perror("remote_send_send");
@@ -539,7 +638,7 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 static remote_t *new_remote(int fd)
 {
 	if (verbose) {
-		remote_conn++;
+		stat_add(remote_conn, 1);
 	}
 
 	remote_t *remote = malloc(sizeof(remote_t));
@@ -547,9 +646,7 @@ static remote_t *new_remote(int fd)
 
 	remote->recv_ctx = malloc(sizeof(remote_ctx_t));
 	remote->send_ctx = malloc(sizeof(remote_ctx_t));
-	remote->buf = malloc(sizeof(buffer_t));
-	remote->buf->len = 0;
-	remote->buf->idx = 0;
+	remote->buf = new_buffer();
 	memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
 	memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
 	remote->fd                  = fd;
@@ -571,7 +668,7 @@ static void free_remote(remote_t *remote)
 		remote->server->remote = NULL;
 	}
 	if (remote->buf != NULL) {
-		free(remote->buf);
+		free_buffer(remote->buf);
 	}
 	free(remote->recv_ctx);
 	free(remote->send_ctx);
@@ -586,8 +683,7 @@ static void close_and_free_remote(EV_P_ remote_t *remote)
 		close(remote->fd);
 		free_remote(remote);
 		if (verbose) {
-			remote_conn--;
-			printf("current remote connection: %d\n", remote_conn);
+			printf("current remote connection: %d\n", stat_sub(remote_conn, 1));
 		}
 	}
 }
@@ -595,7 +691,7 @@ static void close_and_free_remote(EV_P_ remote_t *remote)
 static server_t *new_server(int fd, listen_ctx_t *listener)
 {
 	if (verbose) {
-		server_conn++;
+		stat_add(server_conn, 1);
 	}
 
 	server_t *server;
@@ -607,9 +703,7 @@ static server_t *new_server(int fd, listen_ctx_t *listener)
 	server->send_ctx   = malloc(sizeof(server_ctx_t));
 	memset(server->recv_ctx, 0, sizeof(server_ctx_t));
 	memset(server->send_ctx, 0, sizeof(server_ctx_t));
-	server->buf = malloc(sizeof(buffer_t));
-	server->buf->len = 0;
-	server->buf->idx = 0;
+	server->buf = new_buffer();
 	server->fd                  = fd;
 	server->recv_ctx->server    = server;
 	server->recv_ctx->connected = 0;
@@ -636,7 +730,7 @@ static void free_server(server_t *server)
 		server->remote->server = NULL;
 	}
 	if (server->buf != NULL) {
-		free(server->buf);
+		free_buffer(server->buf);
 	}
 
 	free(server->recv_ctx);
@@ -653,8 +747,7 @@ static void close_and_free_server(EV_P_ server_t *server)
 		close(server->fd);
 		free_server(server);
 		if (verbose) {
-			server_conn--;
-			printf("current server connection: %d\n", server_conn);
+			printf("current server connection: %d\n", stat_sub(server_conn, 1));
 		}
 	}
 }
@@ -750,6 +843,665 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 	}
 }
 
+#ifdef NATCAP_IO_URING
+/* io_uring relay (make IO_URING=1), run by each worker instead of its ev_loop:
+ * one multishot accept per listener, the recv()s pick their buffer from a provided
+ * buffer ring, and the send() of a chunk goes out with the next submit right after
+ * its recv completes, so a busy worker relays many chunks per io_uring_enter().
+ * the send can not be linked behind the recv as its length and buffer are only known
+ * from the recv completion. a connection is freed once its last op has completed.
+ * a direction holds at most one buffer (the next recv is only armed once its send is
+ * done), so the ring carries buf_num / 2 connections: past that the accepts are
+ * cancelled and the new connections wait in the listen backlog until some go away.
+ * on kernels without buffer rings (< 5.19) the worker falls back to libev.
+ */
+#define URING_ENTRIES 4096
+#define URING_BGID 0
+#define URING_BUF_MEM (8 * 1024 * 1024)
+#define URING_BACKOFF_MIN_MS 1
+#define URING_BACKOFF_MAX_MS 1000
+
+enum {
+	UOP_ACCEPT,
+	UOP_ACCEPT_RETRY,
+	UOP_ACCEPT_CANCEL,
+	UOP_CONNECT,
+	UOP_RECV,
+	UOP_SEND,
+	UOP_RETRY,
+};
+
+typedef struct uring_op {
+	int type;
+	int dir;
+	int fd; /* UOP_ACCEPT: the listener */
+	int deferred; /* on uring_ctx.deferred */
+	struct uring_conn *conn;
+	struct uring_op *next;
+} uring_op_t;
+
+typedef struct uring_dir {
+	int bid; /* the buffer on its way out, -1 for none */
+	int off;
+	int len;
+	int backoff_ms;
+	struct __kernel_timespec retry_ts; /* read by the kernel at submit time */
+	uring_op_t recv_op;
+	uring_op_t send_op;
+	uring_op_t retry_op;
+} uring_dir_t;
+
+typedef struct uring_listener {
+	int armed; /* the accept or its retry timeout is in flight */
+	int backoff_ms;
+	struct __kernel_timespec retry_ts;
+	uring_op_t accept_op;
+	uring_op_t retry_op;
+	uring_op_t cancel_op;
+} uring_listener_t;
+
+typedef struct uring_conn {
+	int fd[2]; /* [0] the accepted one, [1] the remote */
+	int inflight;
+	int closing;
+	int responded;
+	time_t active;
+	struct uring_conn *prev;
+	struct uring_conn *next;
+	struct sockaddr_storage dst;
+	uring_op_t connect_op;
+	uring_dir_t dir[2]; /* [0] fd[0] -> fd[1], [1] fd[1] -> fd[0] */
+} uring_conn_t;
+
+typedef struct uring_ctx {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	unsigned int buf_num;
+	int buf_mask;
+	int timeout;
+	int conn_num;
+	int conn_max;
+	int accept_paused;
+	int listen_num;
+	uring_conn_t conns; /* list head */
+	uring_op_t *deferred; /* ops that found the submission queue full */
+	uring_listener_t listener[MAX_REMOTE_NUM];
+} uring_ctx_t;
+
+/* double the delay on every retry in a row, the caller resets *backoff_ms on success */
+static void uring_backoff(struct __kernel_timespec *ts, int *backoff_ms)
+{
+	*backoff_ms = *backoff_ms ? min(*backoff_ms * 2, URING_BACKOFF_MAX_MS) : URING_BACKOFF_MIN_MS;
+	ts->tv_sec = *backoff_ms / 1000;
+	ts->tv_nsec = (long long)(*backoff_ms % 1000) * 1000 * 1000;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_ctx_t *ctx)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&ctx->ring);
+		sqe = io_uring_get_sqe(&ctx->ring);
+	}
+	return sqe;
+}
+
+/* -1 if the submission queue is still full after a submit, e.g. the completion queue overflowed */
+static int uring_prep(uring_ctx_t *ctx, uring_op_t *op)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ctx);
+	uring_conn_t *conn = op->conn;
+	uring_dir_t *ud = conn ? &conn->dir[op->dir] : NULL;
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	switch (op->type) {
+	case UOP_ACCEPT:
+		io_uring_prep_multishot_accept(sqe, op->fd, NULL, NULL, 0);
+		break;
+	case UOP_ACCEPT_RETRY:
+		io_uring_prep_timeout(sqe, &container_of(op, uring_listener_t, retry_op)->retry_ts, 0, 0);
+		break;
+	case UOP_ACCEPT_CANCEL:
+		io_uring_prep_cancel(sqe, &container_of(op, uring_listener_t, cancel_op)->accept_op, 0);
+		break;
+	case UOP_CONNECT:
+		io_uring_prep_connect(sqe, conn->fd[1], (struct sockaddr *)&conn->dst, sizeof(struct sockaddr_in));
+		break;
+	case UOP_RECV:
+		io_uring_prep_recv(sqe, conn->fd[op->dir], NULL, buf_size, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		break;
+	case UOP_SEND:
+		io_uring_prep_send(sqe, conn->fd[!op->dir], ctx->bufs + (size_t)ud->bid * buf_size + ud->off, ud->len, MSG_WAITALL | MSG_NOSIGNAL);
+		break;
+	case UOP_RETRY:
+		io_uring_prep_timeout(sqe, &ud->retry_ts, 0, 0);
+		break;
+	}
+	io_uring_sqe_set_data(sqe, op);
+	return 0;
+}
+
+/* an op that gets no sqe waits on ctx->deferred until the next completions are reaped,
+ * it keeps its conn->inflight reference and its listener armed meanwhile */
+static void uring_submit(uring_ctx_t *ctx, uring_op_t *op)
+{
+	if (op->deferred || uring_prep(ctx, op) == 0) {
+		return;
+	}
+	op->deferred = 1;
+	op->next = ctx->deferred;
+	ctx->deferred = op;
+}
+
+static void uring_accept(uring_ctx_t *ctx, uring_listener_t *l)
+{
+	uring_submit(ctx, &l->accept_op);
+	l->armed = 1;
+}
+
+static void uring_accept_retry(uring_ctx_t *ctx, uring_listener_t *l)
+{
+	uring_backoff(&l->retry_ts, &l->backoff_ms);
+	uring_submit(ctx, &l->retry_op);
+	l->armed = 1;
+}
+
+/* the cancelled accepts complete without IORING_CQE_F_MORE and are left disarmed */
+static void uring_accept_pause(uring_ctx_t *ctx)
+{
+	ctx->accept_paused = 1;
+	for (int i = 0; i < ctx->listen_num; i++) {
+		uring_submit(ctx, &ctx->listener[i].cancel_op);
+	}
+	if (verbose) {
+		printf("%d connections, out of buffers, accept paused\n", ctx->conn_num);
+	}
+}
+
+static void uring_accept_resume(uring_ctx_t *ctx)
+{
+	ctx->accept_paused = 0;
+	for (int i = 0; i < ctx->listen_num; i++) {
+		if (!ctx->listener[i].armed) {
+			uring_accept(ctx, &ctx->listener[i]);
+		}
+	}
+}
+
+static void uring_recv(uring_ctx_t *ctx, uring_conn_t *conn, int d)
+{
+	conn->inflight++;
+	uring_submit(ctx, &conn->dir[d].recv_op);
+}
+
+static void uring_send(uring_ctx_t *ctx, uring_conn_t *conn, int d)
+{
+	conn->inflight++;
+	uring_submit(ctx, &conn->dir[d].send_op);
+}
+
+static void uring_retry(uring_ctx_t *ctx, uring_conn_t *conn, int d)
+{
+	uring_dir_t *ud = &conn->dir[d];
+	uring_backoff(&ud->retry_ts, &ud->backoff_ms);
+	conn->inflight++;
+	uring_submit(ctx, &ud->retry_op);
+}
+
+static void uring_buf_recycle(uring_ctx_t *ctx, uring_dir_t *ud)
+{
+	if (ud->bid == -1) {
+		return;
+	}
+	io_uring_buf_ring_add(ctx->br, ctx->bufs + (size_t)ud->bid * buf_size, buf_size, ud->bid, ctx->buf_mask, 0);
+	io_uring_buf_ring_advance(ctx->br, 1);
+	ud->bid = -1;
+}
+
+/* the pending ops complete with an error or 0 after the shutdown */
+static void uring_conn_close(uring_conn_t *conn)
+{
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = 1;
+	shutdown(conn->fd[0], SHUT_RDWR);
+	shutdown(conn->fd[1], SHUT_RDWR);
+}
+
+static void uring_conn_put(uring_ctx_t *ctx, uring_conn_t *conn)
+{
+	if (--conn->inflight > 0 || !conn->closing) {
+		return;
+	}
+	uring_buf_recycle(ctx, &conn->dir[0]);
+	uring_buf_recycle(ctx, &conn->dir[1]);
+	close(conn->fd[0]);
+	close(conn->fd[1]);
+	conn->prev->next = conn->next;
+	conn->next->prev = conn->prev;
+	free(conn);
+	if (verbose) {
+		printf("current server connection: %d\n", stat_sub(server_conn, 1));
+	}
+	if (--ctx->conn_num <= ctx->conn_max * 3 / 4 && ctx->accept_paused) {
+		uring_accept_resume(ctx);
+	}
+}
+
+static void uring_accept_done(uring_ctx_t *ctx, int fd)
+{
+	uring_conn_t *conn;
+	struct addrinfo info;
+	struct sockaddr_storage storage;
+	int remotefd;
+#ifndef NATCAP_CLIENT_MODE
+	struct sockaddr_storage bind_storage;
+	struct sockaddr *bind_addr = NULL;
+#endif
+
+	int opt = 1;
+	setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	memset(&storage, 0, sizeof(struct sockaddr_storage));
+	if (getdestaddr(fd, &storage) != 0) {
+		perror("getdestaddr");
+		close(fd);
+		return;
+	}
+	memset(&info, 0, sizeof(struct addrinfo));
+	info.ai_family   = AF_INET;
+	info.ai_socktype = SOCK_STREAM;
+	info.ai_protocol = IPPROTO_TCP;
+	info.ai_addrlen  = sizeof(struct sockaddr_in);
+	info.ai_addr     = (struct sockaddr *)&storage;
+
+#ifdef NATCAP_CLIENT_MODE
+	remotefd = remote_socket(&info);
+#else
+	if (ito != 0) {
+		memset(&bind_storage, 0, sizeof(struct sockaddr_storage));
+		if (get_original_destaddr(fd, &bind_storage) != 0) {
+			perror("get_original_destaddr");
+			close(fd);
+			return;
+		}
+		bind_addr = (struct sockaddr *)&bind_storage;
+	}
+	remotefd = remote_socket(&info, bind_addr);
+#endif
+	if (remotefd == -1) {
+		close(fd);
+		return;
+	}
+
+	conn = calloc(1, sizeof(uring_conn_t));
+	conn->fd[0] = fd;
+	conn->fd[1] = remotefd;
+	conn->active = time(NULL);
+	memcpy(&conn->dst, &storage, sizeof(struct sockaddr_storage));
+	conn->connect_op.type = UOP_CONNECT;
+	conn->connect_op.conn = conn;
+	for (int d = 0; d < 2; d++) {
+		uring_dir_t *ud = &conn->dir[d];
+		ud->bid = -1;
+		ud->recv_op.type = UOP_RECV;
+		ud->send_op.type = UOP_SEND;
+		ud->retry_op.type = UOP_RETRY;
+		ud->recv_op.dir = ud->send_op.dir = ud->retry_op.dir = d;
+		ud->recv_op.conn = ud->send_op.conn = ud->retry_op.conn = conn;
+	}
+	conn->next = ctx->conns.next;
+	conn->prev = &ctx->conns;
+	conn->next->prev = conn;
+	ctx->conns.next = conn;
+	if (verbose) {
+		stat_add(server_conn, 1);
+		printf("accept a connection\n");
+	}
+	if (++ctx->conn_num >= ctx->conn_max && !ctx->accept_paused) {
+		uring_accept_pause(ctx);
+	}
+
+	conn->inflight++;
+	uring_submit(ctx, &conn->connect_op);
+}
+
+static void uring_handle(uring_ctx_t *ctx, struct io_uring_cqe *cqe)
+{
+	uring_op_t *op = io_uring_cqe_get_data(cqe);
+	uring_conn_t *conn;
+	uring_dir_t *ud;
+	uring_listener_t *l;
+	int res = cqe->res;
+
+	conn = op->conn;
+	ud = conn ? &conn->dir[op->dir] : NULL;
+
+	switch (op->type) {
+	case UOP_ACCEPT:
+		l = container_of(op, uring_listener_t, accept_op);
+		if (res >= 0) {
+			l->backoff_ms = 0;
+			uring_accept_done(ctx, res);
+		} else if (res != -ECANCELED) {
+			errno = -res;
+			perror("accept");
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			l->armed = 0;
+			if (ctx->accept_paused) {
+				return;
+			}
+			if (res < 0 && res != -ECANCELED) {
+				// e.g. out of fds, do not spin on it
+				uring_accept_retry(ctx, l);
+			} else {
+				uring_accept(ctx, l);
+			}
+		}
+		return;
+
+	case UOP_ACCEPT_RETRY:
+		l = container_of(op, uring_listener_t, retry_op);
+		l->armed = 0;
+		if (!ctx->accept_paused) {
+			uring_accept(ctx, l);
+		}
+		return;
+
+	case UOP_ACCEPT_CANCEL:
+		return;
+
+	case UOP_CONNECT:
+		if (res < 0) {
+			if (verbose) {
+				errno = -res;
+				perror("connect");
+			}
+			uring_conn_close(conn);
+		} else if (!conn->closing) {
+			if (verbose) {
+				printf("remote connected\n");
+			}
+			uring_recv(ctx, conn, 0);
+			uring_recv(ctx, conn, 1);
+		}
+		break;
+
+	case UOP_RECV:
+		if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+			ud->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			ud->off = 0;
+			ud->len = res;
+			ud->backoff_ms = 0;
+			conn->active = time(NULL);
+			if (op->dir == 0) {
+				this_worker->tx += res;
+			} else {
+				this_worker->rx += res;
+			}
+			if (conn->closing) {
+				uring_buf_recycle(ctx, ud);
+				break;
+			}
+			uring_send(ctx, conn, op->dir);
+
+			// Disable TCP_NODELAY after the first response are sent
+			if (op->dir == 1 && !conn->responded) {
+				int opt = 0;
+				setsockopt(conn->fd[0], SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+				setsockopt(conn->fd[1], SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+				conn->responded = 1;
+			}
+		} else if (res == -ENOBUFS && !conn->closing) {
+			// all buffers are on their way out, try again later and later
+			uring_retry(ctx, conn, op->dir);
+		} else {
+			uring_conn_close(conn);
+		}
+		break;
+
+	case UOP_SEND:
+		if (res <= 0) {
+			uring_buf_recycle(ctx, ud);
+			uring_conn_close(conn);
+		} else if (res < ud->len && !conn->closing) {
+			ud->off += res;
+			ud->len -= res;
+			uring_send(ctx, conn, op->dir);
+		} else {
+			uring_buf_recycle(ctx, ud);
+			if (!conn->closing) {
+				uring_recv(ctx, conn, op->dir);
+			}
+		}
+		break;
+
+	case UOP_RETRY:
+		if (!conn->closing) {
+			uring_recv(ctx, conn, op->dir);
+		}
+		break;
+	}
+
+	uring_conn_put(ctx, conn);
+}
+
+/* try the deferred ops again, drop the ones that are no longer wanted */
+static void uring_deferred_run(uring_ctx_t *ctx)
+{
+	uring_op_t *op = ctx->deferred;
+
+	ctx->deferred = NULL;
+	while (op != NULL) {
+		uring_op_t *next = op->next;
+
+		op->deferred = 0;
+		switch (op->type) {
+		case UOP_ACCEPT:
+			if (ctx->accept_paused) {
+				container_of(op, uring_listener_t, accept_op)->armed = 0;
+				op = NULL;
+			}
+			break;
+		case UOP_ACCEPT_RETRY:
+			if (ctx->accept_paused) {
+				container_of(op, uring_listener_t, retry_op)->armed = 0;
+				op = NULL;
+			}
+			break;
+		case UOP_ACCEPT_CANCEL:
+			if (!ctx->accept_paused) {
+				op = NULL;
+			}
+			break;
+		default:
+			if (op->conn->closing) {
+				uring_conn_put(ctx, op->conn);
+				op = NULL;
+			}
+			break;
+		}
+		if (op != NULL) {
+			uring_submit(ctx, op);
+		}
+		op = next;
+	}
+}
+
+static void uring_ctx_free(uring_ctx_t *ctx)
+{
+	if (ctx->br) {
+		io_uring_free_buf_ring(&ctx->ring, ctx->br, ctx->buf_num, URING_BGID);
+	}
+	io_uring_queue_exit(&ctx->ring);
+	free(ctx->bufs);
+	free(ctx);
+}
+
+/* returns -1 right away if io_uring can not be used here */
+static int uring_relay_run(worker_t *worker)
+{
+	int ret;
+	time_t last = 0;
+	uring_ctx_t *ctx = calloc(1, sizeof(uring_ctx_t));
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ctx->ring, 0);
+	if (ret < 0) {
+		printf("io_uring_queue_init: %s, using libev\n", strerror(-ret));
+		free(ctx);
+		return -1;
+	}
+
+	ctx->buf_num = URING_BUF_MEM / buf_size;
+	if (ctx->buf_num < 64) {
+		ctx->buf_num = 64;
+	} else if (ctx->buf_num > 32768) {
+		ctx->buf_num = 32768;
+	}
+	while (ctx->buf_num & (ctx->buf_num - 1)) {
+		ctx->buf_num &= ctx->buf_num - 1;
+	}
+	ctx->conn_max = ctx->buf_num / 2;
+	ctx->br = io_uring_setup_buf_ring(&ctx->ring, ctx->buf_num, URING_BGID, 0, &ret);
+	if (ctx->br == NULL) {
+		printf("io_uring_setup_buf_ring: %s, using libev\n", strerror(-ret));
+		uring_ctx_free(ctx);
+		return -1;
+	}
+	ctx->bufs = malloc((size_t)ctx->buf_num * buf_size);
+	if (ctx->bufs == NULL) {
+		uring_ctx_free(ctx);
+		return -1;
+	}
+	ctx->buf_mask = io_uring_buf_ring_mask(ctx->buf_num);
+	for (unsigned int i = 0; i < ctx->buf_num; i++) {
+		io_uring_buf_ring_add(ctx->br, ctx->bufs + (size_t)i * buf_size, buf_size, i, ctx->buf_mask, i);
+	}
+	io_uring_buf_ring_advance(ctx->br, ctx->buf_num);
+
+	ctx->conns.next = ctx->conns.prev = &ctx->conns;
+	ctx->listen_num = worker->listen_num;
+	for (int i = 0; i < worker->listen_num; i++) {
+		ctx->timeout = worker->listen_ctx[i].timeout;
+		ctx->listener[i].accept_op.type = UOP_ACCEPT;
+		ctx->listener[i].accept_op.fd = worker->listen_ctx[i].fd;
+		ctx->listener[i].retry_op.type = UOP_ACCEPT_RETRY;
+		ctx->listener[i].cancel_op.type = UOP_ACCEPT_CANCEL;
+		uring_accept(ctx, &ctx->listener[i]);
+	}
+
+	while (!__atomic_load_n(&worker->stopping, __ATOMIC_RELAXED)) {
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+		unsigned int head, count = 0;
+		time_t now;
+
+		uring_deferred_run(ctx);
+		ret = io_uring_submit_and_wait_timeout(&ctx->ring, &cqe, 1, &ts, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			printf("io_uring_submit_and_wait_timeout: %s\n", strerror(-ret));
+			break;
+		}
+		io_uring_for_each_cqe(&ctx->ring, head, cqe) {
+			uring_handle(ctx, cqe);
+			count++;
+		}
+		io_uring_cq_advance(&ctx->ring, count);
+
+		now = time(NULL);
+		if (now != last) {
+			last = now;
+			for (uring_conn_t *conn = ctx->conns.next; conn != &ctx->conns; conn = conn->next) {
+				if (!conn->closing && now - conn->active > ctx->timeout) {
+					if (verbose) {
+						printf("TCP connection timeout\n");
+					}
+					uring_conn_close(conn);
+				}
+			}
+		}
+	}
+
+	// the process is going away, no need to drain the ops
+	while (ctx->conns.next != &ctx->conns) {
+		uring_conn_t *conn = ctx->conns.next;
+		ctx->conns.next = conn->next;
+		close(conn->fd[0]);
+		close(conn->fd[1]);
+		free(conn);
+	}
+	uring_ctx_free(ctx);
+
+	return 0;
+}
+#endif
+
+static void worker_stop_cb(EV_P_ ev_async *w, int revents)
+{
+	ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void *worker_run(void *arg)
+{
+	worker_t *worker = (worker_t *)arg;
+
+	this_worker = worker;
+
+	if (worker->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(worker->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+			printf("worker failed to pin to cpu %d\n", worker->cpu);
+		}
+	}
+
+#ifdef NATCAP_IO_URING
+	if (uring_relay_run(worker) == 0) {
+		return NULL;
+	}
+#endif
+	ev_run(worker->loop, 0);
+
+	return NULL;
+}
+
+/* @cpu: the cpu the accepting loop runs on, -1 for any */
+static void listen_ctx_setup(struct ev_loop *loop, listen_ctx_t *listen_ctx, const char *host, const char *port, int timeout, int cpu)
+{
+	// Bind to port
+	int listenfd;
+	listenfd = create_and_bind(host, port);
+	if (listenfd == -1) {
+		FATAL("bind() error");
+	}
+#ifdef SO_INCOMING_CPU
+	// with SO_REUSEPORT the kernel prefers the listener on the cpu that got the SYN
+	if (cpu >= 0 && setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+		perror("setsockopt SO_INCOMING_CPU");
+	}
+#endif
+	if (listen(listenfd, MAXCONN) == -1) {
+		FATAL("listen() error");
+	}
+	setnonblocking(listenfd);
+
+	// Setup proxy context
+	listen_ctx->timeout = timeout;
+	listen_ctx->fd      = listenfd;
+	listen_ctx->loop    = loop;
+
+	ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
+	ev_io_start(loop, &listen_ctx->io);
+}
+
 void usage()
 {
 	printf("\n");
@@ -762,6 +1514,11 @@ void usage()
 	printf("       [-I]                       Bind input as output interface\n");
 #endif
 	printf("       [-t <timeout>]             Socket timeout in seconds.\n");
+	printf("       [-w <workers>]             Accept and relay on this many threads, each with\n");
+	printf("                                  its own event loop and SO_REUSEPORT listener.\n");
+	printf("       [-a]                       Pin the workers to cpus (SO_INCOMING_CPU).\n");
+	printf("       [-z]                       Relay with splice() through a pipe per direction.\n");
+	printf("       [-b <buf_size>]            Relay buffer size in bytes for the copy and io_uring paths (default %d).\n", BUF_SIZE);
 	printf("       [-v]                       Verbose mode.\n");
 	printf("       [-h, --help]               Print this message.\n");
 	printf("\n");
@@ -779,9 +1536,9 @@ int main(int argc, char **argv)
 	opterr = 0;
 
 #ifdef NATCAP_CLIENT_MODE
-	while ((c = getopt_long(argc, argv, "s:l:t:hv", NULL, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "s:l:t:w:azb:hv", NULL, NULL)) != -1) {
 #else
-	while ((c = getopt_long(argc, argv, "s:l:It:hv", NULL, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "s:l:It:w:azb:hv", NULL, NULL)) != -1) {
 #endif
 		switch (c) {
 		case 's':
@@ -800,6 +1557,18 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = optarg;
 			break;
+		case 'w':
+			worker_num = atoi(optarg);
+			break;
+		case 'a':
+			worker_affinity = 1;
+			break;
+		case 'z':
+			use_splice = 1;
+			break;
+		case 'b':
+			buf_size = atoi(optarg);
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -826,6 +1595,28 @@ int main(int argc, char **argv)
 		timeout = "60";
 	}
 
+	if (buf_size < BUF_SIZE) {
+		buf_size = BUF_SIZE;
+	} else if (buf_size > MAX_BUF_SIZE) {
+		buf_size = MAX_BUF_SIZE;
+	}
+
+#ifdef NATCAP_IO_URING
+	// the io_uring loop runs in the workers
+	if (worker_num <= 0) {
+		worker_num = 1;
+	}
+#endif
+	if (worker_num < 0) {
+		worker_num = 0;
+	} else if (worker_num > MAX_WORKER_NUM) {
+		worker_num = MAX_WORKER_NUM;
+	}
+	if (worker_num > 0) {
+		// the workers share the port
+		reuse_port = 1;
+	}
+
 	// ignore SIGPIPE
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGABRT, SIG_IGN);
@@ -842,34 +1633,52 @@ int main(int argc, char **argv)
 
 	// initialize listen context
 	listen_ctx_t listen_ctx_list[server_num];
+	worker_t *workers = NULL;
 
-	// bind to each interface
-	for (int i = 0; i < server_num; i++) {
-		const char *host = server_host[i];
-
-		// Bind to port
-		int listenfd;
-		listenfd = create_and_bind(host, server_port);
-		if (listenfd == -1) {
-			FATAL("bind() error");
+	if (worker_num == 0) {
+		// bind to each interface
+		for (int i = 0; i < server_num; i++) {
+			listen_ctx_setup(loop, &listen_ctx_list[i], server_host[i], server_port, atoi(timeout), -1);
 		}
-		if (listen(listenfd, MAXCONN) == -1) {
-			FATAL("listen() error");
+	} else {
+		long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+
+		workers = calloc(worker_num, sizeof(worker_t));
+		if (workers == NULL) {
+			FATAL("calloc() error");
 		}
-		setnonblocking(listenfd);
-		listen_ctx_t *listen_ctx = &listen_ctx_list[i];
+		for (int w = 0; w < worker_num; w++) {
+			worker_t *worker = &workers[w];
 
-		// Setup proxy context
-		listen_ctx->timeout = atoi(timeout);
-		listen_ctx->fd      = listenfd;
-		listen_ctx->loop    = loop;
+			worker->loop = ev_loop_new(EVFLAG_AUTO);
+			if (worker->loop == NULL) {
+				FATAL("ev_loop_new() error");
+			}
+			worker->cpu = (worker_affinity && cpu_num > 0) ? w % cpu_num : -1;
 
-		ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
-		ev_io_start(loop, &listen_ctx->io);
+			// bind to each interface
+			for (int i = 0; i < server_num; i++) {
+				listen_ctx_setup(worker->loop, &worker->listen_ctx[i], server_host[i], server_port, atoi(timeout), worker->cpu);
+			}
+			worker->listen_num = server_num;
 
-		printf("tcp server listening at %s:%s\n", host ? host : "0.0.0.0", server_port);
+			ev_async_init(&worker->stop, worker_stop_cb);
+			ev_async_start(worker->loop, &worker->stop);
+		}
 	}
 
+	for (int i = 0; i < server_num; i++) {
+		printf("tcp server listening at %s:%s\n", server_host[i] ? server_host[i] : "0.0.0.0", server_port);
+	}
+
+	for (int w = 0; w < worker_num; w++) {
+		if (pthread_create(&workers[w].tid, NULL, worker_run, &workers[w]) != 0) {
+			FATAL("pthread_create() error");
+		}
+	}
+	if (worker_num > 0) {
+		printf("%d workers started%s\n", worker_num, worker_affinity ? " with cpu affinity" : "");
+	}
 
 	if (geteuid() == 0) {
 		printf("running from root user\n");
@@ -878,16 +1687,41 @@ int main(int argc, char **argv)
 	// start ev loop
 	ev_run(loop, 0);
 
+	for (int w = 0; w < worker_num; w++) {
+		__atomic_store_n(&workers[w].stopping, 1, __ATOMIC_RELAXED);
+		ev_async_send(workers[w].loop, &workers[w].stop);
+	}
+	for (int w = 0; w < worker_num; w++) {
+		pthread_join(workers[w].tid, NULL);
+	}
+
 	if (verbose) {
-		printf("closed gracefully\n");
+		unsigned long long tx = main_worker.tx, rx = main_worker.rx;
+		for (int w = 0; w < worker_num; w++) {
+			tx += workers[w].tx;
+			rx += workers[w].rx;
+		}
+		printf("closed gracefully, tx=%llu rx=%llu\n", tx, rx);
 	}
 
 	// Clean up
-	for (int i = 0; i < server_num; i++) {
-		listen_ctx_t *listen_ctx = &listen_ctx_list[i];
-		ev_io_stop(loop, &listen_ctx->io);
-		close(listen_ctx->fd);
+	if (worker_num == 0) {
+		for (int i = 0; i < server_num; i++) {
+			listen_ctx_t *listen_ctx = &listen_ctx_list[i];
+			ev_io_stop(loop, &listen_ctx->io);
+			close(listen_ctx->fd);
+		}
+	}
+	for (int w = 0; w < worker_num; w++) {
+		worker_t *worker = &workers[w];
+		for (int i = 0; i < worker->listen_num; i++) {
+			listen_ctx_t *listen_ctx = &worker->listen_ctx[i];
+			ev_io_stop(worker->loop, &listen_ctx->io);
+			close(listen_ctx->fd);
+		}
+		ev_loop_destroy(worker->loop);
 	}
+	free(workers);
 
 	return 0;
 }
@@ -4,13 +4,20 @@
 #include <stddef.h>
 #include <time.h>
 #include <ev.h>
+#include <pthread.h>
 #include "natcap.h"
 
+#define MAX_REMOTE_NUM 10
+#define MAX_WORKER_NUM 64
+
 typedef struct {
 	int idx;
 	int len;
+	int pipe[2]; /* splice relay, -1 when going through data */
 #define BUF_SIZE 2048
-	unsigned char data[BUF_SIZE];
+#define MAX_BUF_SIZE (1024 * 1024)
+#define SPLICE_SIZE (64 * 1024) /* the default pipe capacity */
+	unsigned char *data;
 } buffer_t;
 
 typedef struct listen_ctx {
@@ -20,6 +27,18 @@ typedef struct listen_ctx {
 	struct ev_loop *loop;
 } listen_ctx_t;
 
+typedef struct worker {
+	pthread_t tid;
+	int cpu;
+	int listen_num;
+	int stopping;
+	unsigned long tx; /* relayed bytes, only touched by the worker itself */
+	unsigned long rx;
+	struct ev_loop *loop;
+	ev_async stop;
+	listen_ctx_t listen_ctx[MAX_REMOTE_NUM];
+} worker_t;
+
 typedef struct server_ctx {
 	ev_io io;
 	ev_timer watcher;
@@ -71,7 +90,6 @@ typedef struct remote {
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 
 #define MAX_REQUEST_TIMEOUT 30
-#define MAX_REMOTE_NUM 10
 
 void
 FATAL(const char *msg)
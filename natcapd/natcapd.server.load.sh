@@ -7,5 +7,7 @@ cd -
 
 test -c /dev/natcap_ctl && echo natcap_redirect_port=1080 >/dev/natcap_ctl
 ulimit -n 100000
-$vmroot/natcapd-server -t 900
+workers=`grep -c ^processor /proc/cpuinfo 2>/dev/null`
+test -n "$workers" || workers=1
+$vmroot/natcapd-server -t 900 -w $workers -a -z
 test -c /dev/natcap_ctl && echo natcap_redirect_port=0 >/dev/natcap_ctl